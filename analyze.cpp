@@ -0,0 +1,457 @@
+#include <midi/analyze.h>
+#include <midi/tempo.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace midi {
+
+typedef struct track_cursor {
+	const uint8_t *ptr;
+	const uint8_t *end;
+	uint32_t next_tick;
+	uint8_t running;
+	bool active;
+} track_cursor_t;
+
+void analyze_file(const void *data, size_t size, file_stats_t &stats){
+	memset(&stats, 0, sizeof(stats));
+
+	if (size < sizeof(file_t)){
+		throw "too short to be a MIDI file";
+	}
+
+	file f(data);
+	std::vector<track> tracks = f.checked_tracks(size);
+	std::vector<track_cursor_t> cursors;
+	tempo_map clock(f);
+
+	bool held[16][128];
+	uint16_t playing[16] = {0};
+	uint32_t tick = 0;
+	uint64_t now = 0;
+
+	memset(held, 0, sizeof(held));
+	stats.tracks = tracks.size();
+	stats.tempo_changes = clock.changes();
+
+	for (auto &x : tracks) {
+		track_cursor_t c = {x.start(), x.end(), 0, 0, x.start() < x.end()};
+
+		if (c.active){
+			c.next_tick = var_field(c.ptr).num;
+		}
+
+		cursors.push_back(c);
+	}
+
+	// same order the player would see things in, by tick and then by track
+	for (;;) {
+		track_cursor_t *next = NULL;
+
+		for (auto &c : cursors) {
+			if (c.active && (!next || c.next_tick < next->next_tick)){
+				next = &c;
+			}
+		}
+
+		if (!next){
+			break;
+		}
+
+		if (next->next_tick != tick){
+			uint64_t then = clock.usecs(next->next_tick);
+
+			for (unsigned k = 0; k < 16; k++) {
+				stats.note_usecs[k] += (double)playing[k] * (then - now);
+			}
+
+			tick = next->next_tick;
+			now = then;
+		}
+
+		event ev(next->ptr, next->running);
+		uint32_t type = ev.type();
+
+		if (type == EVENT_UNKNOWN){
+			stats.undecoded_tracks++;
+			next->active = false;
+			continue;
+		}
+
+		if (type == EVENT_META_TRACK_END){
+			next->active = false;
+			continue;
+		}
+
+		next->ptr += ev.length(type);
+
+		if (next->ptr > next->end){
+			throw "event runs past the end of its track";
+		}
+
+		stats.events[type]++;
+		stats.ticks = tick;
+
+		if (ev.status < 0xf0){
+			next->running = ev.status;
+		}
+
+		if (type == EVENT_MIDI_NOTE_ON || type == EVENT_MIDI_NOTE_OFF){
+			uint8_t  channel  = ev.midi_channel();
+			uint16_t mdata    = ev.midi_data(type);
+			uint8_t  key      = mdata & 0x7f;
+			bool     on       = type == EVENT_MIDI_NOTE_ON && (mdata >> 7);
+
+			if (on && !held[channel][key]){
+				playing[channel]++;
+
+				if (playing[channel] > stats.peak_polyphony[channel]){
+					stats.peak_polyphony[channel] = playing[channel];
+				}
+
+			} else if (!on && held[channel][key]){
+				playing[channel]--;
+			}
+
+			held[channel][key] = on;
+
+		} else if (type == EVENT_MIDI_PROC_CHANGE){
+			uint8_t program = ev.midi_data(type) & 0x7f;
+			stats.programs[program >> 6] |= 1ULL << (program & 63);
+		}
+
+		if (next->ptr < next->end){
+			next->next_tick += var_field(next->ptr).num;
+		} else {
+			next->active = false;
+		}
+	}
+
+	stats.usecs = now;
+}
+
+// minimal JSON string escaping, paths are the only strings we don't control
+static std::string json_string(const std::string &str){
+	std::string ret = "\"";
+
+	for (unsigned char c : str) {
+		if (c == '"' || c == '\\'){
+			ret += '\\';
+			ret += c;
+
+		} else if (c < 0x20){
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			ret += buf;
+
+		} else {
+			ret += c;
+		}
+	}
+
+	return ret + "\"";
+}
+
+// fields shared between per-file lines and the summary
+static std::string json_stats(const file_stats_t &stats, const char *programs){
+	std::string ret;
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "\"duration\":%.3f,\"ticks\":%u,",
+	         stats.usecs / 1e6, stats.ticks);
+	ret += buf;
+	ret += "\"events\":{";
+
+	bool first = true;
+
+	for (unsigned i = 0; i < EVENT_END; i++) {
+		if (stats.events[i]){
+			snprintf(buf, sizeof(buf), "%s\"%s\":%llu", first? "" : ",",
+			         midi_event_string(i), (unsigned long long)stats.events[i]);
+			ret += buf;
+			first = false;
+		}
+	}
+
+	snprintf(buf, sizeof(buf), "},\"tempo_changes\":%u,\"programs\":",
+	         stats.tempo_changes);
+	ret += buf;
+	ret += programs;
+	ret += ",\"peak_polyphony\":[";
+
+	for (unsigned k = 0; k < 16; k++) {
+		snprintf(buf, sizeof(buf), "%s%u", k? "," : "", stats.peak_polyphony[k]);
+		ret += buf;
+	}
+
+	ret += "],\"mean_polyphony\":[";
+
+	for (unsigned k = 0; k < 16; k++) {
+		double mean = stats.usecs? stats.note_usecs[k] / stats.usecs : 0;
+		snprintf(buf, sizeof(buf), "%s%.2f", k? "," : "", mean);
+		ret += buf;
+	}
+
+	return ret + "]";
+}
+
+corpus_analyzer::corpus_analyzer(unsigned nworkers, int fd)
+	: out(fd)
+{
+	memset(&totals, 0, sizeof(totals));
+	memset(program_files, 0, sizeof(program_files));
+
+	if (nworkers == 0){
+		nworkers = 1;
+	}
+
+	max_pending = nworkers * 4;
+
+	for (unsigned i = 0; i < nworkers; i++) {
+		workers.push_back(std::thread(&corpus_analyzer::worker, this));
+	}
+}
+
+corpus_analyzer::~corpus_analyzer(){
+	if (!done){
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			done = true;
+			pending.clear();
+		}
+
+		queued.notify_all();
+
+		for (auto &x : workers) {
+			x.join();
+		}
+	}
+}
+
+void corpus_analyzer::add(std::string path){
+	struct stat st;
+
+	if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)){
+		add_tree(path);
+	} else {
+		enqueue(path);
+	}
+}
+
+static bool midi_extension(const char *name){
+	const char *ext = strrchr(name, '.');
+
+	return ext && (strcasecmp(ext, ".mid") == 0
+	               || strcasecmp(ext, ".midi") == 0
+	               || strcasecmp(ext, ".smf") == 0);
+}
+
+void corpus_analyzer::add_tree(const std::string &path){
+	DIR *dir = opendir(path.c_str());
+
+	if (!dir){
+		enqueue(path);
+		return;
+	}
+
+	struct dirent *ent;
+
+	while ((ent = readdir(dir))) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0){
+			continue;
+		}
+
+		std::string sub = path + "/" + ent->d_name;
+		struct stat st;
+
+		if (stat(sub.c_str(), &st) < 0){
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)){
+			add_tree(sub);
+
+		} else if (S_ISREG(st.st_mode) && midi_extension(ent->d_name)){
+			enqueue(sub);
+		}
+	}
+
+	closedir(dir);
+}
+
+void corpus_analyzer::enqueue(const std::string &path){
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		dequeued.wait(guard, [this]{ return pending.size() < max_pending; });
+		pending.push_back(path);
+	}
+
+	queued.notify_one();
+}
+
+// maps the file in and out again, returns a JSON line for it
+static std::string analyze_path(const std::string &path, file_stats_t &stats,
+                                bool &ok)
+{
+	std::string line = "{\"file\":" + json_string(path) + ",";
+	const char *error = NULL;
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat st;
+
+	ok = false;
+
+	if (fd < 0 || fstat(fd, &st) < 0){
+		error = "could not open file";
+
+	} else if (st.st_size == 0){
+		error = "empty file";
+
+	} else {
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (data == MAP_FAILED){
+			error = "could not map file";
+
+		} else {
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+			try {
+				analyze_file(data, st.st_size, stats);
+				ok = true;
+			} catch (const char *msg) {
+				error = msg;
+			}
+
+			munmap(data, st.st_size);
+		}
+	}
+
+	if (fd >= 0){
+		close(fd);
+	}
+
+	if (!ok){
+		return line + "\"error\":" + json_string(error) + "}\n";
+	}
+
+	std::string programs = "[";
+
+	for (unsigned i = 0; i < 128; i++) {
+		if (stats.programs[i >> 6] & (1ULL << (i & 63))){
+			programs += (programs.size() > 1? "," : "") + std::to_string(i);
+		}
+	}
+
+	char buf[64];
+	snprintf(buf, sizeof(buf), "\"tracks\":%u,\"undecoded_tracks\":%u,",
+	         stats.tracks, stats.undecoded_tracks);
+
+	return line + buf + json_stats(stats, (programs + "]").c_str()) + "}\n";
+}
+
+void corpus_analyzer::worker(void){
+	file_stats_t stats;
+
+	for (;;) {
+		std::string path;
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			queued.wait(guard, [this]{ return done || !pending.empty(); });
+
+			if (pending.empty()){
+				return;
+			}
+
+			path = pending.front();
+			pending.pop_front();
+		}
+
+		dequeued.notify_one();
+
+		bool ok;
+		std::string line = analyze_path(path, stats, ok);
+
+		std::lock_guard<std::mutex> guard(lock);
+		files++;
+
+		try {
+			out.put(line.data(), line.size());
+		} catch (const char *) {
+			// nowhere to report it, the summary will fail the same way
+		}
+
+		if (ok){
+			merge(stats);
+		} else {
+			failed++;
+		}
+	}
+}
+
+void corpus_analyzer::merge(const file_stats_t &stats){
+	totals.usecs += stats.usecs;
+	totals.ticks += stats.ticks;
+	totals.tempo_changes += stats.tempo_changes;
+
+	for (unsigned i = 0; i < EVENT_END; i++) {
+		totals.events[i] += stats.events[i];
+	}
+
+	for (unsigned k = 0; k < 16; k++) {
+		if (stats.peak_polyphony[k] > totals.peak_polyphony[k]){
+			totals.peak_polyphony[k] = stats.peak_polyphony[k];
+		}
+
+		totals.note_usecs[k] += stats.note_usecs[k];
+	}
+
+	for (unsigned i = 0; i < 128; i++) {
+		if (stats.programs[i >> 6] & (1ULL << (i & 63))){
+			program_files[i]++;
+		}
+	}
+}
+
+uint64_t corpus_analyzer::finish(void){
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done = true;
+	}
+
+	queued.notify_all();
+
+	for (auto &x : workers) {
+		x.join();
+	}
+
+	// programs are counted by the number of files using them here
+	std::string programs = "{";
+
+	for (unsigned i = 0; i < 128; i++) {
+		if (program_files[i]){
+			programs += (programs.size() > 1? ",\"" : "\"") + std::to_string(i)
+			          + "\":" + std::to_string(program_files[i]);
+		}
+	}
+
+	char buf[96];
+	snprintf(buf, sizeof(buf), "{\"summary\":{\"files\":%llu,\"failed\":%llu,",
+	         (unsigned long long)files, (unsigned long long)failed);
+
+	std::string line = buf + json_stats(totals, (programs + "}").c_str()) + "}}\n";
+	out.put(line.data(), line.size());
+	out.flush();
+
+	return failed;
+}
+
+// namespace midi
+}
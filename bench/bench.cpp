@@ -0,0 +1,370 @@
+#include "workload.h"
+
+#include <midi/midi.h>
+#include <midi/log.h>
+#include <midi/player.h>
+#include <midi/pullsynth.h>
+#include <midi/wavsynth.h>
+#include <midi/master.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace midi;
+
+typedef struct bench_result {
+	std::string name;
+	std::string unit;
+	double ns_per_op;
+	uint64_t ops;
+} bench_result_t;
+
+// a batch of work, returns how many units it did
+typedef std::function<uint64_t(void)> bench_fn;
+
+static double min_time = 0.25;
+static unsigned repeats = 5;
+static const char *filter = NULL;
+static std::vector<bench_result_t> results;
+
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs batches until min_time has passed, a few times over, and keeps the
+// best rate. The best run is the one least disturbed by everything else on
+// the machine, which is what makes runs comparable.
+static void measure(std::string name, std::string unit, bench_fn fn){
+	if (filter && name.find(filter) == std::string::npos){
+		return;
+	}
+
+	double best = 0;
+	uint64_t total = 0;
+
+	// warm up caches and anything lazily initialized
+	fn();
+
+	for (unsigned r = 0; r < repeats; r++) {
+		uint64_t ops = 0;
+		double start = now();
+		double elapsed;
+
+		do {
+			ops += fn();
+			elapsed = now() - start;
+		} while (elapsed < min_time);
+
+		double ns = elapsed * 1e9 / ops;
+		best = (r == 0 || ns < best)? ns : best;
+		total += ops;
+	}
+
+	results.push_back({name, unit, best, total});
+	printf("%-28s %12.2f ns/%s\n", name.c_str(), best, unit.c_str());
+	fflush(stdout);
+}
+
+// sink for results which would otherwise be optimized out
+static volatile uint64_t sink;
+
+static void bench_decode(const std::vector<uint8_t> &smf){
+	file f(smf.data());
+	std::vector<track> tracks = f.checked_tracks(smf.size());
+
+	measure("decode/type_length", "event", [&]{
+		uint64_t count = 0;
+		uint64_t acc = 0;
+
+		for (auto &x : tracks) {
+			const uint8_t *ptr = x.start();
+			uint8_t running = 0;
+
+			while (ptr < x.end()) {
+				event ev(ptr, running);
+				uint32_t type = ev.type();
+
+				if (type == EVENT_UNKNOWN || type == EVENT_META_TRACK_END){
+					break;
+				}
+
+				if (ev.status < 0xf0){
+					running = ev.status;
+				}
+
+				acc += type;
+				ptr += ev.length(type);
+				count++;
+			}
+		}
+
+		sink = acc;
+		return count;
+	});
+}
+
+// track merging and event handling, without any rendering
+static void bench_sequence(const std::vector<uint8_t> &smf){
+	file f(smf.data());
+	player seq(f);
+	uint64_t events = 0;
+
+	for (unsigned i = 0; i < f.tracks(); i++) {
+		track trk = f.get_track(i);
+
+		for (const uint8_t *ptr = trk.start(); ptr < trk.end(); events++) {
+			event ev(ptr);
+
+			if (ev.type() == EVENT_META_TRACK_END){
+				break;
+			}
+
+			ptr += ev.length();
+		}
+	}
+
+	measure("sequence/merge", "event", [&]{
+		seq.seek(UINT64_MAX / 2);
+		return events;
+	});
+}
+
+// renders a whole workload through the pull backend
+static void bench_render(std::string name, const std::vector<uint8_t> &smf,
+                         bool cheap = false)
+{
+	file f(smf.data());
+	player seq(f);
+	pullsynth syn(&seq, 44100);
+	std::vector<float> buf(SYNTH_BLOCK_SIZE * SYNTH_CHANNELS);
+
+	seq.set_synth(&syn);
+
+	measure(name, "frame", [&]{
+		uint64_t frames = 0;
+		uint32_t n;
+
+		seq.seek(0);
+		syn.reset();
+
+		if (cheap){
+			syn.set_quality({SYNTH_MAX_VOICES, 0, true, false});
+		}
+
+		do {
+			syn.set_target(buf.data());
+			n = seq.step(SYNTH_BLOCK_SIZE);
+			frames += n;
+		} while (n > 0);
+
+		return frames;
+	});
+}
+
+static void bench_master(std::string name, unsigned effect){
+	master_chain master(44100, SYNTH_BLOCK_SIZE);
+	std::vector<float> left(SYNTH_BLOCK_SIZE), right(SYNTH_BLOCK_SIZE);
+	uint32_t state = 1;
+
+	master.set_effect(effect);
+
+	measure(name, "frame", [&]{
+		// loud enough to keep the limiter busy
+		for (unsigned i = 0; i < SYNTH_BLOCK_SIZE; i++) {
+			state = state * 1103515245 + 12345;
+			left[i] = ((int)(state >> 16) - 0x8000) / 16384.0;
+			right[i] = -left[i];
+		}
+
+		master.process(left.data(), right.data(), SYNTH_BLOCK_SIZE);
+		return SYNTH_BLOCK_SIZE;
+	});
+}
+
+// silence, so this is the cost of conversion and writing plus an empty
+// render and the master chain
+static void bench_wav(const char *path){
+	player seq;
+	wavsynth syn(&seq, 44100);
+
+	seq.set_synth(&syn);
+	syn.open(path);
+
+	measure("output/wav", "frame", [&]{
+		syn.output(SYNTH_BLOCK_SIZE * 16);
+		return SYNTH_BLOCK_SIZE * 16;
+	});
+
+	syn.close();
+}
+
+static void write_json(const char *path){
+	FILE *fp = strcmp(path, "-") == 0? stdout : fopen(path, "w");
+
+	if (!fp){
+		throw "could not open JSON output";
+	}
+
+	fprintf(fp, "{\"version\":1,\"min_time\":%g,\"repeats\":%u,\"results\":[",
+	        min_time, repeats);
+
+	for (size_t i = 0; i < results.size(); i++) {
+		bench_result_t &r = results[i];
+
+		fprintf(fp, "%s\n {\"name\":\"%s\",\"unit\":\"%s\",\"ns_per_op\":%.3f,"
+		            "\"ops_per_sec\":%.1f,\"ops\":%llu}",
+		        i? "," : "", r.name.c_str(), r.unit.c_str(), r.ns_per_op,
+		        1e9 / r.ns_per_op, (unsigned long long)r.ops);
+	}
+
+	fprintf(fp, "\n]}\n");
+
+	if (fp != stdout){
+		fclose(fp);
+	}
+}
+
+static void usage(void){
+	puts("usage:");
+	puts("    bench [--json output] [--min-time seconds] [--repeats n] [--filter name]");
+	puts("    bench gen [--tracks n] [--polyphony n] [--drums per beat]");
+	puts("              [--tempo-changes per minute] [--seconds n] [--program n]");
+	puts("              [--seed n] output.mid");
+}
+
+static int generate(int argc, char **argv){
+	workload_params_t params;
+	const char *out = NULL;
+
+	for (int i = 2; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if      (arg == "--tracks" && has_value)        params.tracks = atoi(argv[++i]);
+		else if (arg == "--polyphony" && has_value)     params.polyphony = atoi(argv[++i]);
+		else if (arg == "--drums" && has_value)         params.drums = atoi(argv[++i]);
+		else if (arg == "--tempo-changes" && has_value) params.tempo_changes = atoi(argv[++i]);
+		else if (arg == "--seconds" && has_value)       params.seconds = atoi(argv[++i]);
+		else if (arg == "--program" && has_value)       params.program = atoi(argv[++i]);
+		else if (arg == "--seed" && has_value)          params.seed = atoi(argv[++i]);
+		else if (arg[0] != '-' && !out)                 out = argv[i];
+		else {
+			usage();
+			return 1;
+		}
+	}
+
+	if (!out){
+		usage();
+		return 1;
+	}
+
+	std::vector<uint8_t> smf = generate_workload(params);
+	FILE *fp = fopen(out, "wb");
+
+	if (!fp || fwrite(smf.data(), 1, smf.size(), fp) != smf.size()){
+		fprintf(stderr, "error: could not write %s\n", out);
+		return 1;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+int main(int argc, char **argv){
+	const char *json = NULL;
+
+	log_level = LOG_WARN;
+
+	if (argc > 1 && strcmp(argv[1], "gen") == 0){
+		return generate(argc, argv);
+	}
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if      (arg == "--json" && has_value)     json = argv[++i];
+		else if (arg == "--min-time" && has_value) min_time = atof(argv[++i]);
+		else if (arg == "--repeats" && has_value)  repeats = atoi(argv[++i]);
+		else if (arg == "--filter" && has_value)   filter = argv[++i];
+		else {
+			usage();
+			return 1;
+		}
+	}
+
+	repeats = repeats? repeats : 1;
+
+	try {
+		workload_params_t big;
+		big.tracks = 16;
+		big.polyphony = 6;
+		big.drums = 4;
+		big.tempo_changes = 30;
+		big.seconds = 120;
+
+		std::vector<uint8_t> events = generate_workload(big);
+		bench_decode(events);
+		bench_sequence(events);
+
+		// one family per run, 8 voices held throughout
+		static const struct { const char *name; int program; } kernels[] = {
+			{"organ", 16}, {"guitar", 24}, {"bass", 32}, {"ensemble", 48},
+			{"lead", 80}, {"pad", 88},
+		};
+
+		for (auto &k : kernels) {
+			workload_params_t p;
+			p.tracks = 1;
+			p.polyphony = 8;
+			p.drums = 0;
+			p.seconds = 5;
+			p.program = k.program;
+
+			bench_render(std::string("instrument/") + k.name, generate_workload(p));
+		}
+
+		workload_params_t square;
+		square.tracks = 1;
+		square.polyphony = 8;
+		square.drums = 0;
+		square.seconds = 5;
+		bench_render("instrument/cheap_square", generate_workload(square), true);
+
+		workload_params_t drums;
+		drums.tracks = 0;
+		drums.drums = 8;
+		drums.seconds = 5;
+		bench_render("percussion", generate_workload(drums));
+
+		bench_master("master/limiter", MASTER_EFFECT_NONE);
+		bench_master("master/reverb", MASTER_EFFECT_REVERB);
+		bench_wav("/dev/null");
+
+		workload_params_t mixed;
+		mixed.tracks = 8;
+		mixed.polyphony = 4;
+		mixed.drums = 2;
+		mixed.tempo_changes = 4;
+		mixed.seconds = 10;
+		bench_render("render/mixed", generate_workload(mixed));
+
+	} catch (const char *msg) {
+		fprintf(stderr, "error: %s\n", msg);
+		return 1;
+	}
+
+	if (json){
+		write_json(json);
+	}
+
+	return 0;
+}
@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+# Compares two result files from `bench --json`, and exits with status 1 if
+# anything got slower than the baseline by more than the threshold.
+#
+#     bench/compare.py [--threshold 0.10] baseline.json current.json
+
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return {r["name"]: r for r in json.load(f)["results"]}
+
+
+def main(argv):
+    threshold = 0.10
+    args = argv[1:]
+
+    if len(args) >= 2 and args[0] == "--threshold":
+        threshold = float(args[1])
+        args = args[2:]
+
+    if len(args) != 2:
+        print("usage: compare.py [--threshold fraction] baseline.json current.json")
+        return 2
+
+    old = load(args[0])
+    new = load(args[1])
+    regressions = 0
+
+    print("%-28s %12s %12s %8s" % ("benchmark", "baseline", "current", "change"))
+
+    for name, cur in new.items():
+        if name not in old:
+            print("%-28s %12s %12.2f %8s" % (name, "-", cur["ns_per_op"], "new"))
+            continue
+
+        base = old[name]["ns_per_op"]
+        change = (cur["ns_per_op"] - base) / base
+        flag = ""
+
+        if change > threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        elif change < -threshold:
+            flag = "  faster"
+
+        print("%-28s %12.2f %12.2f %+7.1f%%%s"
+              % (name, base, cur["ns_per_op"], change * 100, flag))
+
+    for name in old:
+        if name not in new:
+            print("%-28s %12.2f %12s %8s" % (name, old[name]["ns_per_op"], "-", "gone"))
+
+    if regressions:
+        print("%d benchmark(s) slower by more than %.0f%%" % (regressions, threshold * 100))
+        return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
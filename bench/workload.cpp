@@ -0,0 +1,169 @@
+#include "workload.h"
+
+#include <algorithm>
+
+namespace midi {
+
+enum {
+	WORKLOAD_DIVISION = 480,
+};
+
+typedef struct timed_bytes {
+	uint32_t tick;
+	uint8_t bytes[6];
+	uint8_t length;
+} timed_bytes_t;
+
+static uint32_t xorshift(uint32_t &state){
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static void put_be(std::vector<uint8_t> &out, uint32_t x, unsigned bytes){
+	while (bytes--) {
+		out.push_back(x >> (bytes * 8));
+	}
+}
+
+static void put_var(std::vector<uint8_t> &out, uint32_t x){
+	uint8_t tmp[5];
+	unsigned n = 0;
+
+	do {
+		tmp[n++] = x & 0x7f;
+		x >>= 7;
+	} while (x);
+
+	while (n--) {
+		out.push_back(tmp[n] | (n? 0x80 : 0));
+	}
+}
+
+static void add(std::vector<timed_bytes_t> &events, uint32_t tick,
+                uint8_t a, uint8_t b, uint8_t c)
+{
+	// program changes have a single data byte
+	uint8_t length = ((a & 0xf0) == 0xc0)? 2 : 3;
+
+	events.push_back({tick, {a, b, c}, length});
+}
+
+// Every event carries its own status byte, so decode results stay
+// comparable with runs from before the reader handled running status.
+// Note offs sort ahead of anything else at the same tick, so chords on
+// consecutive beats don't cut each other short.
+static void put_track(std::vector<uint8_t> &out, std::vector<timed_bytes_t> &events){
+	std::stable_sort(events.begin(), events.end(),
+		[](const timed_bytes_t &a, const timed_bytes_t &b){
+			bool a_off = (a.bytes[0] & 0xf0) == 0x80;
+			bool b_off = (b.bytes[0] & 0xf0) == 0x80;
+
+			return a.tick < b.tick || (a.tick == b.tick && a_off && !b_off);
+		});
+
+	std::vector<uint8_t> body;
+	uint32_t last = 0;
+
+	for (auto &x : events) {
+		put_var(body, x.tick - last);
+		body.insert(body.end(), x.bytes, x.bytes + x.length);
+		last = x.tick;
+	}
+
+	static const uint8_t end[] = {0x00, 0xff, 0x2f, 0x00};
+	body.insert(body.end(), end, end + sizeof(end));
+
+	out.insert(out.end(), {'M', 'T', 'r', 'k'});
+	put_be(out, body.size(), 4);
+	out.insert(out.end(), body.begin(), body.end());
+}
+
+std::vector<uint8_t> generate_workload(const workload_params_t &params){
+	std::vector<uint8_t> out;
+	uint32_t state = params.seed? params.seed : 1;
+	uint32_t beats = params.seconds * 2;
+	uint32_t ticks = beats * WORKLOAD_DIVISION;
+	unsigned ntracks = 1 + params.tracks + (params.drums? 1 : 0);
+
+	out.insert(out.end(), {'M', 'T', 'h', 'd'});
+	put_be(out, 6, 4);
+	put_be(out, 1, 2);
+	put_be(out, ntracks, 2);
+	put_be(out, WORKLOAD_DIVISION, 2);
+
+	// conductor track, starting at 120 bpm
+	std::vector<timed_bytes_t> events;
+	unsigned changes = params.tempo_changes * params.seconds / 60;
+
+	events.push_back({0, {0xff, 0x51, 0x03, 0x07, 0xa1, 0x20}, 6});
+
+	for (unsigned i = 1; i <= changes; i++) {
+		uint32_t usecs = 333333 + xorshift(state) % 666667;
+		uint32_t tick = (uint64_t)ticks * i / (changes + 1);
+
+		events.push_back({tick, {0xff, 0x51, 0x03, (uint8_t)(usecs >> 16),
+		                         (uint8_t)(usecs >> 8), (uint8_t)usecs}, 6});
+	}
+
+	put_track(out, events);
+
+	for (unsigned t = 0; t < params.tracks; t++) {
+		// skip the drum channel
+		uint8_t channel = t % 15;
+		channel += (channel >= 9);
+
+		// organ, guitar, bass, ensemble, synth lead and synth pad each
+		// have their own kernel
+		static const uint8_t spread[] = {16, 24, 32, 48, 80, 88};
+		uint8_t program = (params.program >= 0)
+			? params.program
+			: spread[t % sizeof(spread)];
+
+		events.clear();
+		add(events, 0, 0xc0 | channel, program, 0);
+
+		for (uint32_t beat = 0; beat < beats; beat++) {
+			uint32_t tick = beat * WORKLOAD_DIVISION;
+			bool used[128] = {false};
+
+			for (unsigned n = 0; n < params.polyphony && n < 60; n++) {
+				uint8_t key;
+
+				do {
+					key = 36 + xorshift(state) % 60;
+				} while (used[key]);
+
+				used[key] = true;
+
+				uint8_t velocity = 64 + xorshift(state) % 64;
+				add(events, tick, 0x90 | channel, key, velocity);
+				add(events, tick + WORKLOAD_DIVISION, 0x80 | channel, key, 0);
+			}
+		}
+
+		put_track(out, events);
+	}
+
+	if (params.drums){
+		static const uint8_t kit[] = {35, 36, 38, 40, 41, 42, 44, 45, 46, 48, 50};
+		uint32_t spacing = WORKLOAD_DIVISION / params.drums;
+
+		events.clear();
+
+		for (uint32_t tick = 0; tick < ticks; tick += spacing ? spacing : 1) {
+			uint8_t key = kit[xorshift(state) % sizeof(kit)];
+
+			add(events, tick, 0x99, key, 100);
+			add(events, tick + spacing / 2 + 1, 0x89, key, 0);
+		}
+
+		put_track(out, events);
+	}
+
+	return out;
+}
+
+// namespace midi
+}
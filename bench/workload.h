@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+namespace midi {
+
+// Shape of a synthetic SMF workload. Every melodic track plays a chord of
+// `polyphony` notes on each beat, so that's how many of its voices are
+// held at once, drums are spread evenly through each beat.
+typedef struct workload_params {
+	unsigned tracks = 4;
+	unsigned polyphony = 4;
+	// drum hits per beat, 0 leaves out the drum track
+	unsigned drums = 2;
+	// tempo changes per minute of playback
+	unsigned tempo_changes = 0;
+	unsigned seconds = 30;
+	// program for every melodic track, or -1 to spread tracks across
+	// instrument families
+	int program = -1;
+	uint32_t seed = 1;
+} workload_params_t;
+
+// a format 1 SMF, tempo changes on the first track
+std::vector<uint8_t> generate_workload(const workload_params_t &params);
+
+// namespace midi
+}
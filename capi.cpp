@@ -0,0 +1,121 @@
+#include <midi/midithing.h>
+#include <midi/midi.h>
+#include <midi/player.h>
+#include <midi/pullsynth.h>
+#include <midi/log.h>
+#include <midi/synth.h>
+
+#include <string.h>
+#include <string>
+#include <new>
+
+struct midithing {
+	midithing(const void *buffer, size_t len, uint32_t rate)
+		: data((const char *)buffer, len),
+		  syn(&sequencer, rate)
+	{
+		// hosts hand us anything, so nothing past the checked tracks
+		// and events is ever read
+		midi::file f(data.data());
+
+		sequencer.load(f.checked_tracks(data.size()), f.division());
+		sequencer.set_synth(&syn);
+	}
+
+	// sequencer holds pointers into this, so it has to come first
+	std::string       data;
+	midi::player      sequencer;
+	midi::pullsynth   syn;
+};
+
+static thread_local const char *last_error = "no error";
+
+// Nothing may unwind into a C host, so every entry point catches
+// everything. Errors thrown here are strings, anything else gets a fixed
+// description, since what() doesn't outlive the catch.
+#define MIDITHING_CATCH(failed) \
+	catch (const char *errormsg) { \
+		last_error = errormsg; \
+		failed; \
+	} catch (const std::bad_alloc &) { \
+		last_error = "out of memory"; \
+		failed; \
+	} catch (...) { \
+		last_error = "unexpected internal error"; \
+		failed; \
+	}
+
+extern "C" {
+
+midithing_t *midithing_open(const void *buffer, size_t len, uint32_t sample_rate){
+	if (len < sizeof(midi::file_t)){
+		last_error = "buffer too small to be a midi file";
+		return NULL;
+	}
+
+	try {
+		return new midithing(buffer, len, sample_rate);
+
+	} MIDITHING_CATCH(return NULL)
+}
+
+size_t midithing_render(midithing_t *m, float *dst, size_t frames){
+	size_t done = 0;
+
+	try {
+		m->syn.set_target(dst);
+
+		// step() takes 32 bit counts, hosts might not
+		while (done < frames) {
+			size_t want = frames - done;
+			uint32_t n = m->sequencer.step((want > UINT32_MAX)? UINT32_MAX : want);
+
+			done += n;
+
+			if (n < want){
+				break;
+			}
+		}
+
+	} MIDITHING_CATCH(done = 0)
+
+	memset(dst + done * midi::SYNTH_CHANNELS, 0,
+	       (frames - done) * midi::SYNTH_CHANNELS * sizeof(float));
+	return done;
+}
+
+int midithing_seek(midithing_t *m, uint64_t usecs){
+	try {
+		m->sequencer.seek(usecs);
+		return 0;
+
+	} MIDITHING_CATCH(return -1)
+}
+
+uint64_t midithing_position(midithing_t *m){
+	try {
+		return m->sequencer.control.position();
+
+	} MIDITHING_CATCH(return 0)
+}
+
+int midithing_log_level(const char *level){
+	try {
+		midi::log_level = midi::log_level_from_string(level);
+		return 0;
+
+	} MIDITHING_CATCH(return -1)
+}
+
+void midithing_close(midithing_t *m){
+	try {
+		delete m;
+
+	} MIDITHING_CATCH(return)
+}
+
+const char *midithing_error(void){
+	return last_error;
+}
+
+}
@@ -0,0 +1,200 @@
+#include <midi/export.h>
+#include <midi/tempo.h>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+
+namespace midi {
+
+unsigned export_format(std::string name){
+	if (name == "jsonl") return EXPORT_JSONL;
+	if (name == "csv")   return EXPORT_CSV;
+	if (name == "binary") return EXPORT_BINARY;
+
+	throw "unknown export format, expected jsonl, csv or binary";
+}
+
+buffered_writer::buffered_writer(int out){
+	fd = out;
+}
+
+buffered_writer::~buffered_writer(){
+	try {
+		flush();
+	} catch (const char *) {
+		// already reported by whoever was writing
+	}
+}
+
+void buffered_writer::put(const void *data, size_t n){
+	if (used + n > sizeof(buf)){
+		flush();
+	}
+
+	if (n > sizeof(buf)){
+		// too big to bother buffering
+		write_all((const char *)data, n);
+		return;
+	}
+
+	memcpy(buf + used, data, n);
+	used += n;
+}
+
+void buffered_writer::put_uint(uint64_t x){
+	char tmp[20];
+	unsigned i = sizeof(tmp);
+
+	do {
+		tmp[--i] = '0' + x % 10;
+		x /= 10;
+	} while (x);
+
+	put(tmp + i, sizeof(tmp) - i);
+}
+
+void buffered_writer::flush(void){
+	size_t n = used;
+
+	used = 0;
+	write_all(buf, n);
+}
+
+void buffered_writer::write_all(const char *data, size_t len){
+	for (size_t done = 0; done < len;) {
+		ssize_t n = write(fd, data + done, len - done);
+
+		if (n < 0 && errno == EINTR){
+			continue;
+		}
+
+		if (n <= 0){
+			throw "could not write output";
+		}
+
+		done += n;
+	}
+}
+
+static void write_text(buffered_writer &out, unsigned format,
+                       const export_record_t &rec, const std::string &name)
+{
+	bool has_channel = rec.channel != 0xff;
+
+	if (format == EXPORT_JSONL){
+		out.put("{\"track\":");
+		out.put_uint(rec.track);
+		out.put(",\"tick\":");
+		out.put_uint(rec.tick);
+		out.put(",\"usecs\":");
+		out.put_uint(rec.usecs);
+		out.put(",\"type\":\"");
+		out.put(name.data(), name.size());
+		out.put(",\"channel\":");
+
+		if (has_channel){
+			out.put_uint(rec.channel);
+		} else {
+			out.put("null");
+		}
+
+		out.put(",\"data\":");
+		out.put_uint(rec.data);
+		out.put("}\n");
+
+	} else {
+		out.put_uint(rec.track);
+		out.put(',');
+		out.put_uint(rec.tick);
+		out.put(',');
+		out.put_uint(rec.usecs);
+		out.put(',');
+		out.put(name.data(), name.size());
+		out.put(',');
+
+		if (has_channel){
+			out.put_uint(rec.channel);
+		}
+
+		out.put(',');
+		out.put_uint(rec.data);
+		out.put('\n');
+	}
+}
+
+uint64_t export_events(file f, unsigned format, int fd){
+	buffered_writer out(fd);
+	tempo_map clock(f);
+	uint64_t count = 0;
+
+	// ready to copy out, so nothing gets strlen()'d per event
+	std::vector<std::string> names;
+
+	for (unsigned i = 0; i < EVENT_END; i++) {
+		names.push_back(midi_event_string(i));
+
+		if (format == EXPORT_JSONL){
+			// closing quote goes along with the name
+			names.back() += '"';
+		}
+	}
+
+	if (format == EXPORT_BINARY){
+		export_header_t header = {{'M', 'T', 'E', 'X'}, 1, sizeof(export_record_t)};
+		out.put(&header, sizeof(header));
+
+	} else if (format == EXPORT_CSV){
+		out.put("track,tick,usecs,type,channel,data\n");
+	}
+
+	for (unsigned i = 0; i < f.tracks(); i++) {
+		track trk = f.get_track(i);
+		const uint8_t *ptr = trk.start();
+		const uint8_t *end = trk.end();
+		export_record_t rec = {0, 0, 0, (uint16_t)i, 0, 0xff};
+		uint8_t running = 0;
+
+		clock.rewind();
+
+		while (ptr < end) {
+			event ev(ptr, running);
+			uint32_t type = ev.type();
+
+			if (type == EVENT_UNKNOWN || type == EVENT_META_TRACK_END){
+				break;
+			}
+
+			rec.tick += ev.delta_time().num;
+			rec.usecs = clock.usecs(rec.tick);
+			rec.type = type;
+			rec.channel = 0xff;
+			rec.data = 0;
+
+			if (type >= EVENT_MIDI_NOTE_ON && type <= EVENT_MIDI_CHAN_MODE){
+				rec.channel = ev.midi_channel();
+				rec.data = ev.midi_data(type);
+				running = ev.status;
+
+			} else if (type == EVENT_META_TEMPO){
+				rec.data = (ev.evdata[3] << 16) | (ev.evdata[4] << 8) | ev.evdata[5];
+			}
+
+			if (format == EXPORT_BINARY){
+				out.put(&rec, sizeof(rec));
+			} else {
+				write_text(out, format, rec, names[type]);
+			}
+
+			ptr += ev.length(type);
+			count++;
+		}
+	}
+
+	out.flush();
+	return count;
+}
+
+// namespace midi
+}
@@ -0,0 +1,162 @@
+#include <midi/governor.h>
+#include <stdio.h>
+
+namespace midi {
+
+// render load thresholds, as a fraction of the block's real-time deadline
+static const double degrade_load = 0.70;
+static const double panic_load   = 0.95;
+static const double recover_load = 0.30;
+
+// how long load needs to stay low before stepping quality back up
+static const double recover_secs = 2.0;
+// blocks to wait after a step down before considering another one
+static const unsigned degrade_cooldown = 8;
+
+// The first step down only caps voices, so what goes is whatever's
+// quietest at the time rather than every softly struck note.
+static const synth_quality_t levels[GOVERNOR_LEVELS] = {
+	// max voices,      min vel., cheap osc., simple drums
+	{SYNTH_MAX_VOICES,  0,        false,      false},
+	{32,                0,        false,      false},
+	{16,                24,       false,      false},
+	{16,                32,       true,       false},
+	{8,                 32,       true,       true},
+};
+
+static const char *level_strings[GOVERNOR_LEVELS] = {
+	"full quality",
+	"stealing quiet voices",
+	"polyphony capped",
+	"cheap oscillators",
+	"simplified drums",
+};
+
+const char *governor_level_string(unsigned level){
+	if (level < GOVERNOR_LEVELS){
+		return level_strings[level];
+	}
+
+	return "unknown";
+}
+
+governor::governor(uint32_t rate){
+	sample_rate = rate;
+}
+
+void governor::block_start(void){
+	clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+bool governor::block_end(unsigned frames){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (frames == 0){
+		return false;
+	}
+
+	double elapsed  = (now.tv_sec - started.tv_sec)
+	                + (now.tv_nsec - started.tv_nsec) / 1e9;
+	double deadline = frames / (double)sample_rate;
+	double block_load = elapsed / deadline;
+
+	load = load*0.8 + block_load*0.2;
+
+	if (pinned){
+		return false;
+	}
+
+	if (cooldown > 0){
+		cooldown--;
+	}
+
+	if ((block_load > panic_load || load > degrade_load)
+	    && cooldown == 0 && cur_level + 1 < GOVERNOR_LEVELS)
+	{
+		set_level(cur_level + 1, block_load);
+		degrade_events++;
+		cooldown = degrade_cooldown;
+		return true;
+	}
+
+	if (load < recover_load && cur_level > GOVERNOR_FULL){
+		calm_samples += frames;
+
+		if (calm_samples >= recover_secs * sample_rate){
+			set_level(cur_level - 1, block_load);
+			recover_events++;
+			return true;
+		}
+
+	} else {
+		calm_samples = 0;
+	}
+
+	return false;
+}
+
+void governor::print_change(unsigned from, unsigned to,
+                            double load, double block_load)
+{
+	fprintf(stderr, "midithing: governor: %s -> %s (load %.0f%%, block %.0f%%)\n",
+	        governor_level_string(from), governor_level_string(to),
+	        load * 100, block_load * 100);
+}
+
+void governor::set_level(unsigned lvl, double block_load){
+	if (!defer_reports){
+		print_change(cur_level, lvl, load, block_load);
+
+	} else if (num_changes < sizeof(changes) / sizeof(changes[0])){
+		changes[num_changes++] = {cur_level, lvl, load, block_load};
+
+	} else {
+		dropped_changes++;
+	}
+
+	cur_level = lvl;
+	calm_samples = 0;
+
+	if (lvl > worst_level){
+		worst_level = lvl;
+	}
+}
+
+const synth_quality_t &governor::quality(void){
+	return levels[cur_level];
+}
+
+unsigned governor::level(void){
+	return cur_level;
+}
+
+void governor::pin(unsigned lvl){
+	cur_level = (lvl < GOVERNOR_LEVELS)? lvl : GOVERNOR_LEVELS - 1;
+	worst_level = cur_level;
+	pinned = true;
+}
+
+void governor::report(void){
+	for (unsigned i = 0; i < num_changes; i++) {
+		level_change_t &c = changes[i];
+		print_change(c.from, c.to, c.load, c.block_load);
+	}
+
+	if (dropped_changes > 0){
+		fprintf(stderr, "midithing: governor: %u more level changes not logged\n",
+		        dropped_changes);
+	}
+
+	num_changes = dropped_changes = 0;
+
+	if (degrade_events == 0){
+		return;
+	}
+
+	fprintf(stderr, "midithing: governor: %u degradations, %u recoveries, worst: %s\n",
+	        degrade_events, recover_events, governor_level_string(worst_level));
+}
+
+// namespace midi
+}
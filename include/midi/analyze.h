@@ -0,0 +1,81 @@
+#pragma once
+
+namespace midi {
+	class corpus_analyzer;
+}
+
+#include <midi/midi.h>
+#include <midi/export.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace midi {
+
+typedef struct file_stats {
+	uint64_t usecs;
+	uint32_t ticks;
+	uint16_t tracks;
+	// tracks which stopped at an event the decoder doesn't understand,
+	// which is also where playback would stop
+	uint16_t undecoded_tracks;
+	uint32_t tempo_changes;
+	uint64_t events[EVENT_END];
+	uint16_t peak_polyphony[16];
+	// polyphony integrated over time, in note-microseconds
+	double   note_usecs[16];
+	// bit n set if program n was selected on any channel
+	uint64_t programs[2];
+} file_stats_t;
+
+// Decodes and sequences a whole file already in memory, without rendering
+// anything. Throws if the file is structurally broken.
+void analyze_file(const void *data, size_t size, file_stats_t &stats);
+
+// Runs analyze_file() over a corpus on a pool of workers. Files are mmapped
+// one at a time per worker and paths are fed through a bounded queue, so
+// memory use depends on the number of workers rather than the size of the
+// corpus. Writes a JSON line per file as it's finished, then a summary
+// line from finish().
+class corpus_analyzer {
+	public:
+		corpus_analyzer(unsigned workers, int fd);
+		~corpus_analyzer();
+
+		// queue a file, blocks while the workers are behind. Directories
+		// are walked for .mid/.midi/.smf files.
+		void add(std::string path);
+		// wait for everything queued, write the summary, returns the
+		// number of files that failed
+		uint64_t finish(void);
+
+		uint64_t files = 0;
+		uint64_t failed = 0;
+
+	private:
+		void add_tree(const std::string &path);
+		void enqueue(const std::string &path);
+		void worker(void);
+		void merge(const file_stats_t &stats);
+
+		std::vector<std::thread> workers;
+		std::mutex lock;
+		std::condition_variable queued;
+		std::condition_variable dequeued;
+		std::deque<std::string> pending;
+		size_t max_pending;
+		bool done = false;
+
+		// everything below is protected by lock
+		buffered_writer out;
+		file_stats_t totals;
+		// number of files using each program
+		uint64_t program_files[128];
+};
+
+// namespace midi
+}
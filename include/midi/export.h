@@ -0,0 +1,79 @@
+#pragma once
+
+namespace midi {
+	class buffered_writer;
+}
+
+#include <midi/midi.h>
+#include <stdint.h>
+#include <string>
+
+namespace midi {
+
+enum {
+	EXPORT_JSONL,
+	EXPORT_CSV,
+	EXPORT_BINARY,
+};
+
+// "jsonl", "csv" or "binary", throws on anything else
+unsigned export_format(std::string name);
+
+// Binary export is a header followed by one fixed size record per event,
+// in host byte order. Channel is 0xff for non-channel events, data
+// is midi_data() for channel events and microseconds per quarter note for
+// tempo changes.
+typedef struct export_header {
+	uint8_t  magic[4]; // "MTEX"
+	uint16_t version;
+	uint16_t record_size;
+} __attribute__((packed)) export_header_t;
+
+typedef struct export_record {
+	uint64_t usecs;
+	uint32_t tick;
+	uint32_t data;
+	uint16_t track;
+	uint8_t  type;
+	uint8_t  channel;
+} __attribute__((packed)) export_record_t;
+
+// accumulates output in one large buffer and hands it to write(2) in bulk
+class buffered_writer {
+	public:
+		buffered_writer(int fd);
+		~buffered_writer();
+
+		void put(const void *data, size_t n);
+		void put(char c){
+			if (used == sizeof(buf)){
+				flush();
+			}
+
+			buf[used++] = c;
+		}
+
+		// string literals, without the NUL
+		template <size_t N>
+		void put(const char (&str)[N]){
+			put(str, N - 1);
+		}
+
+		void put_uint(uint64_t x);
+		void flush(void);
+
+	private:
+		void write_all(const char *data, size_t len);
+
+		int fd;
+		size_t used = 0;
+		char buf[1 << 16];
+};
+
+// Writes every event in the file as (track, absolute tick, absolute time,
+// type, channel, data), track by track. Times follow the file's tempo
+// changes. Returns the number of events written.
+uint64_t export_events(file f, unsigned format, int fd);
+
+// namespace midi
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+namespace midi {
+	class governor;
+}
+
+#include <midi/synth.h>
+#include <stdint.h>
+#include <time.h>
+
+namespace midi {
+
+enum {
+	GOVERNOR_FULL,
+	GOVERNOR_STEAL_QUIET,
+	GOVERNOR_CAP_POLYPHONY,
+	GOVERNOR_CHEAP_OSCILLATORS,
+	GOVERNOR_SIMPLE_DRUMS,
+
+	GOVERNOR_LEVELS,
+};
+
+// Times each rendered block against its real-time deadline, and steps the
+// synth quality down when rendering gets close to not keeping up. Quality is
+// stepped back up once there's been enough headroom for a while.
+class governor {
+	public:
+		governor(uint32_t rate);
+
+		void block_start(void);
+		// returns true if the quality level changed during this block
+		bool block_end(unsigned frames);
+
+		const synth_quality_t &quality(void);
+		unsigned level(void);
+		void report(void);
+		// holds quality at the given level, load is still measured but
+		// never changes it, for runs that have to be repeatable
+		void pin(unsigned lvl);
+
+		// fraction of the deadline spent rendering, smoothed
+		double load = 0;
+		unsigned degrade_events = 0;
+		unsigned recover_events = 0;
+		unsigned worst_level = GOVERNOR_FULL;
+
+		// keep level changes in a fixed-size log and only print them from
+		// report(), for when the render thread mustn't touch stdio
+		bool defer_reports = false;
+
+	private:
+		void set_level(unsigned lvl, double block_load);
+		void print_change(unsigned from, unsigned to, double load, double block_load);
+
+		typedef struct level_change {
+			unsigned from;
+			unsigned to;
+			double   load;
+			double   block_load;
+		} level_change_t;
+
+		level_change_t changes[32];
+		unsigned num_changes = 0;
+		unsigned dropped_changes = 0;
+
+		uint32_t sample_rate;
+		unsigned cur_level = GOVERNOR_FULL;
+		bool pinned = false;
+		// blocks left before another step down is allowed, gives the
+		// previous step time to show up in the load figure
+		unsigned cooldown = 0;
+		// samples rendered in a row under the recovery threshold
+		unsigned calm_samples = 0;
+		struct timespec started;
+};
+
+const char *governor_level_string(unsigned level);
+
+// namespace midi
+}
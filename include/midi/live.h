@@ -0,0 +1,104 @@
+#pragma once
+
+namespace midi {
+	class live_parser;
+	class live_input;
+	class wire_player;
+}
+
+#include <midi/midi.h>
+#include <midi/player.h>
+#include <midi/queue.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+namespace midi {
+
+typedef struct live_message {
+	// CLOCK_MONOTONIC time the bytes were read, in nanoseconds
+	uint64_t arrival;
+	uint8_t  bytes[3];
+	uint8_t  length;
+} live_message_t;
+
+// Turns raw MIDI wire bytes into complete channel messages. Handles running
+// status, skips sysex and system common messages, and passes system reset
+// through as a one byte message. Other realtime bytes can show up anywhere,
+// even in the middle of a message, and are dropped without disturbing it.
+class live_parser {
+	public:
+		// returns true when a complete message has been assembled into msg
+		bool feed(uint8_t byte, live_message_t &msg);
+
+	private:
+		uint8_t  status = 0;
+		uint8_t  data[2];
+		unsigned have = 0;
+		unsigned need = 0;
+		bool     in_sysex = false;
+};
+
+// Reads a live byte stream on a background thread and queues up timestamped
+// messages for the render thread. Sources are "-" for stdin, "unix:[path]"
+// to listen on a unix domain socket, or anything else is opened as a file,
+// which is what you want for a FIFO. Input ends when the writer closes it.
+class live_input {
+	public:
+		live_input(std::string source);
+		~live_input();
+
+		// render thread side
+		bool next(live_message_t &msg);
+		bool finished(void);
+
+		// arrival-to-sound latency, in seconds
+		void record_latency(double secs);
+		void report(FILE *fp);
+
+		uint64_t messages = 0;
+
+	private:
+		void reader(void);
+
+		int fd = -1;
+		int listen_fd = -1;
+		std::string path;
+
+		spsc_queue<live_message_t, 1024> queue;
+		std::thread reader_thread;
+		std::atomic<bool> done{false};
+		std::atomic<bool> quit{false};
+		std::atomic<uint64_t> overflows{0};
+
+		double latency_min = -1;
+		double latency_max = 0;
+		double latency_sum = 0;
+		// latencies bucketed by milliseconds, last bucket is everything over
+		uint64_t latency_hist[11] = {0};
+};
+
+// Plays a file as MIDI wire bytes to a file descriptor instead of sound,
+// using running status wherever it can. Paired with a paced nullsynth this
+// replays a file into a live input in real time.
+class wire_player : public player {
+	public:
+		wire_player(file f, int out_fd);
+		virtual void interpret(event &ev);
+
+		uint64_t bytes_written = 0;
+
+	private:
+		int fd;
+		uint8_t last_status = 0;
+};
+
+// connect to a live input, destinations are as for live_input's sources
+int live_connect(std::string dest);
+
+uint64_t live_clock(void);
+
+// namespace midi
+}
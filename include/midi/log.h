@@ -0,0 +1,111 @@
+#pragma once
+
+#include <midi/queue.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <type_traits>
+#include <utility>
+
+namespace midi {
+
+enum {
+	LOG_ERROR,
+	LOG_WARN,
+	// what's being loaded and played, the default
+	LOG_INFO,
+	LOG_DEBUG,
+	// every event and channel change as it's played
+	LOG_TRACE,
+};
+
+// Messages above this level are compiled out entirely, set with
+// `make LOG_LEVEL=n`
+#ifndef MIDI_LOG_LEVEL
+#define MIDI_LOG_LEVEL LOG_TRACE
+#endif
+
+enum {
+	LOG_MAX_ARGS = 6,
+	// records queued for the log thread before they start being dropped
+	LOG_QUEUE_SIZE = 4096,
+};
+
+// messages above this level are skipped at run time
+extern unsigned log_level;
+
+// LOG_INFO for "info" and so on, throws if the name isn't a level
+unsigned log_level_from_string(const char *name);
+
+// Messages are queued unformatted, as the format string and its arguments,
+// and formatted by whichever thread writes them out. Format strings and
+// any string arguments have to outlive the record, in practice they're
+// literals and static tables.
+typedef struct log_record {
+	void (*format)(char *buf, size_t len, const struct log_record &rec);
+	const char *fmt;
+	uint64_t args[LOG_MAX_ARGS];
+	unsigned level;
+} log_record_t;
+
+// Starts a thread which writes queued messages to stderr, from then on
+// logging doesn't touch stdio, allocate or lock. Without one running,
+// messages are written out as they're logged.
+void log_start(void);
+// writes out everything queued and stops the thread
+void log_stop(void);
+void log_push(const log_record_t &rec);
+
+template <typename T>
+static inline uint64_t log_pack(T x){
+	static_assert(std::is_arithmetic<T>::value || std::is_pointer<T>::value,
+	              "log arguments have to be numbers or pointers");
+	uint64_t ret = 0;
+	memcpy(&ret, &x, sizeof(x));
+	return ret;
+}
+
+template <typename T>
+static inline T log_unpack(uint64_t x){
+	T ret;
+	memcpy(&ret, &x, sizeof(ret));
+	return ret;
+}
+
+template <typename... Args, size_t... I>
+static void log_format_args(char *buf, size_t len, const log_record_t &rec,
+                            std::index_sequence<I...>)
+{
+	if constexpr (sizeof...(Args) == 0){
+		snprintf(buf, len, "%s", rec.fmt);
+	} else {
+		snprintf(buf, len, rec.fmt, log_unpack<Args>(rec.args[I])...);
+	}
+}
+
+template <typename... Args>
+static void log_format(char *buf, size_t len, const log_record_t &rec){
+	log_format_args<Args...>(buf, len, rec, std::index_sequence_for<Args...>());
+}
+
+template <typename... Args>
+void log_write(unsigned level, const char *fmt, Args... args){
+	static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+
+	log_record_t rec = {log_format<Args...>, fmt, {log_pack(args)...}, level};
+	log_push(rec);
+}
+
+// namespace midi
+}
+
+// Logs a printf style message, a newline is added. Arguments aren't
+// evaluated unless the message is going to be written, and the format is
+// still checked against them when the level is compiled out.
+#define MIDI_LOG(level, ...) \
+	do { \
+		if ((level) <= MIDI_LOG_LEVEL && (level) <= midi::log_level){ \
+			midi::log_write(level, __VA_ARGS__); \
+		} \
+		(void)sizeof(printf(__VA_ARGS__)); \
+	} while (0)
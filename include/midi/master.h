@@ -0,0 +1,129 @@
+#pragma once
+
+namespace midi {
+	class delay_line;
+	class master_chain;
+}
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace midi {
+
+enum {
+	MASTER_EFFECT_NONE,
+	// stereo ping-pong echo
+	MASTER_EFFECT_DELAY,
+	// small feedback delay network
+	MASTER_EFFECT_REVERB,
+};
+
+enum {
+	// upper bound on the limiter look-ahead, in frames
+	MASTER_MAX_LOOKAHEAD = 256,
+	MASTER_REVERB_LINES = 4,
+};
+
+// Fixed length delay line for block processing. Lines are at least as long
+// as the longest block, so a whole block of delayed samples can be read
+// before any of the block is written, and every read and write is one or
+// two straight copies.
+class delay_line {
+	public:
+		// allocates, everything else is allocation free
+		void init(unsigned length);
+		void reset(void);
+
+		// the frames written `length` frames ago
+		void read(float *dst, unsigned frames);
+		// must follow a read() of the same number of frames
+		void write(const float *src, unsigned frames);
+
+		// see snapshot.h, loading needs a line of the same length
+		void save_state(std::string &out) const;
+		void load_state(const uint8_t *&ptr, const uint8_t *end);
+
+	private:
+		std::vector<float> buf;
+		unsigned pos = 0;
+};
+
+// Master processing run on each mixed block: DC blocking, an optional send
+// effect, then a look-ahead peak limiter. All state is per instance and
+// allocated up front, processing a block doesn't allocate.
+//
+// The limiter delays the signal by its look-ahead so that gain reduction
+// is already in place when a peak comes through, with a linear attack over
+// the look-ahead and an exponential release, so it doesn't pump like a
+// per-sample limiter.
+class master_chain {
+	public:
+		// blocks passed to process() can be up to max_frames long
+		master_chain(uint32_t rate, unsigned max_frames);
+
+		void set_effect(unsigned effect);
+		void reset(void);
+
+		// in place, output is in [-1, 1]
+		void process(float *left, float *right, unsigned frames);
+
+		// how far output lags input, in frames
+		unsigned latency(void);
+
+		// Appends everything processing carries from one block to the
+		// next, see snapshot.h. Lines of effects which aren't in use are
+		// left out, so loading needs the same effect set.
+		void save_state(std::string &out) const;
+		void load_state(const uint8_t *&ptr, const uint8_t *end);
+
+		// peak level the limiter holds output to
+		float ceiling = 0.98;
+		// send level into the delay or reverb
+		float wet = 0.25;
+
+	private:
+		void dc_block(float *buf, unsigned frames, double &x1, double &y1);
+		void delay(float *left, float *right, unsigned frames);
+		void reverb(float *left, float *right, unsigned frames);
+		void limit(float *left, float *right, unsigned frames);
+
+		unsigned effect = MASTER_EFFECT_NONE;
+
+		double dc_coeff;
+		double dc_state[2][2];
+
+		// delay
+		delay_line echo[2];
+		float echo_feedback = 0.4;
+		double echo_damp = 0;
+		double echo_coeff;
+
+		// reverb
+		delay_line lines[MASTER_REVERB_LINES];
+		float line_gain[MASTER_REVERB_LINES];
+		double line_damp[MASTER_REVERB_LINES];
+		double reverb_coeff;
+
+		// scratch for delayed samples, one block per line
+		std::vector<float> taps[MASTER_REVERB_LINES];
+		unsigned max_frames;
+
+		// limiter
+		unsigned lookahead;
+		double release_coeff;
+		double release_gain;
+		float delayed[2][MASTER_MAX_LOOKAHEAD];
+		// sliding window minimum of gains, as a monotonic queue
+		float min_value[MASTER_MAX_LOOKAHEAD + 1];
+		uint64_t min_index[MASTER_MAX_LOOKAHEAD + 1];
+		unsigned min_head;
+		unsigned min_count;
+		// moving average of the window minimums, for the attack ramp
+		float avg_ring[MASTER_MAX_LOOKAHEAD];
+		double avg_sum;
+		uint64_t frame;
+};
+
+// namespace midi
+}
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <vector>
 
 namespace midi {
 
@@ -30,6 +31,11 @@ enum midi_event_types {
 	EVENT_META_SEQ_SPECIFIC,
 	EVENT_META_MIDI_PORT,
 	EVENT_META_CHAN_PREFIX,
+	// any other meta event, which nothing here acts on
+	EVENT_META_OTHER,
+
+	// system exclusive, F0 messages and F7 escapes
+	EVENT_SYSEX,
 
 	EVENT_END,
 };
@@ -78,23 +84,44 @@ static inline varint_t var_field(const uint8_t *x){
 
 class event {
 	public:
-		event(const void *ptr){
+		// running is the status of the last channel message in the track,
+		// for events which leave theirs out
+		event(const void *ptr, uint8_t running = 0){
 			data = ptr;
 			evdata = (const uint8_t *)ptr + delta_time().length;
+
+			if (*evdata < 0x80 && running >= 0x80 && running < 0xf0){
+				status = running;
+				params = evdata;
+			} else {
+				status = *evdata;
+				params = evdata + 1;
+			}
 		};
 
 		uint32_t length(void);
+		// same, for when the caller already has the type at hand
+		uint32_t length(uint32_t type);
 		uint32_t type(void);
 		// TODO: remove after things are working
 		uint32_t debug_bytes(void);
 
 		varint_t delta_time(void);
 		const uint8_t *evdata;
+		// status byte, whether or not it was in the data, and the bytes
+		// following it
+		uint8_t status;
+		const uint8_t *params;
+		// start of the event, delta time included
+		const void *raw(void){
+			return data;
+		}
 
 		// various accessor functions for underlying data
 		bool     is_midi(void);
 		uint8_t  midi_channel(void);
 		uint16_t midi_data(void);
+		uint16_t midi_data(uint32_t type);
 
 	protected:
 		const void *data = NULL;
@@ -105,14 +132,21 @@ class event {
 class event_stream {
 	public:
 		event_stream(){};
-		event_stream(const void *ptr);
+		// end is where the track's data stops, if it's known
+		event_stream(const void *ptr, const void *end = NULL);
 
 		// TODO: wrap this up in an iterator
 		event get_event(void);
 		void next(void);
+		// true once every byte of the track has been read, for tracks
+		// which stop without an end of track event
+		bool done(void);
 
 	private:
 		const void *data = NULL;
+		const void *end = NULL;
+		// carried from one channel message to the next
+		uint8_t running = 0;
 };
 
 class track {
@@ -122,6 +156,14 @@ class track {
 		static bool valid(const void *ptr);
 		uint32_t length(void);
 		event_stream events(void);
+		// raw event data, the end is where the header says it is
+		const uint8_t *start(void);
+		const uint8_t *end(void);
+		// Walks the events the way the player does, up to the end of track
+		// event, the end of the data or the first event the decoder can't
+		// find the length of, and throws if any of them runs past end(). A
+		// checked track is never read outside of while it's played.
+		void check_events(void);
 
 	private:
 		const void *data = NULL;
@@ -137,6 +179,10 @@ class file {
 		uint16_t division(void);
 
 		track get_track(uint32_t id);
+		// every track, checked against the size of the data and with its
+		// events checked against the track, for files that came from
+		// somewhere we don't trust. Throws if anything runs past the end.
+		std::vector<track> checked_tracks(size_t size);
 
 	private:
 		const void *data = NULL;
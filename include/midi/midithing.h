@@ -0,0 +1,50 @@
+#pragma once
+
+/* C interface for embedding midithing. Hosts open a file from memory and
+ * then pull audio from it at whatever block size they like. A handle must
+ * only be used from one thread at a time. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct midithing midithing_t;
+
+/* Parses an SMF file from memory. The data is copied, so the buffer can be
+ * freed after this returns. Nothing outside the first len bytes is read,
+ * and a malformed file fails here rather than while playing. Returns NULL
+ * on failure, see midithing_error(). */
+midithing_t *midithing_open(const void *buffer, size_t len, uint32_t sample_rate);
+
+/* Renders up to `frames` frames of interleaved stereo (left first) in
+ * [-1, 1] directly into dst, which needs room for 2 * frames floats.
+ * Returns the number of frames of the song rendered, which is only less
+ * than `frames` once the song has ended, the rest of dst is zeroed. If
+ * rendering fails, dst is all zeros and 0 is returned, see
+ * midithing_error(). */
+size_t midithing_render(midithing_t *m, float *dst, size_t frames);
+
+/* Moves playback to the given position, in microseconds from the start.
+ * Returns 0, or -1 on failure, see midithing_error(). */
+int midithing_seek(midithing_t *m, uint64_t usecs);
+
+/* Current playback position in microseconds. */
+uint64_t midithing_position(midithing_t *m);
+
+void midithing_close(midithing_t *m);
+
+/* Sets how much goes to the library's log: "error", "warn", "info" (the
+ * default), "debug" or "trace". The level is shared by every handle in the
+ * process. Returns 0, or -1 if the level isn't one of those. */
+int midithing_log_level(const char *level);
+
+/* Describes why the last call on this thread that failed did so. No error
+ * ever propagates out of the library as a C++ exception. */
+const char *midithing_error(void);
+
+#ifdef __cplusplus
+}
+#endif
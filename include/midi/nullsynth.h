@@ -0,0 +1,46 @@
+#pragma once
+
+namespace midi {
+	class nullsynth;
+}
+
+#include <midi/midi.h>
+#include <midi/player.h>
+#include <midi/synth.h>
+#include <midi/governor.h>
+#include <midi/outstats.h>
+
+namespace midi {
+
+// Real-time output backend which throws samples away. It emulates a device
+// buffer drained at the sample rate, so write pacing, underflows and
+// latency accounting behave like they would with a sound card.
+class nullsynth : public synth {
+	public:
+		// an unpaced nullsynth renders as fast as it can, and doesn't
+		// keep any output stats
+		nullsynth(player *play, uint32_t rate, bool paced = true,
+		          unsigned buffer_frames = 4096);
+		~nullsynth();
+
+		virtual void output(uint32_t frames);
+		virtual void prefault(void);
+		virtual double output_latency(void);
+
+		output_stats stats;
+		governor gov;
+
+	private:
+		void write(unsigned frames);
+
+		int16_t buffer[SYNTH_BLOCK_SIZE * SYNTH_CHANNELS];
+		bool paced;
+		unsigned capacity;
+		// frames sitting in the emulated device buffer as of last_time
+		double queued = 0;
+		double last_time;
+		bool primed = false;
+};
+
+// namespace midi
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+namespace midi {
+	class output_stats;
+}
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace midi {
+
+// Underflow and buffer/latency accounting for real-time output backends.
+// All times are in seconds, on whatever clock the backend's stream uses.
+class output_stats {
+	public:
+		output_stats(uint32_t rate);
+
+		void start(double now);
+		// frames of write space available just before a write
+		void before_write(long available);
+		void after_write(unsigned frames, double now);
+		void underflow(void);
+		void write_error(void);
+		void set_reported_latency(double secs);
+
+		void dump(FILE *fp);
+		void log_line(FILE *fp);
+		// time until the first frame of the last write will be heard
+		double block_latency(void);
+
+		// print a log line once per second of stream time
+		bool log_per_second = false;
+
+		uint64_t writes = 0;
+		uint64_t frames_written = 0;
+		uint64_t underflows = 0;
+		uint64_t errors = 0;
+
+		// largest write space seen, which is our estimate of the buffer size
+		long buffer_frames = 0;
+		// buffer fill before each write, in frames
+		long fill_min = -1;
+		long fill_max = 0;
+		double fill_sum = 0;
+		long last_fill = 0;
+
+		// latency reported by the backend when the stream was opened
+		double reported_latency = 0;
+		// time between a write returning and its last frame being played
+		double latency_min = -1;
+		double latency_max = 0;
+		double latency_sum = 0;
+		double last_latency = 0;
+		unsigned last_frames = 0;
+
+	private:
+		uint32_t sample_rate;
+		double start_time = 0;
+		double last_log = 0;
+		// counters at the time of the last log line
+		uint64_t logged_writes = 0;
+		uint64_t logged_underflows = 0;
+};
+
+// namespace midi
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+namespace midi {
+	class patch_set;
+}
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace midi {
+
+enum {
+	PATCH_SHAPE_SINE,
+	// sine squashed to ±1 everywhere but its zero crossings
+	PATCH_SHAPE_SQUARE,
+	PATCH_SHAPE_TRIANGLE,
+	PATCH_SHAPE_SAW,
+};
+
+enum {
+	PATCH_MAX_LAYERS = 4,
+	// every layer lowers to at most three steps, plus the drive and output
+	PATCH_MAX_STEPS = PATCH_MAX_LAYERS * 3 + 2,
+};
+
+// One oscillator in a patch, in the terms the patch file uses
+typedef struct patch_layer {
+	uint8_t shape;
+	// semitones from the note played, for octave and fifth layers
+	int8_t  transpose;
+	// pitch multiplier, from the detune in cents
+	double  ratio;
+	// the wave is pushed to ±1 wherever it's past this level, 1 and above
+	// leaves it alone
+	double  clip;
+	// the clip level moves by depth * sin(phase * rate), phase being the
+	// channel phase the note's pitch comes from
+	double  lfo_rate;
+	double  lfo_depth;
+	double  gain;
+} patch_layer_t;
+
+// Steps in a lowered patch. Each one runs over a whole block before the
+// next, on the scratch buffers synth::render_patch() keeps.
+enum {
+	// osc = shape(phase * note(key + transpose) * a)
+	PATCH_OP_SINE,
+	PATCH_OP_TRIANGLE,
+	PATCH_OP_SAW,
+	// squash osc past a fixed level a
+	PATCH_OP_CLIP,
+	// squash osc past a + c * sin(phase * b)
+	PATCH_OP_CLIP_LFO,
+	// acc += osc * a
+	PATCH_OP_MIX,
+	// push acc away from zero by a, then clamp to ±1
+	PATCH_OP_DRIVE,
+	// out = acc * a, always last
+	PATCH_OP_OUTPUT,
+};
+
+typedef struct patch_step {
+	uint8_t op;
+	int8_t  transpose;
+	double  a;
+	double  b;
+	double  c;
+} patch_step_t;
+
+// A patch lowered to a fixed list of block-wide steps. Everything the
+// patch file leaves at its default is left out here rather than tested
+// for while rendering, so the loops inside each step don't branch.
+typedef struct patch_plan {
+	patch_step_t steps[PATCH_MAX_STEPS];
+	unsigned count;
+} patch_plan_t;
+
+// turns a patch's layers into the steps which render it
+patch_plan_t lower_patch(const patch_layer_t *layers, unsigned count,
+                         double drive, double gain);
+
+// Instrument patches loaded from a text file, to replace the built in
+// instruments per program without rebuilding. Each patch starts with the
+// programs it's for, then up to PATCH_MAX_LAYERS layers:
+//
+//     patch 80-87
+//     layer sine clip=0.4
+//     gain 0.8
+//
+//     patch 24-31
+//     layer sine clip=0.5 gain=0.5
+//     layer sine transpose=12 clip=0.8 lfo=1:-0.125 gain=0.5
+//     gain 0.8
+//
+// Layer options are shape (sine, square, triangle or saw), transpose in
+// semitones, detune in cents, clip, lfo=rate:depth and gain. A patch can
+// also have a drive amount, as in the built in instruments' amplify().
+// patches/default.patch describes the built in instruments.
+class patch_set {
+	public:
+		// throws on anything it can't parse
+		patch_set(const char *path);
+
+		// plan for a program, NULL if the file doesn't cover it
+		const patch_plan_t *plan(uint8_t program) const {
+			int i = program_plan[program & 0x7f];
+			return (i < 0)? NULL : &plans[i];
+		}
+
+		unsigned count(void) const {
+			return plans.size();
+		}
+
+	private:
+		std::vector<patch_plan_t> plans;
+		int program_plan[128];
+};
+
+// namespace midi
+}
@@ -7,6 +7,8 @@ namespace midi {
 #include <midi/midi.h>
 #include <midi/player.h>
 #include <midi/synth.h>
+#include <midi/governor.h>
+#include <midi/outstats.h>
 #include <stdio.h>
 #include <portaudio.h>
 
@@ -14,14 +16,26 @@ namespace midi {
 
 class paudiosynth : public synth {
 	public:
-		paudiosynth(player *play, uint32_t rate);
+		// low_latency asks the device for its lowest latency and writes
+		// smaller blocks, at the cost of more CPU overhead
+		paudiosynth(player *play, uint32_t rate, bool low_latency = false);
 		~paudiosynth();
 
-		virtual void wait(uint32_t usecs);
+		virtual void output(uint32_t frames);
+		virtual void prefault(void);
+		virtual double output_latency(void);
+
+		output_stats stats;
+		governor gov;
+		// print the governor summary and output stats on close, which
+		// is only wanted with --stats or --output-log
+		bool report = false;
 
 	private:
 		PaStream* stream;
 		PaStreamParameters audio_params;
+		unsigned block_frames;
+		int16_t buffer[SYNTH_BLOCK_SIZE * SYNTH_CHANNELS];
 };
 
 // namespace midi
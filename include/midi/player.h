@@ -4,10 +4,14 @@ namespace midi {
 	class channel;
 	class player_track;
 	class player;
+	class live_input;
 }
 
 #include <midi/midi.h>
 #include <midi/synth.h>
+#include <midi/transport.h>
+#include <midi/tempo.h>
+#include <string>
 #include <vector>
 
 namespace midi {
@@ -15,16 +19,52 @@ namespace midi {
 enum {
 	PLAYER_INITIALIZED,
 	PLAYER_STARTED,
+	PLAYER_PAUSED,
 	PLAYER_STOPPED,
 };
 
+enum {
+	// events handed to the synth with each block, more than this many
+	// in one block get applied early
+	PLAYER_MAX_SCHEDULED = 1024,
+};
+
+// an event due part way through the block being output
+typedef struct scheduled_event {
+	// frames from the start of the block
+	uint32_t offset;
+	// the event's data in the track, or NULL for the end of the sequence
+	const void *data;
+	// status in effect, for events using running status
+	uint8_t status;
+} scheduled_event_t;
+
 class channel {
 	public:
 		channel();
 		void note_on(uint16_t midi_data);
 		void note_off(uint16_t midi_data);
+		void control_change(uint16_t midi_data);
+		void pitch_bend(uint16_t midi_data);
+		// releases everything, including keys held by the pedal
+		void all_notes_off(void);
+		void reset(void);
+		// appends everything about the channel, see snapshot.h
+		void save_state(std::string &out) const;
 
 		uint8_t instrument;
+		// CC7, CC11 and CC10, the synth turns these into per-channel gains
+		uint8_t volume;
+		uint8_t expression;
+		uint8_t pan;
+		// CC1, vibrato depth
+		uint8_t modulation;
+		// 14 bit pitch wheel position, 0x2000 is centered
+		uint16_t bend;
+		// full scale pitch wheel in semitones, set through RPN 0
+		uint8_t bend_range;
+		// CC64, note offs are held back while it's down
+		bool sustain;
 		// map of active notes and their current volumes
 		uint8_t notemap[128];
 
@@ -36,6 +76,13 @@ class channel {
 	private:
 		bool changed = false;
 		void regen_active(void);
+		void release_sustained(void);
+		void reset_controllers(void);
+
+		// keys released while the pedal was down
+		bool sustained[128];
+		// currently selected registered parameter, 0x3fff for none
+		uint16_t rpn;
 };
 
 class player_track {
@@ -47,6 +94,7 @@ class player_track {
 
 		void reset(void){
 			stream = ptrack.events();
+			next_tick = 0;
 			active = true;
 		}
 
@@ -59,23 +107,95 @@ class player_track {
 class player {
 	public:
 		player(file f);
+		// no file, for playing live input
+		player(void);
 		channel channels[16];
 		std::vector<player_track> tracks;
 
 		void load_tracks(file f);
+		// replace whatever was loaded with tracks parsed earlier, the data
+		// they point into has to outlive playback
+		void load(const std::vector<track> &trks, uint16_t division);
 		void dump_tracks(void);
-		void interpret(event &ev);
+		virtual void interpret(event &ev);
 		unsigned tracks_active(void);
 		void set_synth(synth *syn);
 
 		void play(void);
 		void loop(unsigned loops);
+		// back to the start with nothing played, only from the thread
+		// driving playback
+		void rewind(void);
+		// thread-safe, same as control.stop()
 		void stop(void);
+
+		// Pull-style playback: advance by at most the given number of frames,
+		// handling events as they come due and having the synth output the
+		// frames in between. Returns the number of frames output, which is
+		// only short once there's nothing left to play.
+		uint32_t step(uint32_t frames);
+		// only from the thread driving playback, others should use control
+		void seek(uint64_t usecs);
+
+		// Called by the synth before each run of frames it renders. Applies
+		// the events scheduled up to this point in the block, and returns
+		// how many of the given frames can be rendered before the next one.
+		uint32_t dispatch(uint32_t frames);
+
+		// play messages from a live input as they arrive, until it's closed
+		void play_live(live_input &in);
+
+		// commands from other threads, see transport.h
+		transport control;
 	
-		uint32_t usecs_per_tick;
-		uint32_t tick;
+		// frames output by step() since the last rewind or seek, and the
+		// frame the sequence ran out of events at, UINT64_MAX until then
+		uint64_t frames_played = 0;
+		uint64_t end_frame = UINT64_MAX;
+		// when set, every event is mixed in as it's applied, along with
+		// the frame it lands on, see rerender.h
+		uint64_t *event_hash = NULL;
+
+		// kept fractional, so that rounding doesn't pile up over a file,
+		// follows the file's tempo events as they're played
+		double usecs_per_tick;
+		// the file's tempo changes, for turning ticks into time
+		tempo_map clock;
+		uint32_t tick = 0;
 		unsigned state = PLAYER_INITIALIZED;
 		synth *synthesizer = NULL;
+
+	private:
+		// interprets every event due at the current tick, or with defer
+		// set, schedules them at the given offset into the block
+		uint32_t process_events(bool defer = false, uint32_t offset = 0);
+		bool schedule_block(uint32_t frames);
+		void schedule_event(const void *data, uint32_t offset, uint8_t status = 0);
+		void apply(const scheduled_event_t &sched);
+		void fingerprint(const scheduled_event_t &sched);
+		double frames_per_tick(void);
+		// follows a tempo event, SMPTE files keep their fixed tick length
+		void set_tempo(event &ev);
+		bool handle_commands(void);
+		void set_state(unsigned st);
+		void publish_position(double ticks);
+
+		double tempo_scale = 1.0;
+		uint16_t mute_mask = 0;
+		// set when a stop command ends playback, rather than running out
+		bool stop_requested = false;
+		// tick of the next event, and how many ticks are left to render
+		// before it. The fraction of a frame left over before each event
+		// carries over into the next gap, so rounding doesn't accumulate.
+		uint32_t event_tick = 0;
+		double ticks_pending = 0;
+
+		// events for the block being output, in order
+		scheduled_event_t schedule[PLAYER_MAX_SCHEDULED];
+		unsigned num_scheduled = 0;
+		unsigned next_scheduled = 0;
+		// frames into the block the synth has got to
+		uint32_t dispatch_cursor = 0;
 };
 
 // namespace midi
@@ -0,0 +1,117 @@
+#pragma once
+
+namespace midi {
+	class playlist_deck;
+	class playlist;
+}
+
+#include <midi/midi.h>
+#include <midi/player.h>
+#include <midi/pullsynth.h>
+#include <midi/master.h>
+#include <midi/server.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace midi {
+
+enum {
+	// free for the prefetch thread to load into
+	DECK_EMPTY,
+	DECK_LOADING,
+	// loaded and waiting for its turn
+	DECK_READY,
+	DECK_PLAYING,
+};
+
+// One song's worth of playback, rendered into its own block buffer
+class playlist_deck {
+	public:
+		playlist_deck(uint32_t rate);
+
+		player seq;
+		pullsynth syn;
+		// keeps the data seq points into alive
+		sequence_ref data;
+		std::string path;
+		// position in the playlist
+		size_t index = 0;
+		// frames until the last event, worked out when it's loaded
+		uint64_t length = 0;
+		std::atomic<unsigned> state{DECK_EMPTY};
+
+		// 1 while fading in, -1 while fading out, from the playlist frame
+		// in fade_start
+		int fade = 0;
+		uint64_t fade_start = 0;
+		// frames of this block rendered, the rest is silence
+		unsigned rendered = 0;
+		float buf[SYNTH_BLOCK_SIZE * SYNTH_CHANNELS];
+};
+
+// Plays a list of files back to back through one output, as the source of
+// an output backend's synth. A background thread reads and parses the next
+// file into the idle deck while the current one plays, so it's ready to
+// start at the exact frame the current one runs out of events, with the
+// current one's tail ringing out underneath. With a crossfade, the next
+// song starts that much before the end of the current one, and the two are
+// faded linearly across it.
+class playlist : public frame_source {
+	public:
+		playlist(const std::vector<std::string> &paths, uint32_t rate,
+		         double crossfade_secs = 0,
+		         unsigned effect = MASTER_EFFECT_NONE);
+		~playlist();
+
+		virtual void render(float *buf, unsigned frames);
+		// true once every song has been played out
+		bool finished(void);
+
+		// Offline renders should set this, so that render() waits for a
+		// song that hasn't finished loading rather than playing silence
+		bool wait_for_prefetch = false;
+
+		// songs started so far
+		std::atomic<unsigned> songs_played{0};
+
+	private:
+		void prefetch(void);
+		void load(playlist_deck &deck, const std::string &path);
+		// the ready deck, if any, otherwise waits for one when
+		// wait_for_prefetch is set, returns -1 if there isn't one
+		int next_deck(void);
+		void start(int deck, unsigned offset);
+		void retire(int deck);
+		void render_deck(playlist_deck &deck, unsigned offset, unsigned frames);
+		float gain(const playlist_deck &deck, uint64_t frame);
+
+		std::vector<std::string> paths;
+		sequence_cache cache;
+		uint32_t sample_rate;
+		uint64_t crossfade;
+		unsigned effect;
+
+		playlist_deck decks[2];
+		// playing and coming up next, or the one being faded out or
+		// ringing out after its end
+		int current = -1;
+		int outgoing = -1;
+		// frames output so far
+		uint64_t now = 0;
+
+		std::thread loader;
+		std::mutex lock;
+		std::condition_variable wanted;
+		std::condition_variable loaded;
+		size_t next_path = 0;
+		std::atomic<bool> exhausted{false};
+		bool quit = false;
+};
+
+// namespace midi
+}
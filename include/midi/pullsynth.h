@@ -0,0 +1,28 @@
+#pragma once
+
+namespace midi {
+	class pullsynth;
+}
+
+#include <midi/midi.h>
+#include <midi/player.h>
+#include <midi/synth.h>
+
+namespace midi {
+
+// Output backend for hosts which pull audio themselves. Interleaved frames
+// are rendered straight into the buffer given to set_target(), which is
+// advanced as frames are output.
+class pullsynth : public synth {
+	public:
+		pullsynth(player *play, uint32_t rate);
+
+		void set_target(float *dst);
+		virtual void output(uint32_t frames);
+
+	private:
+		float *target = NULL;
+};
+
+// namespace midi
+}
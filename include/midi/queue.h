@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace midi {
+
+// Bounded single-producer, single-consumer queue. Both ends are wait-free:
+// push() fails when the queue is full and pop() fails when it's empty,
+// neither ever blocks or allocates. N must be a power of two.
+template <typename T, size_t N>
+class spsc_queue {
+	static_assert((N & (N - 1)) == 0, "queue size must be a power of two");
+
+	public:
+		bool push(const T &item){
+			size_t t = tail.load(std::memory_order_relaxed);
+
+			if (t - head.load(std::memory_order_acquire) == N){
+				return false;
+			}
+
+			items[t & (N - 1)] = item;
+			tail.store(t + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool pop(T &item){
+			size_t h = head.load(std::memory_order_relaxed);
+
+			if (h == tail.load(std::memory_order_acquire)){
+				return false;
+			}
+
+			item = items[h & (N - 1)];
+			head.store(h + 1, std::memory_order_release);
+			return true;
+		}
+
+		size_t size(void){
+			return tail.load(std::memory_order_acquire)
+			     - head.load(std::memory_order_acquire);
+		}
+
+	private:
+		// keep the two ends on separate cache lines so the producer and
+		// consumer don't bounce one line between them
+		alignas(64) std::atomic<size_t> head{0};
+		alignas(64) std::atomic<size_t> tail{0};
+		T items[N];
+};
+
+// Bounded multi-producer, single-consumer queue, for when more than one
+// thread feeds the same consumer. Each slot carries a sequence number, so
+// producers only contend on claiming a slot with a compare and swap and
+// never wait on each other or on the consumer. push() fails when full.
+template <typename T, size_t N>
+class mpsc_queue {
+	static_assert((N & (N - 1)) == 0, "queue size must be a power of two");
+
+	public:
+		mpsc_queue(){
+			for (size_t i = 0; i < N; i++) {
+				cells[i].seq.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		bool push(const T &item){
+			size_t t = tail.load(std::memory_order_relaxed);
+			cell *c;
+
+			for (;;) {
+				c = &cells[t & (N - 1)];
+				intptr_t diff = (intptr_t)c->seq.load(std::memory_order_acquire)
+				              - (intptr_t)t;
+
+				if (diff == 0){
+					if (tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed)){
+						break;
+					}
+
+				} else if (diff < 0){
+					// the consumer hasn't got to this slot from last time
+					return false;
+
+				} else {
+					t = tail.load(std::memory_order_relaxed);
+				}
+			}
+
+			c->item = item;
+			c->seq.store(t + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool pop(T &item){
+			size_t h = head.load(std::memory_order_relaxed);
+			cell *c = &cells[h & (N - 1)];
+
+			if (c->seq.load(std::memory_order_acquire) != h + 1){
+				return false;
+			}
+
+			item = c->item;
+			c->seq.store(h + N, std::memory_order_release);
+			head.store(h + 1, std::memory_order_relaxed);
+			return true;
+		}
+
+	private:
+		struct cell {
+			std::atomic<size_t> seq;
+			T item;
+		};
+
+		alignas(64) std::atomic<size_t> head{0};
+		alignas(64) std::atomic<size_t> tail{0};
+		cell cells[N];
+};
+
+// namespace midi
+}
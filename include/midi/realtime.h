@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace midi {
+
+// Setup for running the render loop on a real-time thread. Each step
+// degrades gracefully, returning false and leaving things as they were if
+// the system won't allow it.
+bool realtime_schedule(void);
+bool realtime_lock_memory(void);
+// touch enough stack that the render path won't take page faults on it
+void realtime_prefault_stack(void);
+
+// Marks the calling thread as the render thread. Until realtime_leave(),
+// any heap allocation or hot-path stdio from that thread is a violation.
+void realtime_enter(void);
+void realtime_leave(void);
+bool realtime_thread(void);
+
+// called by code paths which print, before they print, and by the stdio
+// replacements in rtalloc.cpp
+void realtime_check_stdio(void);
+// called by the allocator replacements in rtalloc.cpp, which is only linked
+// into the midithing binary so that the library leaves hosts' allocators
+// and stdio be
+void realtime_note_allocation(void);
+
+typedef struct realtime_violations {
+	unsigned long allocations;
+	unsigned long stdio;
+} realtime_violations_t;
+
+realtime_violations_t realtime_get_violations(void);
+
+// namespace midi
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+namespace midi {
+	class render_stats;
+}
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace midi {
+
+enum {
+	// gathering and applying events
+	STAGE_SEQUENCE,
+	// rendering and mixing
+	STAGE_SYNTH,
+	// everything else in the backend's output(), including any time spent
+	// waiting on the device
+	STAGE_OUTPUT,
+
+	STAGE_END,
+};
+
+enum {
+	// per-block time histogram, bucket n counts blocks that took under
+	// 2^n * 16us, the last catches everything else
+	RENDER_HISTOGRAM_BUCKETS = 13,
+};
+
+// Where render time goes, for --stats. Timestamps are taken a few times per
+// block with clock_gettime(), never per sample, so leaving this attached
+// costs next to nothing.
+class render_stats {
+	public:
+		render_stats(uint32_t rate);
+
+		// monotonic clock in nanoseconds
+		static uint64_t now(void);
+
+		void add(unsigned stage, uint64_t ns);
+		// Each block goes block_start(), sequencing, output_start(), the
+		// backend's output(), block_end(). Time between the first two is
+		// sequencing, time in output() not add()ed by the synth is output.
+		void block_start(void);
+		void output_start(void);
+		void block_end(unsigned frames);
+		// after each run of frames the synth renders
+		void voices(unsigned active, unsigned frames);
+
+		void dump(FILE *fp);
+		void log_line(FILE *fp);
+
+		// print a log line once per second of wall time
+		bool log_per_second = false;
+
+		uint64_t stage_ns[STAGE_END] = {0};
+		uint64_t events = 0;
+		uint64_t frames = 0;
+		uint64_t blocks = 0;
+		unsigned peak_voices = 0;
+		// active voices summed over every frame, for the mean
+		double voice_frames = 0;
+		uint64_t histogram[RENDER_HISTOGRAM_BUCKETS] = {0};
+		// blocks which took longer to render than they last
+		uint64_t late_blocks = 0;
+
+	private:
+		uint32_t sample_rate;
+		uint64_t block_begin = 0;
+		uint64_t output_begin = 0;
+		// sequence and synth time in the current block, in total and
+		// before output()
+		uint64_t block_inner = 0;
+		uint64_t inner_before = 0;
+		uint64_t last_log = 0;
+		uint64_t logged_frames = 0;
+		uint64_t logged_ns = 0;
+};
+
+// namespace midi
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+namespace midi {
+	class rerender_synth;
+}
+
+#include <midi/player.h>
+#include <midi/synth.h>
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace midi {
+
+enum {
+	// blocks in a segment, the unit that's fingerprinted and re-rendered,
+	// about 1.5 seconds at 44.1kHz
+	RERENDER_SEGMENT_BLOCKS = 128,
+	RERENDER_SEGMENT_FRAMES = RERENDER_SEGMENT_BLOCKS * SYNTH_BLOCK_SIZE,
+	// bumped whenever the same file and settings would render differently,
+	// so older journals aren't patched from
+	RERENDER_VERSION = 2,
+};
+
+// The journal is this header, the synth state snapshots, then the segment
+// table, all in host byte order.
+typedef struct rerender_header {
+	uint8_t  magic[4]; // "MTRR"
+	uint16_t version;
+	uint16_t segment_blocks;
+	uint32_t rate;
+	uint32_t segments;
+	// whatever else the caller says changes the sound
+	uint64_t settings;
+	// frames in the .wav, and its modification time once written, so a
+	// .wav written by something else isn't patched
+	uint64_t frames;
+	int64_t  wav_sec;
+	int64_t  wav_nsec;
+	// where the segment table starts
+	uint64_t table;
+} __attribute__((packed)) rerender_header_t;
+
+typedef struct rerender_segment {
+	// events applied during the segment and the frames they landed on
+	uint64_t events;
+	// synth and channel state at the start of the segment
+	uint64_t state;
+	// the synth's saved state at the start of the segment
+	uint64_t offset;
+	uint64_t length;
+} __attribute__((packed)) rerender_segment_t;
+
+// Offline .wav render which keeps a journal next to its output, as
+// file.wav.state, so that rendering an edited file again only redoes what
+// the edit changed. The journal has a fingerprint of the events in each
+// segment, and a snapshot and hash of the synth and channel state at the
+// start of each.
+//
+// A re-render sequences the new file without rendering it to fingerprint
+// its segments, and starts rendering from the first one that differs,
+// with the synth loaded from that segment's snapshot, writing over that
+// part of the .wav in place. Once it's past the last segment that differs
+// and the state at a segment start hashes the same as it did last time,
+// everything from there on would come out the same, so it stops. A note
+// changed in the middle of a long file costs the segment it's in plus
+// however long the tail takes to die away, and the output is the same as
+// a full render of the edited file.
+class rerender_synth : public synth {
+	public:
+		rerender_synth(player *play, uint32_t rate, std::string outfile,
+		               uint64_t settings);
+		~rerender_synth();
+
+		// renders the player's sequence, throws if the output can't be
+		// written. A journal that's missing or doesn't match means a full
+		// render.
+		void run(void);
+		virtual void output(uint32_t frames);
+
+		// frames rendered by run(), and kept from the last output
+		uint64_t rendered = 0;
+		uint64_t reused = 0;
+
+	private:
+		// maps the last journal in if it's usable with this render
+		bool open_journal(void);
+		void close_journal(void);
+		// event fingerprints of each segment of the new sequence
+		std::vector<uint64_t> fingerprint(void);
+		uint64_t state_hash(const std::string &state);
+		// old entry for a segment, past the end is no events at all
+		uint64_t old_events(size_t segment);
+
+		player *play;
+		std::string path;
+		std::string journal_path;
+		uint64_t settings;
+		int fd = -1;
+
+		// while set, output() only dispatches events
+		bool skipping = false;
+		// frames output since the start of the sequence
+		uint64_t position = 0;
+		// the player mixes each segment's events in here
+		uint64_t segment_events;
+		int16_t buffer[SYNTH_BLOCK_SIZE * SYNTH_CHANNELS];
+
+		// last journal
+		const uint8_t *journal = NULL;
+		size_t journal_size = 0;
+		const rerender_header_t *old_header = NULL;
+		const rerender_segment_t *old_table = NULL;
+};
+
+// namespace midi
+}
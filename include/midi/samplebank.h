@@ -0,0 +1,80 @@
+#pragma once
+
+namespace midi {
+	class sample_bank;
+}
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace midi {
+
+enum {
+	BANK_VERSION = 1,
+	// zone loops between loop_start and loop_end until the voice dies,
+	// otherwise it stops at end
+	BANK_ZONE_LOOP = 1,
+	// returned by sample_bank::find() when nothing covers the note
+	BANK_NO_ZONE = 0xffff,
+};
+
+// Sample bank file layout, little endian, see tools/mkbank.py. The header
+// is followed by zone_count zones sorted by program, then the sample data
+// at data_offset as mono 16 bit PCM.
+typedef struct bank_header {
+	char     magic[4];
+	uint16_t version;
+	uint16_t zone_count;
+	uint32_t data_offset;
+	uint32_t data_frames;
+} bank_header_t;
+
+// a range of keys and velocities on one program, played from one sample
+typedef struct bank_zone {
+	uint8_t  program;
+	uint8_t  key_lo;
+	uint8_t  key_hi;
+	uint8_t  vel_lo;
+	uint8_t  vel_hi;
+	// key the sample plays back at its own pitch on
+	uint8_t  root_key;
+	// fine tuning in cents
+	int8_t   tune;
+	uint8_t  flags;
+	uint32_t sample_rate;
+	// frames into the sample data, end and loop_end are exclusive
+	uint32_t start;
+	uint32_t end;
+	uint32_t loop_start;
+	uint32_t loop_end;
+} bank_zone_t;
+
+// A sample bank mapped read-only from its file. Only the header and zones
+// are read when it's opened, sample data is paged in as voices play it, so
+// opening a big bank is instant and only what's played ends up resident.
+// Pages are shared with any other process mapping the same file, and one
+// bank can be handed to any number of synths.
+class sample_bank {
+	public:
+		// throws if the file can't be mapped or doesn't check out
+		sample_bank(const char *path);
+		~sample_bank();
+
+		// index of the zone to play a note with, or BANK_NO_ZONE if the
+		// program isn't in the bank or has nothing for the note
+		unsigned find(uint8_t program, uint8_t key, uint8_t velocity) const;
+
+		const bank_zone_t *zones;
+		unsigned zone_count;
+		const int16_t *samples;
+		uint32_t frames;
+
+	private:
+		void *map;
+		size_t map_size;
+		// zones for program n are first[n] up to first[n + 1]
+		uint16_t first[129];
+};
+
+// namespace midi
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+namespace midi {
+	class sequence_cache;
+	class render_server;
+}
+
+#include <midi/midi.h>
+#include <midi/player.h>
+#include <midi/wavsynth.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace midi {
+
+// a file's bytes along with its validated track table, ready to be handed
+// to player::load() without touching the data again
+typedef struct cached_sequence {
+	std::string key;
+	std::string data;
+	uint16_t division;
+	std::vector<track> tracks;
+} cached_sequence_t;
+
+typedef std::shared_ptr<const cached_sequence_t> sequence_ref;
+
+// LRU cache of parsed sequences, bounded by the total size of the files it
+// holds. Entries are reference counted, so evicting one doesn't pull it out
+// from under a render that's still using it. Safe to use from any thread.
+class sequence_cache {
+	public:
+		sequence_cache(size_t max_bytes);
+
+		// keyed by path, size and modification time, so edits are noticed
+		sequence_ref from_path(std::string path, bool &hit);
+		// keyed by a hash of the contents
+		sequence_ref from_bytes(std::string &bytes, bool &hit);
+
+		std::atomic<uint64_t> hits{0};
+		std::atomic<uint64_t> misses{0};
+		size_t entries(void);
+		size_t bytes(void);
+
+	private:
+		sequence_ref lookup(const std::string &key);
+		sequence_ref insert(std::string key, std::string &data);
+
+		std::mutex lock;
+		size_t max_bytes;
+		size_t total_bytes = 0;
+		// most recently used at the front
+		std::list<sequence_ref> lru;
+		std::unordered_map<std::string, std::list<sequence_ref>::iterator> index;
+};
+
+// Long running render daemon on a unix domain socket. Connections are queued
+// for a fixed pool of workers, each of which keeps its own player and synth
+// around between jobs. Once the queue is full the accept loop stops taking
+// connections until a worker frees up, so clients back up in the listen
+// backlog instead of the server piling up work.
+//
+// The protocol is line based, one request per line, any number of requests
+// per connection:
+//
+//   render <wav|raw> <output> <midi file> [start ms] [end ms]
+//   render-bytes <wav|raw> <output> <length> [start ms] [end ms]
+//       followed by <length> bytes of MIDI file
+//   stats
+//
+// and each request gets a single line back, either "ok ..." or "error ...".
+// Paths are as seen by the server and can't contain spaces.
+class render_server {
+	public:
+		render_server(std::string socket_path, unsigned workers,
+		              size_t cache_bytes = 64 << 20);
+		~render_server();
+
+		// accept connections forever
+		void run(void);
+
+	private:
+		class connection;
+		void worker(void);
+		void serve(connection &conn, player &seq, wavsynth &out);
+		std::string render(std::vector<std::string> &req, connection &conn,
+		                   player &seq, wavsynth &out);
+		std::string stats(void);
+
+		uint32_t rate = 44100;
+		int listen_fd = -1;
+		std::string path;
+		sequence_cache cache;
+
+		std::vector<std::thread> workers;
+		std::mutex lock;
+		std::condition_variable queued;
+		std::condition_variable dequeued;
+		std::deque<int> pending;
+		size_t max_pending;
+		bool stopping = false;
+
+		uint64_t jobs = 0;
+		uint64_t failed = 0;
+		uint64_t frames = 0;
+};
+
+// namespace midi
+}
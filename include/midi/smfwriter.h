@@ -0,0 +1,44 @@
+#pragma once
+
+#include <midi/midi.h>
+#include <stdint.h>
+#include <vector>
+
+namespace midi {
+
+typedef struct smf_options {
+	// merge every track into one and write a format 0 file
+	bool flatten;
+} smf_options_t;
+
+typedef struct smf_stats {
+	uint64_t events_in;
+	uint64_t events_out;
+	// tracks cut short at a status byte MIDI files don't define, which is
+	// also where playback stops
+	uint16_t truncated_tracks;
+	uint64_t bytes;
+} smf_stats_t;
+
+// Writes tracks back out as a Standard MIDI File, normalized to take as
+// little space as it can while playing the same:
+//
+// - running status wherever consecutive channel messages share a status,
+//   which is reset after meta events the way the standard asks
+// - note offs become zero velocity note ons, so they can share running
+//   status with the note ons around them, unless they carry a release
+//   velocity other than the defaults of 0 or 64
+// - program changes, pitch wheel moves and controller values which don't
+//   change anything on their channel are dropped
+//
+// Tracks are read the way the player reads them. Sysex and meta events,
+// ones the player ignores included, are copied through as they are, and
+// anything after a status byte no MIDI file should hold is left out.
+// Output goes through a buffered_writer, one track at a time. Throws on
+// write errors, or when asked to flatten a format 2 file, which has no
+// single timeline to flatten onto.
+smf_stats_t write_smf(const std::vector<track> &tracks, uint16_t format,
+                      uint16_t division, const smf_options_t &opts, int fd);
+
+// namespace midi
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+namespace midi {
+
+// Render state is saved as the raw bytes of one field after another, in
+// host byte order. Fields go in one at a time rather than as whole structs,
+// so that padding never ends up in a snapshot and equal states always give
+// equal bytes. Snapshots are only read back by the build that wrote them,
+// see rerender.h.
+template <typename T>
+inline void save_field(std::string &out, const T &x){
+	out.append((const char *)&x, sizeof(x));
+}
+
+// throws if there isn't a whole field left
+template <typename T>
+inline void load_field(const uint8_t *&ptr, const uint8_t *end, T &x){
+	if ((size_t)(end - ptr) < sizeof(x)){
+		throw "render state is truncated";
+	}
+
+	memcpy(&x, ptr, sizeof(x));
+	ptr += sizeof(x);
+}
+
+static const uint64_t FNV_BASIS = 0xcbf29ce484222325ULL;
+
+// 64 bit FNV-1a, start from FNV_BASIS
+inline uint64_t fnv_hash(uint64_t hash, const void *ptr, size_t len){
+	const uint8_t *p = (const uint8_t *)ptr;
+
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+// namespace midi
+}
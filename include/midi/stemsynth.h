@@ -0,0 +1,87 @@
+#pragma once
+
+namespace midi {
+	class stemsynth;
+}
+
+#include <midi/synth.h>
+#include <midi/export.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace midi {
+
+enum {
+	// one stem per MIDI channel, then the master mix
+	STEM_MASTER = 16,
+	STEM_FILES,
+	// blocks the render thread can get ahead of the slowest writer
+	STEM_SLOTS = 8,
+};
+
+// Renders a sequence once and writes each MIDI channel to its own .wav file
+// alongside the master mix, as prefix-chNN.wav (prefix-drums.wav for
+// channel 10) and prefix-master.wav. Stems are taken before the master
+// chain, so they're what a mix engineer would want to rebalance, while the
+// master file is the same as `midithing wav` would write.
+//
+// The render thread only converts each block into a slot of a small ring,
+// a pool of writer threads takes it from there. Each writer owns a fixed
+// set of the files, so every file is written in order without the writers
+// having to coordinate beyond the ring.
+class stemsynth : public synth, public stem_sink {
+	public:
+		// throws if any of the files can't be opened
+		stemsynth(player *play, uint32_t rate, std::string prefix,
+		          unsigned writers = 4);
+		~stemsynth();
+
+		virtual void output(uint32_t frames);
+		virtual void stem(unsigned channel, const float *left,
+		                  const float *right, unsigned frames);
+
+		// waits for the writers, finishes the files and removes stems
+		// which never made a sound, returns the number kept
+		unsigned close(void);
+
+		// paths of the stems close() kept, master last
+		std::vector<std::string> written;
+
+	private:
+		typedef struct stem_file {
+			std::string path;
+			int fd;
+			std::unique_ptr<buffered_writer> out;
+			bool audible;
+			bool failed;
+		} stem_file_t;
+
+		void writer(unsigned index);
+
+		std::vector<stem_file_t> files;
+		std::vector<std::thread> writers;
+		bool closed = false;
+
+		// interleaved stereo per file, for each slot of the ring
+		int16_t slots[STEM_SLOTS][STEM_FILES][SYNTH_BLOCK_SIZE * SYNTH_CHANNELS];
+		unsigned slot_frames[STEM_SLOTS];
+		// frames of the current block each stem has been given
+		unsigned stem_pos[16];
+		float master_buf[SYNTH_BLOCK_SIZE * SYNTH_CHANNELS];
+
+		std::mutex lock;
+		std::condition_variable published_cv;
+		std::condition_variable written_cv;
+		// blocks handed to the writers, and taken by each writer
+		uint64_t published = 0;
+		std::vector<uint64_t> taken;
+		bool finishing = false;
+};
+
+// namespace midi
+}
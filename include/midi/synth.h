@@ -2,34 +2,267 @@
 
 namespace midi {
 	class synth;
+	class frame_source;
+	class stem_sink;
 }
 
 #include <midi/midi.h>
 #include <midi/player.h>
+#include <midi/master.h>
+#include <midi/renderstats.h>
+#include <midi/samplebank.h>
+#include <midi/patch.h>
 
 
 namespace midi {
 
+enum {
+	// upper bound on simultaneously rendered instrument voices,
+	// 15 melodic channels with every key held
+	SYNTH_MAX_VOICES = 15 * 128,
+
+	// frames rendered per block by the output backends
+	SYNTH_BLOCK_SIZE = 512,
+
+	// output is interleaved stereo, left first
+	SYNTH_CHANNELS = 2,
+
+	// frames between updates of controller driven parameters, which are
+	// ramped linearly in between. Updates fall on a fixed grid, however
+	// blocks end up split.
+	SYNTH_CONTROL_BLOCK = 64,
+};
+
+// knobs which trade fidelity for render cost, see governor.h
+typedef struct synth_quality {
+	// hard cap on voices rendered per block, quietest are stolen first
+	unsigned max_voices;
+	// voices with a velocity below this are dropped entirely
+	uint8_t  min_velocity;
+	// replace instrument timbres with a plain square wave
+	bool     cheap_oscillators;
+	// replace the drum kit with short noise/square bursts
+	bool     simple_drums;
+} synth_quality_t;
+
+enum {
+	ENVELOPE_ATTACK,
+	ENVELOPE_DECAY,
+	ENVELOPE_SUSTAIN,
+	ENVELOPE_RELEASE,
+	// silent, retired once the key is up
+	ENVELOPE_DONE,
+};
+
+// per instrument family, rates are per control block
+typedef struct envelope {
+	float attack_step;
+	float decay_coeff;
+	float sustain;
+	float release_coeff;
+} envelope_t;
+
+// Voices live from note on until their release reaches silence. Velocity
+// and instrument are taken when the note starts, and so is the sample bank
+// zone if the program has one.
+typedef struct voice {
+	uint8_t channel;
+	uint8_t key;
+	uint8_t velocity;
+	uint8_t instrument;
+	uint8_t stage;
+	// current envelope level, which ramps by step each frame to reach
+	// target at the end of the control block
+	float   level;
+	float   target;
+	float   step;
+	// BANK_NO_ZONE for the built in instruments
+	uint16_t zone;
+	// sample frames played per output frame at the channel's natural pitch
+	float   pitch;
+	// position in the bank's sample data
+	double  pos;
+} voice_t;
+
+// Something other than a synth's own voices for its output backend to
+// play, see synth::source
+class frame_source {
+	public:
+		virtual ~frame_source(){}
+		// interleaved stereo, up to SYNTH_BLOCK_SIZE frames at a time
+		virtual void render(float *buf, unsigned frames) = 0;
+};
+
+// Gets each MIDI channel's share of the mix, see synth::stems
+class stem_sink {
+	public:
+		virtual ~stem_sink(){}
+		// Called for all 16 channels in order, silent ones included, for
+		// every run of frames rendered. Panned and at the channel's
+		// volume, but before the master chain, so the stems of a block add
+		// up to its mix going into the limiter.
+		virtual void stem(unsigned channel, const float *left,
+		                  const float *right, unsigned frames) = 0;
+};
+
 class synth {
 	public:
 		synth(player *play, uint32_t rate);
 		~synth();
-		virtual void wait(uint32_t usecs) = 0;
+		// render and output the given number of frames
+		virtual void output(uint32_t frames) = 0;
+		// seconds until the start of the last output block is heard, for
+		// backends which are played in real time
+		virtual double output_latency(void);
+		uint32_t rate(void);
+
+		// back to the state of a freshly constructed synth, so that an
+		// instance can be reused for another render
+		void reset(void);
+		void set_quality(const synth_quality_t &q);
+		// bit n set mutes channel n
+		void set_mute_mask(uint16_t mask);
+		// while paused, render() gives silence and leaves voices, effect
+		// tails and the note clock where they were, to carry on from there
+		void set_paused(bool pause);
+		// true while any voice or drum hasn't died away yet
+		bool sounding(void);
+		// fault in everything the render path touches, so that it doesn't
+		// take page faults once playback starts
+		virtual void prefault(void);
+
+		// Appends everything the synth carries from one block to the next,
+		// master chain included, see snapshot.h. Loading it into a synth
+		// with the same rate, effect, bank and patches, driven by a player
+		// at the same point in the same sequence, carries on exactly where
+		// the saving one was. The player's own state isn't included.
+		void save_state(std::string &out) const;
+		// throws if the data is short or doesn't fit
+		void load_state(const uint8_t *ptr, size_t len);
+
+		// limiter and effects run over the final mix
+		master_chain master;
+		// where render time goes, for --stats, not kept if NULL
+		render_stats *timing = NULL;
+		// when set, output() plays frames from here instead of rendering
+		// anything itself, and the synth doesn't need a player
+		frame_source *source = NULL;
+		// programs with zones in the bank are played from it instead of
+		// the built in instruments, the bank must outlive the synth
+		const sample_bank *bank = NULL;
+		// programs with patches are played with them instead of the built
+		// in instruments, unless the bank has them
+		const patch_set *patches = NULL;
+		// when set, gets every channel's output as it's mixed
+		stem_sink *stems = NULL;
 
 	protected:
-		int16_t next_sample(void);
+		// render interleaved stereo frames, buf needs room for
+		// frames * SYNTH_CHANNELS samples. Channel state must not change
+		// while a block is being rendered.
+		void render(int16_t *buf, unsigned frames);
+		// same, with samples in [-1, 1]
+		void render(float *buf, unsigned frames);
+		void prefault_render(int16_t *buf, unsigned frames);
+		// applies the events due over the given frames without rendering
+		// anything, leaving the synth as it was
+		void skip(unsigned frames);
 		uint32_t sample_rate;
 
-		double kick(unsigned index, double tick);
-		double snare(unsigned index, double tick);
-		double tom(unsigned index, double tick);
+		// sweep is the current pitch of the drum's falling tone
+		double kick(unsigned index, double tick, double sweep);
+		double snare(unsigned index, double tick, double sweep);
+		double tom(unsigned index, double tick, double sweep);
 		double hihat(unsigned index, double tick);
-		double do_percussion(unsigned index, double tick);
+		double do_percussion(unsigned index, double tick, double sweep);
+		double simple_percussion(unsigned index, double tick);
 		double perc_time;
 
 	private:
+		void begin_block(void);
+		// dispatches whatever's due and renders up to the next event,
+		// returns the number of frames in mix_buf
+		unsigned render_chunk(unsigned frames);
+		void update_voices(void);
+		// restart the current envelope segment from where the voice is
+		void retarget(voice_t &vo);
+		void steal_voices(void);
+		// renders up to SYNTH_BLOCK_SIZE frames into mix_buf
+		void render_block(unsigned frames);
+		void render_percussion(unsigned frames);
+		void mix_channels(unsigned frames);
+		// fills phase_buf for a channel with voices this block
+		void channel_phase(unsigned k, unsigned frames);
+		// picks a zone for a voice and starts it from the top
+		void start_sample(voice_t &vo);
+		// fills voice_buf from a voice's zone, following phase_buf
+		void render_sample(voice_t &vo, unsigned frames);
+		// fills voice_buf by running a patch's steps over phase_buf
+		void render_patch(const voice_t &vo, const patch_plan_t &plan,
+		                  unsigned frames);
+		void idle_channel(unsigned k);
+
 		player *sequencer;
 		double tick;
+		double increment;
+
+		// Each melodic channel advances its own phase by the pitch ratio
+		// from its wheel and vibrato, so bends don't make voices jump.
+		// Channels without voices just follow tick.
+		double chan_tick[16];
+		// ratio now, and ramping towards the one at the next update
+		double chan_ratio[16];
+		double chan_target[16];
+		double chan_step[16];
+		// frames until the next control update
+		unsigned control_left;
+		// pitch bend in semitones, smoothed at control rate
+		double chan_bend[16];
+		double control_coeff;
+		double vibrato_phase;
+		double vibrato_inc;
+		double phase_buf[SYNTH_BLOCK_SIZE];
+		// channel phase at the start of the block, before phase_buf[0]
+		double phase_origin;
+
+		// samples left on each triggered drum, keys 35 to 81 on channel 10
+		uint16_t percussion_buf[0x40];
+		unsigned noise_state;
+
+		// Mix bus, each MIDI channel is rendered into its own buffer and
+		// then panned into the stereo mix. Gains ramp from where they were
+		// at the end of the last block to the channel's current pan and
+		// volume over the course of each block.
+		alignas(16) float channel_buf[16][SYNTH_BLOCK_SIZE];
+		alignas(16) float mix_buf[SYNTH_CHANNELS][SYNTH_BLOCK_SIZE];
+		// one channel's part of mix_buf, for stems
+		alignas(16) float stem_buf[SYNTH_CHANNELS][SYNTH_BLOCK_SIZE];
+		double tick_buf[SYNTH_BLOCK_SIZE];
+		// the four samples around each frame's position, then the
+		// interpolated voice, for sample voices
+		alignas(16) float tap_buf[4][SYNTH_BLOCK_SIZE];
+		alignas(16) float frac_buf[SYNTH_BLOCK_SIZE];
+		alignas(16) float voice_buf[SYNTH_BLOCK_SIZE];
+		// oscillator and mix for patches
+		double patch_osc[SYNTH_BLOCK_SIZE];
+		double patch_acc[SYNTH_BLOCK_SIZE];
+		float gains[16][SYNTH_CHANNELS];
+		// channels with something in channel_buf this block
+		uint16_t channels_used;
+
+		synth_quality_t quality;
+		voice_t voices[SYNTH_MAX_VOICES];
+		unsigned num_voices = 0;
+		// indexes of the voices rendered this block, in channel order
+		uint16_t render_list[SYNTH_MAX_VOICES];
+		unsigned num_rendered = 0;
+		unsigned num_stolen = 0;
+		envelope_t envelopes[16];
+
+		uint16_t mute_mask = 0;
+		bool drums_muted = false;
+		bool paused = false;
+		float source_buf[SYNTH_BLOCK_SIZE * SYNTH_CHANNELS];
 };
 
 // namespace midi
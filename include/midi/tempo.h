@@ -0,0 +1,51 @@
+#pragma once
+
+namespace midi {
+	class tempo_map;
+}
+
+#include <midi/midi.h>
+#include <stdint.h>
+#include <vector>
+
+namespace midi {
+
+typedef struct tempo_change {
+	uint32_t tick;
+	uint32_t usecs_per_quarter;
+	// time at which this tempo takes effect
+	uint64_t usecs;
+} tempo_change_t;
+
+// Converts ticks to microseconds following the tempo changes in every
+// track of a file, or its SMPTE division if it has one. Lookups walk
+// forward from the last one, so they're cheapest in increasing order, an
+// earlier tick starts the walk over.
+class tempo_map {
+	public:
+		tempo_map(file f);
+		// same, for tracks parsed earlier
+		tempo_map(const std::vector<track> &trks, uint16_t division);
+		// 120 bpm throughout, at one tick per quarter
+		tempo_map(void);
+
+		void rewind(void);
+		uint64_t usecs(uint32_t tick);
+		// number of tempo events in the file
+		size_t changes(void);
+		// length of a tick at the given tempo, SMPTE divisions have no
+		// tempo and always give the same length
+		double tick_usecs(uint32_t usecs_per_quarter);
+
+	private:
+		void build(const std::vector<track> &trks, uint16_t division);
+		uint64_t to_usecs(const tempo_change_t &t, uint32_t ticks);
+
+		std::vector<tempo_change_t> tempos;
+		size_t current = 0;
+		uint32_t ticks_per_quarter = 1;
+		double smpte_usecs = 0;
+};
+
+// namespace midi
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+namespace midi {
+	class trace_scope;
+}
+
+#include <stdint.h>
+
+namespace midi {
+
+// Timeline tracing for chasing stutters, written out as Chrome trace JSON
+// which chrome://tracing and ui.perfetto.dev both load. The hooks in the
+// render path are the TRACE_ macros below, which are only compiled in with
+// `make TRACE=1` and are nothing at all otherwise.
+//
+// Records go into a ring per thread, allocated up front by trace_start(),
+// so tracing doesn't allocate or lock once it's running. When a ring fills
+// up the oldest records are overwritten.
+enum {
+	TRACE_MAX_THREADS = 8,
+	TRACE_RING_RECORDS = 1 << 15,
+};
+
+typedef struct trace_record {
+	const char *name;
+	// argument names are NULL if unused
+	const char *arg_names[2];
+	int64_t args[2];
+	uint64_t start;
+	uint64_t duration;
+	// 'X' for spans, 'i' for instants, 'C' for counters
+	char phase;
+} trace_record_t;
+
+// true between trace_start() and trace_write()
+extern bool trace_armed;
+
+// allocates the rings and starts recording
+void trace_start(void);
+// stops recording and writes everything recorded, throws if it can't
+void trace_write(const char *path);
+
+// nanoseconds on the monotonic clock
+uint64_t trace_clock(void);
+void trace_add(const trace_record_t &rec);
+void trace_instant(const char *name, const char *arg_name, int64_t arg);
+void trace_counter(const char *name, int64_t value);
+
+// records a span from construction to destruction
+class trace_scope {
+	public:
+		trace_scope(const char *name);
+		~trace_scope();
+
+		// up to two, the second replaces the first if there are more
+		void set_arg(const char *name, int64_t value);
+
+	private:
+		trace_record_t rec;
+};
+
+#ifdef MIDI_TRACE
+#define TRACE_JOIN_(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN_(a, b)
+
+// anonymous span to the end of the enclosing scope
+#define TRACE_SCOPE(name) \
+	midi::trace_scope TRACE_JOIN(trace_scope_, __LINE__)(name)
+// named span, so that arguments can be added with TRACE_SPAN_ARG()
+#define TRACE_SPAN(var, name) midi::trace_scope var(name)
+#define TRACE_SPAN_ARG(var, name, value) var.set_arg(name, value)
+#define TRACE_INSTANT(name, arg_name, arg) \
+	do { if (midi::trace_armed) midi::trace_instant(name, arg_name, arg); } while (0)
+#define TRACE_COUNTER(name, value) \
+	do { if (midi::trace_armed) midi::trace_counter(name, value); } while (0)
+
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_SPAN(var, name)
+#define TRACE_SPAN_ARG(var, name, value)
+#define TRACE_INSTANT(name, arg_name, arg)
+#define TRACE_COUNTER(name, value)
+#endif
+
+// namespace midi
+}
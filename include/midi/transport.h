@@ -0,0 +1,73 @@
+#pragma once
+
+namespace midi {
+	class transport;
+}
+
+#include <midi/queue.h>
+#include <stdint.h>
+#include <atomic>
+
+namespace midi {
+
+enum {
+	TRANSPORT_PLAY,
+	TRANSPORT_PAUSE,
+	TRANSPORT_STOP,
+	TRANSPORT_SEEK,
+	TRANSPORT_TEMPO_SCALE,
+	TRANSPORT_MUTE,
+};
+
+typedef struct transport_command {
+	unsigned type;
+	// channel for TRANSPORT_MUTE
+	unsigned channel;
+	// target position in microseconds for TRANSPORT_SEEK
+	uint64_t position;
+	// speed multiplier for TRANSPORT_TEMPO_SCALE, non-zero to mute
+	// for TRANSPORT_MUTE
+	double   value;
+} transport_command_t;
+
+// Thread-safe control of a player from outside of the thread running it.
+// Commands are queued without locking, and the player picks them up at
+// the next block boundary. It then publishes its state back, which can be
+// read from any thread. Commands may come from any one thread at a time.
+class transport {
+	public:
+		// these only fail if the command queue is full
+		bool play(void);
+		bool pause(void);
+		bool stop(void);
+		bool seek(uint64_t usecs);
+		bool set_tempo_scale(double scale);
+		bool mute(unsigned channel, bool muted);
+
+		// one of the PLAYER_* states
+		unsigned state(void);
+		// position in microseconds of score time, unaffected by tempo scale
+		uint64_t position(void);
+		double   tempo_scale(void);
+		uint16_t mute_mask(void);
+
+		// player side
+		bool next_command(transport_command_t &cmd);
+		void publish_state(unsigned state);
+		void publish_position(uint64_t usecs);
+		void publish_tempo_scale(double scale);
+		void publish_mute_mask(uint16_t mask);
+
+	private:
+		bool send(unsigned type, unsigned channel, uint64_t position, double value);
+
+		spsc_queue<transport_command_t, 64> queue;
+
+		std::atomic<unsigned> cur_state{0};
+		std::atomic<uint64_t> cur_position{0};
+		std::atomic<double>   cur_scale{1.0};
+		std::atomic<uint16_t> cur_mutes{0};
+};
+
+// namespace midi
+}
@@ -17,15 +17,24 @@ namespace midi {
 class wavsynth : public synth {
 	public:
 		wavsynth(player *play, uint32_t rate, std::string outfile);
+		// no output yet, see open()
+		wavsynth(player *play, uint32_t rate);
 		~wavsynth();
 
-		virtual void wait(uint32_t usecs);
+		// start a new output file, raw writes headerless 16 bit PCM
+		void open(std::string outfile, bool raw = false);
+		// finish the current file, returns the number of frames written
+		size_t close(void);
+
+		virtual void output(uint32_t frames);
 	
 	private:
 		void write_header(void);
-		size_t samples;
+		size_t samples = 0;
 		//std::vector<int16_t> samples;
-		FILE *fp;
+		FILE *fp = NULL;
+		bool raw = false;
+		int16_t buffer[SYNTH_BLOCK_SIZE * SYNTH_CHANNELS];
 };
 
 enum {
@@ -62,5 +71,8 @@ typedef struct wav_header {
 
 } __attribute__((packed)) wav_header_t;
 
+// header for 16 bit PCM with the given number of frames
+void wav_header(wav_header_t &header, uint32_t rate, unsigned channels, size_t frames);
+
 // namespace midi
 }
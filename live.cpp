@@ -0,0 +1,332 @@
+#include <midi/live.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace midi {
+
+uint64_t live_clock(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// number of data bytes following a status byte
+static unsigned data_length(uint8_t status){
+	switch (status & 0xf0) {
+		case 0xc0:
+		case 0xd0:
+			return 1;
+
+		case 0xf0:
+			switch (status) {
+				case 0xf1:
+				case 0xf3: return 1;
+				case 0xf2: return 2;
+				default:   return 0;
+			}
+
+		default:
+			return 2;
+	}
+}
+
+bool live_parser::feed(uint8_t byte, live_message_t &msg){
+	// realtime messages
+	if (byte >= 0xf8){
+		if (byte == 0xff){
+			// system reset
+			msg.bytes[0] = byte;
+			msg.length = 1;
+			return true;
+		}
+
+		return false;
+	}
+
+	// status bytes
+	if (byte & 0x80){
+		in_sysex = (byte == 0xf0);
+		status = (byte >= 0xf0 && data_length(byte) == 0)? 0 : byte;
+		need = data_length(byte);
+		have = 0;
+		return false;
+	}
+
+	// data bytes
+	if (in_sysex || status == 0){
+		return false;
+	}
+
+	data[have++] = byte;
+
+	if (have < need){
+		return false;
+	}
+
+	have = 0;
+
+	if (status >= 0xf0){
+		// system common messages aren't used, and cancel running status
+		status = 0;
+		return false;
+	}
+
+	msg.bytes[0] = status;
+	msg.bytes[1] = data[0];
+	msg.bytes[2] = (need > 1)? data[1] : 0;
+	msg.length = 1 + need;
+	return true;
+}
+
+live_input::live_input(std::string source){
+	if (source == "-"){
+		fd = STDIN_FILENO;
+
+	} else if (source.compare(0, 5, "unix:") == 0){
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+
+		path = source.substr(5);
+
+		if (path.size() >= sizeof(addr.sun_path)){
+			throw "socket path too long";
+		}
+
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path.c_str());
+		unlink(path.c_str());
+
+		listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+		if (listen_fd < 0
+		    || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+		    || listen(listen_fd, 1) < 0)
+		{
+			throw "could not listen on socket";
+		}
+
+	} else {
+		// opened by the reader, since opening a FIFO blocks until
+		// there's a writer
+		path = source;
+	}
+
+	reader_thread = std::thread(&live_input::reader, this);
+}
+
+live_input::~live_input(){
+	quit = true;
+
+	if (fd < 0 && listen_fd < 0 && !done){
+		// reader is probably stuck opening a FIFO, be its writer for a moment
+		int wake = open(path.c_str(), O_WRONLY | O_NONBLOCK);
+
+		if (wake >= 0){
+			close(wake);
+		}
+	}
+
+	reader_thread.join();
+
+	if (fd > STDIN_FILENO){
+		close(fd);
+	}
+
+	if (listen_fd >= 0){
+		close(listen_fd);
+		unlink(path.c_str());
+	}
+}
+
+// wait until fd is readable, or we've been told to quit
+static bool wait_readable(int fd, std::atomic<bool> &quit){
+	struct pollfd pfd = {fd, POLLIN, 0};
+
+	while (!quit) {
+		int ret = poll(&pfd, 1, 100);
+
+		if (ret > 0){
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void live_input::reader(void){
+	live_parser parser;
+	live_message_t msg;
+	uint8_t buf[256];
+
+	if (listen_fd >= 0){
+		if (wait_readable(listen_fd, quit)){
+			fd = accept(listen_fd, NULL, NULL);
+		}
+
+	} else if (fd < 0){
+		fd = open(path.c_str(), O_RDONLY);
+	}
+
+	while (fd >= 0 && wait_readable(fd, quit)) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+
+		if (n <= 0){
+			break;
+		}
+
+		uint64_t now = live_clock();
+
+		for (ssize_t i = 0; i < n; i++) {
+			if (parser.feed(buf[i], msg)){
+				msg.arrival = now;
+
+				if (!queue.push(msg)){
+					overflows++;
+				}
+			}
+		}
+	}
+
+	done = true;
+}
+
+bool live_input::next(live_message_t &msg){
+	if (queue.pop(msg)){
+		messages++;
+		return true;
+	}
+
+	return false;
+}
+
+bool live_input::finished(void){
+	return done;
+}
+
+static const double hist_edges[] = {
+	0.001, 0.002, 0.005, 0.010, 0.020, 0.050, 0.100, 0.200, 0.500, 1.0,
+};
+
+void live_input::record_latency(double secs){
+	unsigned k = 0;
+
+	while (k < 10 && secs >= hist_edges[k]) {
+		k++;
+	}
+
+	latency_hist[k]++;
+	latency_sum += secs;
+
+	if (latency_min < 0 || secs < latency_min) latency_min = secs;
+	if (secs > latency_max) latency_max = secs;
+}
+
+void live_input::report(FILE *fp){
+	uint64_t n = 0;
+
+	for (unsigned k = 0; k < 11; k++) {
+		n += latency_hist[k];
+	}
+
+	fprintf(fp, "live input: %lu messages, %lu dropped (queue full)\n",
+	        (unsigned long)messages, (unsigned long)overflows.load());
+
+	if (n == 0){
+		return;
+	}
+
+	fprintf(fp, "    arrival to sound: min %.2f, mean %.2f, max %.2f ms\n",
+	        latency_min * 1000, latency_sum / n * 1000, latency_max * 1000);
+
+	for (unsigned k = 0; k < 11; k++) {
+		if (!latency_hist[k]){
+			continue;
+		}
+
+		if (k < 10){
+			fprintf(fp, "    < %6.0f ms: %lu\n", hist_edges[k] * 1000,
+			        (unsigned long)latency_hist[k]);
+		} else {
+			fprintf(fp, "   >= %6.0f ms: %lu\n", hist_edges[9] * 1000,
+			        (unsigned long)latency_hist[k]);
+		}
+	}
+}
+
+wire_player::wire_player(file f, int out_fd)
+	: player(f)
+{
+	fd = out_fd;
+}
+
+void wire_player::interpret(event &ev){
+	if (!ev.is_midi()){
+		// tempo changes still set the pace
+		player::interpret(ev);
+		return;
+	}
+
+	uint8_t status = ev.status;
+	uint8_t buf[3];
+	unsigned n = 0;
+
+	if (status != last_status){
+		buf[n++] = status;
+		last_status = status;
+	}
+
+	for (unsigned i = 0; i < data_length(status); i++) {
+		buf[n++] = ev.params[i];
+	}
+
+	if (write(fd, buf, n) == (ssize_t)n){
+		bytes_written += n;
+	}
+}
+
+int live_connect(std::string dest){
+	if (dest == "-"){
+		return STDOUT_FILENO;
+	}
+
+	if (dest.compare(0, 5, "unix:") == 0){
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+
+		std::string path = dest.substr(5);
+
+		if (path.size() >= sizeof(addr.sun_path)){
+			throw "socket path too long";
+		}
+
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path.c_str());
+
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+		if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+			throw "could not connect to socket";
+		}
+
+		return fd;
+	}
+
+	int fd = open(dest.c_str(), O_WRONLY);
+
+	if (fd < 0){
+		throw "could not open output";
+	}
+
+	return fd;
+}
+
+// namespace midi
+}
@@ -0,0 +1,92 @@
+#include <midi/log.h>
+#include <midi/realtime.h>
+
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+
+namespace midi {
+
+unsigned log_level = LOG_INFO;
+
+static const char *level_strings[] = {"error", "warn", "info", "debug", "trace"};
+
+unsigned log_level_from_string(const char *name){
+	for (unsigned i = 0; i <= LOG_TRACE; i++) {
+		if (strcmp(name, level_strings[i]) == 0){
+			return i;
+		}
+	}
+
+	throw "unknown log level, expected error, warn, info, debug or trace";
+}
+
+static mpsc_queue<log_record_t, LOG_QUEUE_SIZE> log_queue;
+static std::thread log_thread;
+static std::atomic<bool> log_running(false);
+static std::atomic<unsigned long> log_dropped(0);
+
+static void write_record(const log_record_t &rec){
+	char buf[256];
+
+	rec.format(buf, sizeof(buf), rec);
+	fputs(buf, stderr);
+	fputc('\n', stderr);
+}
+
+static void drain(void){
+	log_record_t rec;
+
+	while (log_queue.pop(rec)) {
+		write_record(rec);
+	}
+}
+
+static void log_worker(void){
+	struct timespec idle = {0, 2000000};
+
+	while (log_running.load(std::memory_order_acquire)) {
+		drain();
+		nanosleep(&idle, NULL);
+	}
+
+	drain();
+}
+
+void log_start(void){
+	if (!log_running.exchange(true)){
+		log_thread = std::thread(log_worker);
+	}
+}
+
+void log_stop(void){
+	if (!log_running.exchange(false)){
+		return;
+	}
+
+	log_thread.join();
+
+	unsigned long dropped = log_dropped.exchange(0);
+
+	if (dropped > 0){
+		fprintf(stderr, "midithing: log: %lu messages dropped (queue full)\n",
+		        dropped);
+	}
+}
+
+void log_push(const log_record_t &rec){
+	if (log_running.load(std::memory_order_acquire)){
+		if (!log_queue.push(rec)){
+			log_dropped++;
+		}
+
+		return;
+	}
+
+	realtime_check_stdio();
+	write_record(rec);
+}
+
+// namespace midi
+}
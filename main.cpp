@@ -1,32 +1,529 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
 #include <limits.h>
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <vector>
+#include <set>
 
 #include <midi/midi.h>
 #include <midi/player.h>
 #include <midi/synth.h>
 #include <midi/wavsynth.h>
+#include <midi/stemsynth.h>
+#include <midi/rerender.h>
+#include <midi/snapshot.h>
+#include <midi/nullsynth.h>
+#include <midi/realtime.h>
+#include <midi/live.h>
+#include <midi/server.h>
+#include <midi/export.h>
+#include <midi/smfwriter.h>
+#include <midi/analyze.h>
+#include <midi/playlist.h>
+#include <midi/tracing.h>
+#include <midi/log.h>
+
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <thread>
+#include <memory>
+
+#ifndef NO_PORTAUDIO
 #include <midi/paudiosynth.h>
+#endif
+
+// send effect on the master bus, from --reverb or --delay
+static unsigned master_effect = midi::MASTER_EFFECT_NONE;
+
+// from --stats, kept for every synth played through
+static midi::render_stats *render_timing = NULL;
+// from --stats or --output-log, sound card output only prints its stats
+// on exit when one was given
+static bool output_reports = false;
+
+// from --bank and --patches, shared by every synth
+static midi::sample_bank *sample_bank = NULL;
+static midi::patch_set *patches = NULL;
+
+static void attach_synth(midi::player &player, midi::synth &syn){
+	player.set_synth(&syn);
+	syn.master.set_effect(master_effect);
+	syn.timing = render_timing;
+	syn.bank = sample_bank;
+	syn.patches = patches;
+}
+
+// Everything besides the file that goes into a render, for wav
+// --incremental. Banks and patch files count by path, size and
+// modification time rather than by contents.
+static uint64_t render_settings(const std::string &bank_path,
+                                const std::string &patch_path)
+{
+	uint64_t hash = midi::fnv_hash(midi::FNV_BASIS, &master_effect,
+	                               sizeof(master_effect));
+
+	for (auto &x : {bank_path, patch_path}) {
+		struct stat st;
+
+		hash = midi::fnv_hash(hash, x.c_str(), x.size() + 1);
+
+		if (!x.empty() && stat(x.c_str(), &st) == 0){
+			int64_t id[3] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+			hash = midi::fnv_hash(hash, id, sizeof(id));
+		}
+	}
+
+	return hash;
+}
+
+static void write_trace(const std::string &path){
+	if (path.empty()){
+		return;
+	}
+
+	try {
+		midi::trace_write(path.c_str());
+		fprintf(stderr, "midithing: trace written to %s\n", path.c_str());
+	} catch (const char *errormsg) {
+		fprintf(stderr, "midithing: %s\n", errormsg);
+	}
+}
+
+static void report_timing(void){
+	if (render_timing && render_timing->blocks > 0){
+		render_timing->dump(stderr);
+	}
+}
+
+// run the render path with the real-time checks armed
+static void enter_render_thread(midi::synth &syn){
+	syn.prefault();
+	midi::realtime_enter();
+}
+
+// returns the number of violations seen on the render thread
+static unsigned long leave_render_thread(void){
+	midi::realtime_leave();
+	midi::realtime_violations_t v = midi::realtime_get_violations();
+
+	if (v.allocations || v.stdio){
+		fprintf(stderr, "midithing: realtime: %lu allocations and %lu stdio "
+		                "calls on the render thread\n", v.allocations, v.stdio);
+	}
+
+	return v.allocations + v.stdio;
+}
+
+// For `make rtcheck` to show that rtcheck catches what it should: breaks the
+// render thread's rules once, from a stem sink since that's called there.
+class rtcheck_injection : public midi::stem_sink {
+	public:
+		rtcheck_injection(const std::string &what) : kind(what){}
+		~rtcheck_injection(){ free(block); }
+
+		void stem(unsigned, const float *, const float *, unsigned){
+			if (done){
+				return;
+			}
+
+			if (kind == "malloc"){
+				block = malloc(64);
+			} else {
+				fprintf(stderr, "rtcheck: printing from the render thread\n");
+			}
+
+			done = true;
+		}
+
+		std::string kind;
+		void *block = NULL;
+		bool done = false;
+};
+
+static void start_realtime(midi::synth &syn){
+	midi::realtime_lock_memory();
+	midi::realtime_schedule();
+	midi::realtime_prefault_stack();
+	enter_render_thread(syn);
+}
+
+static void play_live(midi::player &player, midi::synth &syn,
+                      midi::live_input &in, bool realtime)
+{
+	attach_synth(player, syn);
+
+	if (realtime){
+		start_realtime(syn);
+		player.play_live(in);
+		leave_render_thread();
+
+	} else {
+		player.play_live(in);
+	}
+
+	in.report(stderr);
+}
+
+static void play_list(midi::playlist &list, midi::synth &syn, bool realtime){
+	syn.source = &list;
+
+	if (realtime){
+		start_realtime(syn);
+	}
+
+	while (!list.finished()) {
+		syn.output(midi::SYNTH_BLOCK_SIZE);
+	}
+
+	if (realtime){
+		leave_render_thread();
+	}
+}
+
+// plays every file given back to back through one output stream
+static int playlist_action(std::vector<std::string> &args,
+                           std::set<std::string> &options, bool realtime)
+{
+	std::vector<std::string> paths(args.begin() + 2, args.end());
+	std::string wav;
+	double crossfade = 0;
+
+	for (auto &x : options) {
+		if (x.compare(0, 12, "--crossfade=") == 0){
+			crossfade = atof(x.c_str() + 12);
+
+		} else if (x.compare(0, 6, "--wav=") == 0){
+			wav = x.substr(6);
+		}
+	}
+
+	try {
+		midi::playlist list(paths, 44100, crossfade, master_effect);
+
+		if (!wav.empty()){
+			// offline, so wait for each song to load rather than leave a gap
+			midi::wavsynth syn(NULL, 44100, wav);
+			list.wait_for_prefetch = true;
+			play_list(list, syn, false);
+
+		} else if (options.count("--null")){
+			midi::nullsynth syn(NULL, 44100, true, realtime? 512 : 4096);
+			syn.gov.defer_reports = realtime;
+			play_list(list, syn, realtime);
+
+		} else {
+#ifndef NO_PORTAUDIO
+			midi::paudiosynth syn(NULL, 44100, realtime);
+			syn.report = output_reports;
+			syn.gov.defer_reports = realtime;
+			play_list(list, syn, realtime);
+#else
+			throw "built without PortAudio, try --null or --wav=file";
+#endif
+		}
+
+		fprintf(stderr, "playlist: played %u of %zu files\n",
+		        list.songs_played.load(), paths.size());
+
+	} catch (const char *errormsg) {
+		printf("error: playlist: %s\n", errormsg);
+		return 1;
+	}
+
+	return 0;
+}
+
+// actions which don't start by loading a file
+static int live_action(std::string action, std::vector<std::string> &args,
+                       bool realtime, bool null_output)
+{
+	try {
+		if (action == "live"){
+			midi::player player;
+			midi::live_input in(args[2]);
+
+#ifndef NO_PORTAUDIO
+			if (!null_output){
+				midi::paudiosynth syn(&player, 44100, realtime);
+				syn.report = output_reports;
+				syn.gov.defer_reports = realtime;
+				play_live(player, syn, in, realtime);
+				return 0;
+			}
+#endif
+
+			midi::nullsynth syn(&player, 44100, true, realtime? 512 : 4096);
+			syn.gov.defer_reports = realtime;
+			play_live(player, syn, in, realtime);
+		}
+
+		else if (action == "replay"){
+			if (args.size() < 4) {
+				throw "need somewhere to replay to (try `midithing help`)";
+			}
+
+			std::ifstream asdf(args[2]);
+			std::stringstream stream;
+			stream << asdf.rdbuf();
+			std::string in = stream.str();
+
+			// the reader going away shouldn't kill us
+			signal(SIGPIPE, SIG_IGN);
+
+			midi::file thing(in.c_str());
+			thing.checked_tracks(in.size());
+			midi::wire_player player(thing, midi::live_connect(args[3]));
+			// a small buffer keeps us from running ahead of the file's timing
+			midi::nullsynth syn(&player, 44100, true, 64);
+
+			player.set_synth(&syn);
+			player.play();
+
+			fprintf(stderr, "replay: wrote %lu bytes\n",
+			        (unsigned long)player.bytes_written);
+		}
+
+		else if (action == "serve"){
+			unsigned workers = std::thread::hardware_concurrency();
+
+			if (args.size() >= 4){
+				workers = atoi(args[3].c_str());
+			}
+
+			// workers share the log, keep them quiet
+			midi::log_level = midi::LOG_WARN;
+
+			midi::render_server server(args[2], workers? workers : 1);
+			printf("serve: listening on %s with %u workers\n",
+			       args[2].c_str(), workers? workers : 1);
+			fflush(stdout);
+			server.run();
+		}
+
+		else if (action == "analyze"){
+			midi::log_level = midi::LOG_WARN;
+
+			midi::corpus_analyzer corpus(std::thread::hardware_concurrency(),
+			                             STDOUT_FILENO);
+
+			for (size_t i = 2; i < args.size(); i++) {
+				corpus.add(args[i]);
+			}
+
+			corpus.finish();
+			fprintf(stderr, "analyze: %llu files, %llu failed\n",
+			        (unsigned long long)corpus.files,
+			        (unsigned long long)corpus.failed);
+		}
+
+	} catch (const char *errormsg) {
+		printf("error: %s: %s\n", action.c_str(), errormsg);
+		return 1;
+	}
+
+	return 0;
+}
 
 int main(int argc, char *argv[]){
-	if (argc < 3){
+	// split out --options, everything else is positional
+	std::vector<std::string> args;
+	std::set<std::string> options;
+
+	for (int i = 0; i < argc; i++) {
+		std::string arg = argv[i];
+
+		if (arg.compare(0, 2, "--") == 0){
+			options.insert(arg);
+		} else {
+			args.push_back(arg);
+		}
+	}
+
+	if (args.size() < 3){
 		puts("usage:");
 		puts("    midithing help");
 		puts("    midithing dump [midi file]");
+		puts("    midithing export [midi file] [jsonl | csv | binary] [[output]]");
+		puts("    midithing analyze [midi file or directory] [[more...]]");
+		puts("    midithing normalize [midi file] [output .mid]");
 		puts("    midithing play [midi file]");
 		puts("    midithing loop [midi file] [[loops]]");
 		puts("    midithing wav  [midi file] [output .wav]");
+		puts("    midithing stems [midi file] [output prefix]");
+		puts("    midithing null [midi file]");
+		puts("    midithing rtcheck [midi file]");
+		puts("    midithing live [- | fifo | unix:socket]");
+		puts("    midithing replay [midi file] [- | fifo | unix:socket]");
+		puts("    midithing serve [socket path] [[workers]]");
+		puts("    midithing playlist [midi file] [[more...]]");
+		puts("");
+		puts("options:");
+		puts("    --output-log    print output buffer/underflow stats every second");
+		puts("    --stats         print where render time went on exit");
+		puts("    --stats-log     same, plus a line every second");
+		puts("    --trace=file    write a Chrome trace of render blocks and events");
+		puts("                    to file on exit, needs a `make TRACE=1` build");
+		puts("    --realtime      low latency output with real-time scheduling and");
+		puts("                    locked memory, nothing is printed while playing");
+		puts("    --null          live, playlist: discard output instead of playing it");
+		puts("    --crossfade=s   playlist: overlap songs by s seconds");
+		puts("    --wav=file      playlist: render to a .wav file instead");
+		puts("    --flatten       normalize: merge tracks into a format 0 file");
+		puts("    --incremental   wav: keep render state in file.wav.state, and");
+		puts("                    only re-render what changed next time");
+		puts("    --reverb        add reverb to the output");
+		puts("    --delay         add a stereo echo to the output");
+		puts("    --bank=file     play programs found in a sample bank from it,");
+		puts("                    see tools/mkbank.py");
+		puts("    --patches=file  play programs found in a patch file with it,");
+		puts("                    see patches/default.patch");
+		puts("    --log=level     error, warn, info (default), debug or trace, which");
+		puts("                    prints every event as it's played");
+		puts("    --governor=n    rtcheck: hold quality at governor level n, from 0");
+		puts("                    (full, the default) to 4 (simplified drums)");
 
 		return 1;
 	}
 
-	std::string action = argv[1];
-	std::string fname  = argv[2];
+	std::string action = args[1];
+	std::string fname  = args[2];
+	bool output_log = options.count("--output-log");
+	bool realtime   = options.count("--realtime");
+	bool stats_log  = options.count("--stats-log");
+	std::string trace_path;
+	std::string bank_path;
+	std::string patch_path;
+	unsigned governor_level = midi::GOVERNOR_FULL;
+	std::string inject;
+
+	for (auto &x : options) {
+		if (x.compare(0, 8, "--trace=") == 0){
+			trace_path = x.substr(8);
+
+		} else if (x.compare(0, 7, "--bank=") == 0){
+			bank_path = x.substr(7);
+
+		} else if (x.compare(0, 10, "--patches=") == 0){
+			patch_path = x.substr(10);
+
+		} else if (x.compare(0, 6, "--log=") == 0){
+			try {
+				midi::log_level = midi::log_level_from_string(x.c_str() + 6);
+			} catch (const char *errormsg) {
+				fprintf(stderr, "midithing: %s\n", errormsg);
+				return 1;
+			}
+
+		} else if (x.compare(0, 11, "--governor=") == 0){
+			char *end;
+			governor_level = strtoul(x.c_str() + 11, &end, 10);
+
+			if (end == x.c_str() + 11 || *end || governor_level >= midi::GOVERNOR_LEVELS){
+				fprintf(stderr, "midithing: governor level should be 0 to %u\n",
+				        midi::GOVERNOR_LEVELS - 1);
+				return 1;
+			}
+
+		} else if (x.compare(0, 9, "--inject=") == 0){
+			// rtcheck's own test, see the Makefile, not for users
+			inject = x.substr(9);
+
+			if (inject != "malloc" && inject != "print"){
+				fprintf(stderr, "midithing: --inject should be malloc or print\n");
+				return 1;
+			}
+		}
+	}
+
+	midi::render_stats timing(44100);
+	std::unique_ptr<midi::sample_bank> bank;
+	std::unique_ptr<midi::patch_set> patch_file;
+	int ret = 0;
+
+	if (!bank_path.empty()){
+		try {
+			bank.reset(new midi::sample_bank(bank_path.c_str()));
+			sample_bank = bank.get();
+		} catch (const char *errormsg) {
+			fprintf(stderr, "midithing: %s: %s\n", bank_path.c_str(), errormsg);
+			return 1;
+		}
+	}
+
+	if (!patch_path.empty()){
+		try {
+			patch_file.reset(new midi::patch_set(patch_path.c_str()));
+			patches = patch_file.get();
+		} catch (const char *errormsg) {
+			fprintf(stderr, "midithing: %s: %s\n", patch_path.c_str(), errormsg);
+			return 1;
+		}
+	}
+
+	if (options.count("--reverb")){
+		master_effect = midi::MASTER_EFFECT_REVERB;
+	} else if (options.count("--delay")){
+		master_effect = midi::MASTER_EFFECT_DELAY;
+	}
+
+	if (realtime){
+		if (output_log){
+			fputs("midithing: --output-log is ignored with --realtime\n", stderr);
+			output_log = false;
+		}
+
+		if (stats_log){
+			fputs("midithing: --stats-log is ignored with --realtime\n", stderr);
+			stats_log = false;
+		}
+	}
+
+	if (stats_log || options.count("--stats")){
+		timing.log_per_second = stats_log;
+		render_timing = &timing;
+	}
+
+	output_reports = output_log || render_timing;
+
+	if (!trace_path.empty()){
+#ifdef MIDI_TRACE
+		midi::trace_start();
+#else
+		fputs("midithing: built without tracing, --trace needs `make TRACE=1`\n",
+		      stderr);
+		trace_path.clear();
+#endif
+	}
+
+	if (action == "playlist"){
+		midi::log_start();
+		ret = playlist_action(args, options, realtime);
+		midi::log_stop();
+		write_trace(trace_path);
+		return ret;
+	}
+
+	if (action == "live" || action == "replay" || action == "serve"
+	    || action == "analyze")
+	{
+		midi::log_start();
+		ret = live_action(action, args, realtime, options.count("--null"));
+		midi::log_stop();
+		report_timing();
+		write_trace(trace_path);
+		return ret;
+	}
+
+	// messages are written out on their own thread from here on, so that
+	// nothing being played waits on stdio
+	midi::log_start();
 
 	std::ifstream asdf(fname);
 	std::stringstream stream;
@@ -35,46 +532,216 @@ int main(int argc, char *argv[]){
 
 	try {
 		midi::file   thing(in.c_str());
+
+		// nothing reads the file past its checked tracks after this
+		thing.checked_tracks(in.size());
 		midi::player player(thing);
 
 		if (action == "dump"){
 			player.dump_tracks();
 		}
 
-		else if (action == "play"){
-			midi::paudiosynth syn(&player, 44100);
+		else if (action == "export"){
+			if (args.size() < 4) {
+				throw "need an export format (try `midithing help`)";
+			}
 
-			player.set_synth(&syn);
+			unsigned format = midi::export_format(args[3]);
+			int fd = STDOUT_FILENO;
+
+			if (args.size() >= 5){
+				fd = open(args[4].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+				if (fd < 0){
+					throw "could not open output file for writing";
+				}
+			}
+
+			uint64_t count = midi::export_events(thing, format, fd);
+
+			if (fd != STDOUT_FILENO){
+				close(fd);
+			}
+
+			fprintf(stderr, "export: %llu events\n", (unsigned long long)count);
+		}
+
+		else if (action == "normalize"){
+			if (args.size() < 4) {
+				throw "need an output file (try `midithing help`)";
+			}
+
+			midi::smf_options_t opts = {options.count("--flatten") > 0};
+			int fd = open(args[3].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+			if (fd < 0){
+				throw "could not open output file for writing";
+			}
+
+			midi::smf_stats_t st;
+
+			try {
+				st = midi::write_smf(thing.checked_tracks(in.size()), thing.format(),
+				                     thing.division(), opts, fd);
+			} catch (const char *) {
+				close(fd);
+				throw;
+			}
+
+			close(fd);
+
+			fprintf(stderr, "normalize: %zu -> %llu bytes, %llu of %llu events kept\n",
+			        in.size(), (unsigned long long)st.bytes,
+			        (unsigned long long)st.events_out,
+			        (unsigned long long)st.events_in);
+
+			if (st.truncated_tracks){
+				fprintf(stderr, "normalize: %u tracks stopped at an event that "
+				                "couldn't be decoded\n", st.truncated_tracks);
+			}
+		}
+
+		else if (action == "null"){
+			midi::nullsynth syn(&player, 44100);
+			syn.stats.log_per_second = output_log;
+			syn.gov.defer_reports = realtime;
+
+			attach_synth(player, syn);
+
+			if (realtime){
+				start_realtime(syn);
+				player.play();
+				leave_render_thread();
+
+			} else {
+				player.play();
+			}
+		}
+
+		else if (action == "rtcheck"){
+			// render the whole file as fast as possible with the render thread
+			// checks armed, fails if the hot path allocates or prints. The
+			// governor is held at one level, so every run takes the same
+			// path through the synth whatever the machine's load.
+			midi::nullsynth syn(&player, 44100, false);
+			syn.gov.defer_reports = true;
+			syn.gov.pin(governor_level);
+
+			rtcheck_injection injection(inject);
+
+			if (!inject.empty()){
+				syn.stems = &injection;
+			}
+
+			attach_synth(player, syn);
+			syn.set_quality(syn.gov.quality());
+			enter_render_thread(syn);
 			player.play();
+
+			if (leave_render_thread() > 0){
+				ret = 1;
+			} else {
+				puts("rtcheck: no allocations or stdio on the render thread");
+			}
+		}
+
+#ifndef NO_PORTAUDIO
+		else if (action == "play"){
+			midi::paudiosynth syn(&player, 44100, realtime);
+			syn.report = output_reports;
+			syn.stats.log_per_second = output_log;
+			syn.gov.defer_reports = realtime;
+
+			attach_synth(player, syn);
+
+			if (realtime){
+				start_realtime(syn);
+				player.play();
+				leave_render_thread();
+
+			} else {
+				player.play();
+			}
 		}
 
 		else if (action == "loop"){
 			unsigned loops = UINT_MAX;
-			midi::paudiosynth syn(&player, 44100);
+			midi::paudiosynth syn(&player, 44100, realtime);
+			syn.report = output_reports;
+			syn.stats.log_per_second = output_log;
+			syn.gov.defer_reports = realtime;
 
-			if (argc >= 4){
-				loops = atoi(argv[3]);
+			if (args.size() >= 4){
+				loops = atoi(args[3].c_str());
 			}
 
-			player.set_synth(&syn);
-			player.loop(loops);
+			attach_synth(player, syn);
+
+			if (realtime){
+				start_realtime(syn);
+				player.loop(loops);
+				leave_render_thread();
+
+			} else {
+				player.loop(loops);
+			}
+		}
+
+#else
+		else if (action == "play" || action == "loop"){
+			throw "built without PortAudio, try `null` or `wav` instead";
 		}
+#endif
 
 		else if (action == "wav"){
-			if (argc < 4) {
+			if (args.size() < 4) {
 				throw "need output file name (try `midithing help`)";
 			}
 
-			std::string outfile = argv[3];
-			midi::wavsynth wav(&player, 44100, outfile);
+			std::string outfile = args[3];
 
-			player.set_synth(&wav);
+			if (options.count("--incremental")){
+				uint64_t settings = render_settings(bank_path, patch_path);
+				midi::rerender_synth wav(&player, 44100, outfile, settings);
+
+				attach_synth(player, wav);
+				wav.run();
+
+				fprintf(stderr, "wav: rendered %.2f secs, kept %.2f secs\n",
+				        wav.rendered / 44100.0, wav.reused / 44100.0);
+
+			} else {
+				midi::wavsynth wav(&player, 44100, outfile);
+
+				attach_synth(player, wav);
+				player.play();
+			}
+		}
+
+		else if (action == "stems"){
+			if (args.size() < 4) {
+				throw "need an output prefix (try `midithing help`)";
+			}
+
+			unsigned cores = std::thread::hardware_concurrency();
+			midi::stemsynth syn(&player, 44100, args[3], cores? cores : 1);
+
+			attach_synth(player, syn);
 			player.play();
+			syn.close();
+
+			for (auto &x : syn.written) {
+				fprintf(stderr, "stems: wrote %s\n", x.c_str());
+			}
 		}
 
 	} catch (const char *errormsg) {
-		printf("error: %s: %s\n", argv[1], errormsg);
+		printf("error: %s: %s\n", action.c_str(), errormsg);
+		ret = 1;
 	}
 
-	return 0;
+	midi::log_stop();
+	report_timing();
+	write_trace(trace_path);
+	return ret;
 }
@@ -0,0 +1,372 @@
+#include <midi/master.h>
+#include <midi/snapshot.h>
+
+#include <string.h>
+#include <math.h>
+
+namespace midi {
+
+void delay_line::init(unsigned length){
+	buf.assign(length, 0);
+	pos = 0;
+}
+
+void delay_line::reset(void){
+	memset(buf.data(), 0, buf.size() * sizeof(float));
+	pos = 0;
+}
+
+void delay_line::read(float *dst, unsigned frames){
+	unsigned first = buf.size() - pos;
+
+	if (first >= frames){
+		memcpy(dst, buf.data() + pos, frames * sizeof(float));
+
+	} else {
+		memcpy(dst, buf.data() + pos, first * sizeof(float));
+		memcpy(dst + first, buf.data(), (frames - first) * sizeof(float));
+	}
+}
+
+void delay_line::write(const float *src, unsigned frames){
+	unsigned first = buf.size() - pos;
+
+	if (first > frames){
+		memcpy(buf.data() + pos, src, frames * sizeof(float));
+		pos += frames;
+
+	} else {
+		memcpy(buf.data() + pos, src, first * sizeof(float));
+		memcpy(buf.data(), src + first, (frames - first) * sizeof(float));
+		pos = frames - first;
+	}
+}
+
+void delay_line::save_state(std::string &out) const {
+	save_field(out, pos);
+	out.append((const char *)buf.data(), buf.size() * sizeof(float));
+}
+
+void delay_line::load_state(const uint8_t *&ptr, const uint8_t *end){
+	load_field(ptr, end, pos);
+
+	if (pos >= buf.size() || (size_t)(end - ptr) < buf.size() * sizeof(float)){
+		throw "render state is truncated";
+	}
+
+	memcpy(buf.data(), ptr, buf.size() * sizeof(float));
+	ptr += buf.size() * sizeof(float);
+}
+
+// mutually prime-ish lengths in milliseconds, so the echoes don't line up
+static const double reverb_ms[MASTER_REVERB_LINES] = {29.7, 37.1, 41.1, 43.7};
+// seconds for the reverb to decay by 60dB
+static const double reverb_rt60 = 1.6;
+
+master_chain::master_chain(uint32_t rate, unsigned frames){
+	max_frames = frames;
+
+	// high pass at around 10Hz
+	dc_coeff = 1 - (2 * M_PI * 10.0 / rate);
+
+	for (auto &x : echo) {
+		unsigned len = rate * 0.25;
+		x.init((len > max_frames)? len : max_frames);
+	}
+
+	echo_coeff = 1 - exp(-2 * M_PI * 3000.0 / rate);
+	reverb_coeff = 1 - exp(-2 * M_PI * 5000.0 / rate);
+
+	for (unsigned i = 0; i < MASTER_REVERB_LINES; i++) {
+		unsigned len = rate * reverb_ms[i] / 1000;
+		len = (len > max_frames)? len : max_frames;
+
+		lines[i].init(len);
+		line_gain[i] = pow(10, -3.0 * len / (reverb_rt60 * rate));
+		taps[i].assign(max_frames, 0);
+	}
+
+	// 1.5ms is enough to catch the attack of anything we render
+	lookahead = rate * 0.0015;
+	lookahead = (lookahead < 1)? 1 : lookahead;
+	lookahead = (lookahead > MASTER_MAX_LOOKAHEAD)? MASTER_MAX_LOOKAHEAD : lookahead;
+	release_coeff = 1 - exp(-1 / (0.15 * rate));
+
+	reset();
+}
+
+void master_chain::set_effect(unsigned e){
+	effect = e;
+	reset();
+}
+
+void master_chain::reset(void){
+	memset(dc_state, 0, sizeof(dc_state));
+
+	for (auto &x : echo) {
+		x.reset();
+	}
+
+	for (auto &x : lines) {
+		x.reset();
+	}
+
+	echo_damp = 0;
+	memset(line_damp, 0, sizeof(line_damp));
+
+	release_gain = 1;
+	memset(delayed, 0, sizeof(delayed));
+	min_head = 0;
+	min_count = 0;
+
+	for (unsigned i = 0; i < lookahead; i++) {
+		avg_ring[i] = 1;
+	}
+
+	avg_sum = lookahead;
+	frame = 0;
+}
+
+unsigned master_chain::latency(void){
+	return lookahead;
+}
+
+void master_chain::save_state(std::string &out) const {
+	save_field(out, dc_state);
+
+	if (effect == MASTER_EFFECT_DELAY){
+		echo[0].save_state(out);
+		echo[1].save_state(out);
+		save_field(out, echo_damp);
+
+	} else if (effect == MASTER_EFFECT_REVERB){
+		for (auto &x : lines) {
+			x.save_state(out);
+		}
+
+		save_field(out, line_damp);
+	}
+
+	save_field(out, release_gain);
+	save_field(out, delayed);
+	save_field(out, min_count);
+
+	// only the live part of the queue and the ring, from the head
+	for (unsigned i = 0; i < min_count; i++) {
+		unsigned at = (min_head + i) % (lookahead + 1);
+
+		save_field(out, min_value[at]);
+		save_field(out, min_index[at]);
+	}
+
+	out.append((const char *)avg_ring, lookahead * sizeof(float));
+	save_field(out, avg_sum);
+	save_field(out, frame);
+}
+
+void master_chain::load_state(const uint8_t *&ptr, const uint8_t *end){
+	load_field(ptr, end, dc_state);
+
+	if (effect == MASTER_EFFECT_DELAY){
+		echo[0].load_state(ptr, end);
+		echo[1].load_state(ptr, end);
+		load_field(ptr, end, echo_damp);
+
+	} else if (effect == MASTER_EFFECT_REVERB){
+		for (auto &x : lines) {
+			x.load_state(ptr, end);
+		}
+
+		load_field(ptr, end, line_damp);
+	}
+
+	load_field(ptr, end, release_gain);
+	load_field(ptr, end, delayed);
+	load_field(ptr, end, min_count);
+
+	if (min_count > lookahead + 1){
+		throw "render state is corrupt";
+	}
+
+	min_head = 0;
+
+	for (unsigned i = 0; i < min_count; i++) {
+		load_field(ptr, end, min_value[i]);
+		load_field(ptr, end, min_index[i]);
+	}
+
+	for (unsigned i = 0; i < lookahead; i++) {
+		load_field(ptr, end, avg_ring[i]);
+	}
+
+	load_field(ptr, end, avg_sum);
+	load_field(ptr, end, frame);
+}
+
+void master_chain::process(float *left, float *right, unsigned frames){
+	dc_block(left, frames, dc_state[0][0], dc_state[0][1]);
+	dc_block(right, frames, dc_state[1][0], dc_state[1][1]);
+
+	switch (effect) {
+		case MASTER_EFFECT_DELAY:  delay(left, right, frames); break;
+		case MASTER_EFFECT_REVERB: reverb(left, right, frames); break;
+		default: break;
+	}
+
+	limit(left, right, frames);
+}
+
+// one pole, one zero high pass
+void master_chain::dc_block(float *buf, unsigned frames, double &x1, double &y1){
+	for (unsigned i = 0; i < frames; i++) {
+		double x = buf[i];
+		double y = x - x1 + dc_coeff * y1;
+
+		x1 = x;
+		y1 = y;
+		buf[i] = y;
+	}
+}
+
+void master_chain::delay(float *left, float *right, unsigned frames){
+	float *tap_l = taps[0].data();
+	float *tap_r = taps[1].data();
+	float *in_l  = taps[2].data();
+	float *in_r  = taps[3].data();
+
+	echo[0].read(tap_l, frames);
+	echo[1].read(tap_r, frames);
+
+	for (unsigned i = 0; i < frames; i++) {
+		// darken each repeat a little
+		echo_damp += (tap_r[i] - echo_damp) * echo_coeff;
+
+		// mono in on the left, bouncing between sides from then on
+		in_l[i] = (left[i] + right[i]) * 0.5f + echo_feedback * echo_damp;
+		in_r[i] = echo_feedback * tap_l[i];
+	}
+
+	for (unsigned i = 0; i < frames; i++) {
+		left[i]  += wet * tap_l[i];
+		right[i] += wet * tap_r[i];
+	}
+
+	echo[0].write(in_l, frames);
+	echo[1].write(in_r, frames);
+}
+
+// Four line feedback delay network with a Hadamard mixing matrix. Lines are
+// longer than a block, so a block's worth of every line's output can be read
+// up front and the rest is straight-line math over each block.
+void master_chain::reverb(float *left, float *right, unsigned frames){
+	for (unsigned k = 0; k < MASTER_REVERB_LINES; k++) {
+		float *tap = taps[k].data();
+		double damp = line_damp[k];
+
+		lines[k].read(tap, frames);
+
+		// damping is a one pole low pass, the only part that's sequential
+		for (unsigned i = 0; i < frames; i++) {
+			damp += (tap[i] - damp) * reverb_coeff;
+			tap[i] = damp * line_gain[k];
+		}
+
+		line_damp[k] = damp;
+	}
+
+	float *a = taps[0].data();
+	float *b = taps[1].data();
+	float *c = taps[2].data();
+	float *d = taps[3].data();
+
+	for (unsigned i = 0; i < frames; i++) {
+		float in = (left[i] + right[i]) * 0.25f;
+		float w = a[i], x = b[i], y = c[i], z = d[i];
+
+		left[i]  += wet * (w + y);
+		right[i] += wet * (x + z);
+
+		a[i] = in + 0.5f * (w + x + y + z);
+		b[i] = in + 0.5f * (w - x + y - z);
+		c[i] = in + 0.5f * (w + x - y - z);
+		d[i] = in + 0.5f * (w - x - y + z);
+	}
+
+	for (unsigned k = 0; k < MASTER_REVERB_LINES; k++) {
+		lines[k].write(taps[k].data(), frames);
+	}
+}
+
+// For each frame coming in, the gain needed to keep it under the ceiling
+// goes through an instant attack, exponential release follower, then a
+// sliding minimum over the look-ahead window, then a moving average over
+// the same length. The minimum makes sure every gain that'll be applied
+// while a peak is in the delay is low enough for it, and the average turns
+// the step down into a linear ramp that finishes just as the peak is output.
+void master_chain::limit(float *left, float *right, unsigned frames){
+	unsigned window = lookahead + 1;
+
+	for (unsigned i = 0; i < frames; i++) {
+		float l = left[i];
+		float r = right[i];
+		float peak = fmaxf(fabsf(l), fabsf(r));
+		double need = (peak > ceiling)? ceiling / peak : 1;
+
+		release_gain += (1 - release_gain) * release_coeff;
+
+		if (need < release_gain){
+			release_gain = need;
+		}
+
+		float g = release_gain;
+
+		// drop whatever's left the window, then anything that can't be
+		// the minimum anymore
+		if (min_count > 0 && min_index[min_head] + lookahead < frame){
+			min_head = (min_head + 1) % window;
+			min_count--;
+		}
+
+		while (min_count > 0) {
+			unsigned last = (min_head + min_count - 1) % window;
+
+			if (min_value[last] < g){
+				break;
+			}
+
+			min_count--;
+		}
+
+		unsigned tail = (min_head + min_count) % window;
+		min_value[tail] = g;
+		min_index[tail] = frame;
+		min_count++;
+
+		float smooth = min_value[min_head];
+		unsigned slot = frame % lookahead;
+
+		avg_sum += smooth - avg_ring[slot];
+		avg_ring[slot] = smooth;
+
+		float gain = avg_sum / lookahead;
+
+		// swap the new frame into the look-ahead delay
+		float out_l = delayed[0][slot];
+		float out_r = delayed[1][slot];
+		delayed[0][slot] = l;
+		delayed[1][slot] = r;
+
+		out_l *= gain;
+		out_r *= gain;
+
+		// rounding in the average could let something just past the ceiling
+		// through, so clip whatever's left
+		left[i]  = fmaxf(-1, fminf(1, out_l));
+		right[i] = fmaxf(-1, fminf(1, out_r));
+
+		frame++;
+	}
+}
+
+// namespace midi
+}
@@ -10,6 +10,7 @@
 #include <string.h>
 
 #include <midi/midi.h>
+#include <midi/log.h>
 
 namespace midi {
 
@@ -38,6 +39,9 @@ const char *event_strings[] {
 	"event_meta_seq_specific",
 	"event_meta_midi_port",
 	"event_meta_chan_prefix",
+	"event_meta_other",
+
+	"event_sysex",
 
 	"event_end (shouldn't get here)",
 };
@@ -60,54 +64,66 @@ varint_t event::delta_time(void){
 }
 
 uint32_t event::length(void){
+	return length(type());
+}
+
+uint32_t event::length(uint32_t type){
 	//return delta_time().length + 2;
 	uint32_t delta = delta_time().length;
 
-	switch (type()) {
+	if (params == evdata){
+		// running status, no status byte of its own
+		delta--;
+	}
+
+	switch (type) {
 		case EVENT_MIDI_NOTE_ON:
 		case EVENT_MIDI_NOTE_OFF:
+		case EVENT_MIDI_POLY_PRESSURE:
 		case EVENT_MIDI_CHAN_MODE:
 		case EVENT_MIDI_PITCH_WHEEL:
-		case EVENT_META_TRACK_END:
 			return delta + 3;
 
-		case EVENT_META_MIDI_PORT:
-		case EVENT_META_CHAN_PREFIX:
-			return delta + 4;
-
+		// meta events say how long they are, whatever their type, after
+		// the ff and the type byte
 		case EVENT_META_TEXT:
-		case EVENT_META_SEQ_SPECIFIC:
-			return delta + 2 + var_field(evdata + 2).length + var_field(evdata + 2).num;
-
-		case EVENT_META_KEY_SIG:
-			return delta + 5;
-
+		case EVENT_META_SEQUENCE:
+		case EVENT_META_TRACK_END:
 		case EVENT_META_TEMPO:
-			//return delta + 3 + var_field(evdata + 3).length;
-			return delta + 6;
-
 		case EVENT_META_TIME_SIG:
-			return delta + 7;
+		case EVENT_META_KEY_SIG:
+		case EVENT_META_SEQ_SPECIFIC:
+		case EVENT_META_MIDI_PORT:
+		case EVENT_META_CHAN_PREFIX:
+		case EVENT_META_OTHER: {
+			varint_t len = var_field(evdata + 2);
+			return delta + 2 + len.length + len.num;
+		}
+
+		// same for sysex, right after the f0 or f7
+		case EVENT_SYSEX: {
+			varint_t len = var_field(evdata + 1);
+			return delta + 1 + len.length + len.num;
+		}
 
 		case EVENT_MIDI_PROC_CHANGE:
 		case EVENT_MIDI_CHAN_PRESSURE:
 		default:
 			return delta + 2;
 	}
-	// TODO: actually get the length
 }
 
 uint32_t event::type(void){
-	uint8_t status = *evdata;
-
 	// channel voice messages
 	if ((status & 0xf0) != 0xf0) {
 		//printf("    (got here, status: %02x)\n", status >> 4);
 		switch (status >> 4) {
 			case 0x8: return EVENT_MIDI_NOTE_OFF;
 			case 0x9: return EVENT_MIDI_NOTE_ON;
+			case 0xa: return EVENT_MIDI_POLY_PRESSURE;
 			case 0xb: return EVENT_MIDI_CHAN_MODE;
 			case 0xc: return EVENT_MIDI_PROC_CHANGE;
+			case 0xd: return EVENT_MIDI_CHAN_PRESSURE;
 			case 0xe: return EVENT_MIDI_PITCH_WHEEL;
 			default: break;
 		}
@@ -153,13 +169,15 @@ uint32_t event::type(void){
 			return EVENT_META_SEQ_SPECIFIC;
 		}
 
-		else {
-			printf("    unknown metatype %02x\n", metatype);
-		}
+		return EVENT_META_OTHER;
+	}
+
+	else if (status == 0xf0 || status == 0xf7){
+		return EVENT_SYSEX;
 	}
 
 	else if ((status & 0xf0) == 0xf0) {
-		puts("    (got system common message)");
+		MIDI_LOG(LOG_DEBUG, "    (got system common message)");
 	}
 
 	return EVENT_UNKNOWN;
@@ -172,22 +190,26 @@ bool event::is_midi(void){
 }
 
 uint8_t event::midi_channel(void){
-	return *evdata & 0xf;
+	return status & 0xf;
 }
 
 uint16_t event::midi_data(void){
-	switch (type()) {
+	return midi_data(type());
+}
+
+uint16_t event::midi_data(uint32_t type){
+	switch (type) {
 		case EVENT_MIDI_NOTE_ON:
 		case EVENT_MIDI_NOTE_OFF:
 		case EVENT_MIDI_POLY_PRESSURE:
 		case EVENT_MIDI_CTRL_CHANGE:
 		case EVENT_MIDI_PITCH_WHEEL:
 		case EVENT_MIDI_CHAN_MODE:
-			return (evdata[2] << 7) | evdata[1];
+			return (params[1] << 7) | params[0];
 
 		case EVENT_MIDI_PROC_CHANGE:
 		case EVENT_MIDI_CHAN_PRESSURE:
-			return evdata[1];
+			return params[0];
 
 		default:
 			return 0;
@@ -196,21 +218,33 @@ uint16_t event::midi_data(void){
 
 // event_stream class implementations
 event event_stream::get_event(void){
-	return event(data);
+	return event(data, running);
 }
 
 void event_stream::next(void){
 	event ev = get_event();
+	uint32_t type = ev.type();
 
-	if (ev.type() == EVENT_META_TRACK_END){
+	if (type == EVENT_META_TRACK_END){
 		return;
 	}
 
-	data = (const uint8_t *)data + ev.length();
+	// meta events are supposed to cancel running status, but plenty of
+	// files carry it across them, so only channel messages change it
+	if (ev.status >= 0x80 && ev.status < 0xf0){
+		running = ev.status;
+	}
+
+	data = (const uint8_t *)data + ev.length(type);
 }
 
-event_stream::event_stream(const void *ptr){
+event_stream::event_stream(const void *ptr, const void *end){
 	data = ptr;
+	this->end = end;
+}
+
+bool event_stream::done(void){
+	return end && data >= end;
 }
 
 // track class implementations
@@ -222,8 +256,8 @@ track::track(const void *ptr){
 	//if (memcmp(ptr, track_magic, 4) != 0){
 	if (!track::valid(ptr)) {
 		track_t *track = (track_t *)ptr;
-		printf("actual magic: %02x %02x %02x %02x\n",
-		       track->magic[0], track->magic[1], track->magic[2], track->magic[3]);
+		MIDI_LOG(LOG_ERROR, "actual magic: %02x %02x %02x %02x",
+		         track->magic[0], track->magic[1], track->magic[2], track->magic[3]);
 		throw "bad track magic";
 	}
 
@@ -235,7 +269,85 @@ uint32_t track::length(void){
 }
 
 event_stream track::events(void){
-	return event_stream((const uint8_t *)data + sizeof(track_t));
+	return event_stream(start(), end());
+}
+
+const uint8_t *track::start(void){
+	return (const uint8_t *)data + sizeof(track_t);
+}
+
+const uint8_t *track::end(void){
+	return start() + length();
+}
+
+// var_field(), but false instead of reading at or past end
+static bool bounded_var_field(const uint8_t *x, const uint8_t *end, varint_t &ret){
+	ret = {.num = 0, .length = 0};
+
+	do {
+		if (x + ret.length >= end || ret.length == 4){
+			return false;
+		}
+
+		ret.num = (ret.num << 7) | (x[ret.length] & 0x7f);
+	} while (x[ret.length++] & 0x80);
+
+	return true;
+}
+
+void track::check_events(void){
+	const uint8_t *ptr = start();
+	const uint8_t *stop = end();
+	uint8_t running = 0;
+
+	for (;;) {
+		varint_t delta;
+		varint_t len;
+
+		// plenty of files leave out the end of track event, running out
+		// of data ends the track just as well
+		if (ptr >= stop){
+			return;
+		}
+
+		// enough of the event to tell what it is, and for meta and sysex
+		// events, how long they say they are
+		if (!bounded_var_field(ptr, stop, delta)){
+			throw "event runs past the end of its track";
+		}
+
+		const uint8_t *evdata = ptr + delta.length;
+
+		if (evdata >= stop
+		    || (*evdata == 0xff && (stop - evdata < 3
+		                            || !bounded_var_field(evdata + 2, stop, len)))
+		    || ((*evdata == 0xf0 || *evdata == 0xf7)
+		        && !bounded_var_field(evdata + 1, stop, len)))
+		{
+			throw "event runs past the end of its track";
+		}
+
+		event ev(ptr, running);
+		uint32_t type = ev.type();
+
+		if (type == EVENT_UNKNOWN){
+			return;
+		}
+
+		if (ev.length(type) > (size_t)(stop - ptr)){
+			throw "event runs past the end of its track";
+		}
+
+		if (type == EVENT_META_TRACK_END){
+			return;
+		}
+
+		if (ev.status >= 0x80 && ev.status < 0xf0){
+			running = ev.status;
+		}
+
+		ptr += ev.length(type);
+	}
 }
 
 // file class implementations
@@ -250,11 +362,11 @@ file::file(const void *ptr){
 
 	data = ptr;
 
-	printf(
+	MIDI_LOG(LOG_INFO,
 		"length: %u\n"
 		"format: %u\n"
 		"tracks: %u\n"
-		"div.:   %u\n\n",
+		"div.:   %u\n",
 		length(), format(), tracks(), division()
 	);
 }
@@ -293,5 +405,38 @@ track file::get_track(uint32_t id){
 	return track(foo);
 }
 
+std::vector<track> file::checked_tracks(size_t size){
+	std::vector<track> ret;
+
+	if (size < sizeof(file_t)){
+		throw "too short to be a MIDI file";
+	}
+
+	size_t offset = sizeof(file_t) + length() - 6;
+
+	for (unsigned i = 0; i < tracks(); i++) {
+		if (offset + sizeof(track_t) > size){
+			throw "truncated MIDI file";
+		}
+
+		const track_t *trk = (const track_t *)((const uint8_t *)data + offset);
+
+		if (!track::valid(trk)){
+			throw "bad track identifier";
+		}
+
+		offset += sizeof(track_t) + b32_field(trk->length);
+
+		if (offset > size){
+			throw "truncated MIDI file";
+		}
+
+		ret.push_back(track(trk));
+		ret.back().check_events();
+	}
+
+	return ret;
+}
+
 // namespace midi
 }
@@ -0,0 +1,117 @@
+#include <midi/nullsynth.h>
+#include <midi/tracing.h>
+
+#include <stdio.h>
+#include <time.h>
+
+namespace midi {
+
+static double now_secs(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_secs(double secs){
+	struct timespec ts;
+	ts.tv_sec  = (time_t)secs;
+	ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+
+	nanosleep(&ts, NULL);
+}
+
+nullsynth::nullsynth(player *play, uint32_t rate, bool paced,
+                     unsigned buffer_frames)
+	: synth(play, rate), stats(rate), gov(rate)
+{
+	this->paced = paced;
+	capacity = buffer_frames;
+	last_time = now_secs();
+
+	stats.set_reported_latency(capacity / (double)rate);
+	stats.start(last_time);
+}
+
+nullsynth::~nullsynth(){
+	gov.report();
+
+	if (paced){
+		stats.dump(stderr);
+	}
+}
+
+void nullsynth::prefault(void){
+	prefault_render(buffer, SYNTH_BLOCK_SIZE);
+}
+
+// drain the emulated device buffer up to the current time, then block
+// until there's room for the write like Pa_WriteStream() would
+void nullsynth::write(unsigned frames){
+	if (!paced){
+		return;
+	}
+
+	TRACE_SCOPE("write");
+	double now = now_secs();
+
+	queued -= (now - last_time) * sample_rate;
+	last_time = now;
+
+	if (queued < 0){
+		if (primed){
+			stats.underflow();
+		}
+
+		queued = 0;
+	}
+
+	double available = capacity - queued;
+	stats.before_write((long)available);
+
+	if (frames > available){
+		// writes bigger than the whole buffer only wait for it to drain
+		double excess = (frames - available < queued)? frames - available : queued;
+
+		sleep_secs(excess / sample_rate);
+		now = now_secs();
+		queued -= (now - last_time) * sample_rate;
+		last_time = now;
+
+		if (queued < 0){
+			queued = 0;
+		}
+	}
+
+	if (!primed){
+		// stream clock starts with the first write
+		stats.start(now);
+		primed = true;
+	}
+
+	queued += frames;
+	stats.after_write(frames, now);
+}
+
+double nullsynth::output_latency(void){
+	return stats.block_latency();
+}
+
+void nullsynth::output(uint32_t frames){
+	while (frames > 0){
+		unsigned n = (frames >= SYNTH_BLOCK_SIZE)? SYNTH_BLOCK_SIZE : frames;
+		frames -= n;
+
+		gov.block_start();
+		render(buffer, n);
+
+		if (gov.block_end(n)){
+			set_quality(gov.quality());
+		}
+
+		write(n);
+	}
+}
+
+// namespace midi
+}
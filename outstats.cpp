@@ -0,0 +1,113 @@
+#include <midi/outstats.h>
+
+namespace midi {
+
+output_stats::output_stats(uint32_t rate){
+	sample_rate = rate;
+}
+
+void output_stats::start(double now){
+	start_time = now;
+	last_log = now;
+}
+
+void output_stats::before_write(long available){
+	if (available < 0){
+		// backend couldn't tell us, don't skew the figures
+		return;
+	}
+
+	if (available > buffer_frames){
+		buffer_frames = available;
+	}
+
+	long fill = buffer_frames - available;
+
+	if (fill_min < 0 || fill < fill_min) fill_min = fill;
+	if (fill > fill_max) fill_max = fill;
+
+	fill_sum += fill;
+	last_fill = fill;
+}
+
+void output_stats::after_write(unsigned frames, double now){
+	writes++;
+	frames_written += frames;
+
+	double queued_until = start_time + frames_written / (double)sample_rate;
+	double latency = queued_until - now;
+
+	if (latency < 0){
+		// we fell behind the device clock, so the buffer ran dry and only
+		// holds what was just written, re-anchor the clock to match
+		start_time = now + (frames - (double)frames_written) / sample_rate;
+		latency = frames / (double)sample_rate;
+	}
+
+	if (latency_min < 0 || latency < latency_min) latency_min = latency;
+	if (latency > latency_max) latency_max = latency;
+
+	latency_sum += latency;
+	last_latency = latency;
+	last_frames = frames;
+
+	if (log_per_second && now - last_log >= 1.0){
+		log_line(stderr);
+		last_log = now;
+	}
+}
+
+double output_stats::block_latency(void){
+	double ret = last_latency - last_frames / (double)sample_rate;
+
+	return (ret > 0)? ret : 0;
+}
+
+void output_stats::underflow(void){
+	underflows++;
+}
+
+void output_stats::write_error(void){
+	errors++;
+}
+
+void output_stats::set_reported_latency(double secs){
+	reported_latency = secs;
+}
+
+void output_stats::log_line(FILE *fp){
+	fprintf(fp, "midithing: output: %lu writes, %lu underflows, "
+	            "fill %ld/%ld frames, latency %.1f ms\n",
+	        (unsigned long)(writes - logged_writes),
+	        (unsigned long)(underflows - logged_underflows),
+	        last_fill, buffer_frames, last_latency * 1000);
+
+	logged_writes = writes;
+	logged_underflows = underflows;
+}
+
+void output_stats::dump(FILE *fp){
+	double n = writes? writes : 1;
+
+	fprintf(fp,
+		"output stats:\n"
+		"    writes:           %lu (%lu frames, %.2f secs)\n"
+		"    underflows:       %lu\n"
+		"    write errors:     %lu\n"
+		"    buffer size:      %ld frames (estimated)\n"
+		"    buffer fill:      min %ld, mean %.0f, max %ld frames\n"
+		"    reported latency: %.1f ms\n"
+		"    measured latency: min %.1f, mean %.1f, max %.1f ms\n",
+		(unsigned long)writes, (unsigned long)frames_written,
+		frames_written / (double)sample_rate,
+		(unsigned long)underflows,
+		(unsigned long)errors,
+		buffer_frames,
+		(fill_min < 0)? 0 : fill_min, fill_sum / n, fill_max,
+		reported_latency * 1000,
+		((latency_min < 0)? 0 : latency_min) * 1000,
+		(latency_sum / n) * 1000, latency_max * 1000);
+}
+
+// namespace midi
+}
@@ -0,0 +1,225 @@
+#include <midi/patch.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fstream>
+#include <sstream>
+
+namespace midi {
+
+patch_plan_t lower_patch(const patch_layer_t *layers, unsigned count,
+                         double drive, double gain)
+{
+	patch_plan_t plan;
+	unsigned n = 0;
+
+	memset(&plan, 0, sizeof(plan));
+
+	for (unsigned i = 0; i < count; i++) {
+		const patch_layer_t &x = layers[i];
+		// squares are sines clipped at zero, the way squarewave() does it
+		bool sine = x.shape == PATCH_SHAPE_SINE || x.shape == PATCH_SHAPE_SQUARE;
+		double clip = (x.shape == PATCH_SHAPE_SQUARE)? 0 : x.clip;
+
+		switch (x.shape) {
+			case PATCH_SHAPE_TRIANGLE: plan.steps[n].op = PATCH_OP_TRIANGLE; break;
+			case PATCH_SHAPE_SAW:      plan.steps[n].op = PATCH_OP_SAW; break;
+			default:                   plan.steps[n].op = PATCH_OP_SINE; break;
+		}
+
+		plan.steps[n].transpose = x.transpose;
+		plan.steps[n++].a = x.ratio;
+
+		// clipping only means anything for the sine based shapes, and
+		// only below full scale unless something moves the level
+		if (sine && x.lfo_depth != 0){
+			plan.steps[n++] = {PATCH_OP_CLIP_LFO, 0, clip, x.lfo_rate, x.lfo_depth};
+
+		} else if (sine && clip < 1){
+			plan.steps[n++] = {PATCH_OP_CLIP, 0, clip, 0, 0};
+		}
+
+		plan.steps[n++] = {PATCH_OP_MIX, 0, x.gain, 0, 0};
+	}
+
+	if (drive > 0){
+		plan.steps[n++] = {PATCH_OP_DRIVE, 0, drive, 0, 0};
+	}
+
+	plan.steps[n++] = {PATCH_OP_OUTPUT, 0, gain, 0, 0};
+	plan.count = n;
+
+	return plan;
+}
+
+static double parse_number(const std::string &str){
+	char *end;
+	double ret = strtod(str.c_str(), &end);
+
+	if (str.empty() || *end){
+		throw "bad number in patch file";
+	}
+
+	return ret;
+}
+
+static uint8_t parse_shape(const std::string &str){
+	if (str == "sine")     return PATCH_SHAPE_SINE;
+	if (str == "square")   return PATCH_SHAPE_SQUARE;
+	if (str == "triangle") return PATCH_SHAPE_TRIANGLE;
+	if (str == "saw")      return PATCH_SHAPE_SAW;
+
+	throw "unknown shape in patch file, expected sine, square, triangle or saw";
+}
+
+static patch_layer_t parse_layer(std::istringstream &fields){
+	patch_layer_t ret = {PATCH_SHAPE_SINE, 0, 1, 1, 0, 0, 1};
+	std::string opt;
+
+	while (fields >> opt) {
+		size_t eq = opt.find('=');
+		std::string name = opt.substr(0, eq);
+		std::string value = (eq == std::string::npos)? "" : opt.substr(eq + 1);
+
+		if (eq == std::string::npos){
+			ret.shape = parse_shape(name);
+
+		} else if (name == "shape"){
+			ret.shape = parse_shape(value);
+
+		} else if (name == "transpose"){
+			double semitones = parse_number(value);
+
+			if (semitones < -48 || semitones > 48 || semitones != floor(semitones)){
+				throw "transpose should be whole semitones, up to 48 either way";
+			}
+
+			ret.transpose = semitones;
+
+		} else if (name == "detune"){
+			ret.ratio = exp2(parse_number(value) / 1200);
+
+		} else if (name == "clip"){
+			ret.clip = parse_number(value);
+
+		} else if (name == "lfo"){
+			size_t colon = value.find(':');
+
+			if (colon == std::string::npos){
+				throw "lfo should be rate:depth";
+			}
+
+			ret.lfo_rate = parse_number(value.substr(0, colon));
+			ret.lfo_depth = parse_number(value.substr(colon + 1));
+
+		} else if (name == "gain"){
+			ret.gain = parse_number(value);
+
+		} else {
+			throw "unknown layer option in patch file";
+		}
+	}
+
+	return ret;
+}
+
+patch_set::patch_set(const char *path){
+	std::ifstream in(path);
+	std::string line;
+	std::vector<int> programs;
+	patch_layer_t layers[PATCH_MAX_LAYERS];
+	unsigned num_layers = 0;
+	double drive = 0;
+	double gain = 1;
+
+	if (!in){
+		throw "could not open patch file";
+	}
+
+	for (unsigned i = 0; i < 128; i++) {
+		program_plan[i] = -1;
+	}
+
+	// the patch being read is finished when the next starts, or at the end
+	auto finish = [&](){
+		if (programs.empty()){
+			return;
+		}
+
+		if (num_layers == 0){
+			throw "patch without any layers";
+		}
+
+		for (int x : programs) {
+			program_plan[x] = plans.size();
+		}
+
+		plans.push_back(lower_patch(layers, num_layers, drive, gain));
+		programs.clear();
+		num_layers = 0;
+		drive = 0;
+		gain = 1;
+	};
+
+	while (std::getline(in, line)) {
+		std::istringstream fields(line.substr(0, line.find('#')));
+		std::string word;
+
+		if (!(fields >> word)){
+			continue;
+		}
+
+		if (word == "patch"){
+			finish();
+
+			while (fields >> word) {
+				int lo, hi;
+				char dash;
+				std::istringstream range(word);
+
+				if (!(range >> lo)){
+					throw "bad program range in patch file";
+				}
+
+				hi = (range >> dash >> hi && dash == '-')? hi : lo;
+
+				if (lo < 0 || hi > 127 || lo > hi){
+					throw "programs in patch file should be 0 to 127";
+				}
+
+				for (int x = lo; x <= hi; x++) {
+					programs.push_back(x);
+				}
+			}
+
+			if (programs.empty()){
+				throw "patch needs at least one program";
+			}
+
+		} else if (programs.empty()){
+			throw "patch file settings need a patch line before them";
+
+		} else if (word == "layer"){
+			if (num_layers == PATCH_MAX_LAYERS){
+				throw "too many layers in patch";
+			}
+
+			layers[num_layers++] = parse_layer(fields);
+
+		} else if (word == "drive" && fields >> word){
+			drive = parse_number(word);
+
+		} else if (word == "gain" && fields >> word){
+			gain = parse_number(word);
+
+		} else {
+			throw "unknown line in patch file";
+		}
+	}
+
+	finish();
+}
+
+// namespace midi
+}
@@ -1,4 +1,5 @@
 #include <midi/paudiosynth.h>
+#include <midi/tracing.h>
 #include <portaudio.h>
 
 namespace midi {
@@ -11,15 +12,18 @@ static inline PaError throw_if_error(PaError x){
 	return x;
 }
 
-paudiosynth::paudiosynth(player *play, uint32_t rate)
-	: synth(play, rate)
+paudiosynth::paudiosynth(player *play, uint32_t rate, bool low_latency)
+	: synth(play, rate), stats(rate), gov(rate)
 {
 	throw_if_error(Pa_Initialize());
+	block_frames = low_latency? SYNTH_BLOCK_SIZE / 4 : SYNTH_BLOCK_SIZE;
 
 	audio_params.device       = Pa_GetDefaultOutputDevice();
-	audio_params.channelCount = 1;
+	audio_params.channelCount = SYNTH_CHANNELS;
 	audio_params.sampleFormat = paInt16;
-	audio_params.suggestedLatency = Pa_GetDeviceInfo(audio_params.device)->defaultHighOutputLatency;
+	audio_params.suggestedLatency = low_latency
+		? Pa_GetDeviceInfo(audio_params.device)->defaultLowOutputLatency
+		: Pa_GetDeviceInfo(audio_params.device)->defaultHighOutputLatency;
 	audio_params.hostApiSpecificStreamInfo = NULL;
 
 	throw_if_error(
@@ -34,32 +38,63 @@ paudiosynth::paudiosynth(player *play, uint32_t rate)
 			NULL /* no callback, so no userData */
 			));
 
+	const PaStreamInfo *info = Pa_GetStreamInfo(stream);
+
+	if (info){
+		stats.set_reported_latency(info->outputLatency);
+	}
+
 	Pa_StartStream(stream);
+	stats.start(Pa_GetStreamTime(stream));
 }
 
 paudiosynth::~paudiosynth(){
+	if (report){
+		gov.report();
+		stats.dump(stderr);
+	}
+
 	throw_if_error(Pa_StopStream(stream));
 	throw_if_error(Pa_CloseStream(stream));
 }
 
-#define BUFFER_SIZE (512)
+void paudiosynth::prefault(void){
+	prefault_render(buffer, block_frames);
+}
 
-void paudiosynth::wait(uint32_t usecs){
-	static int16_t buffer[BUFFER_SIZE];
-	uint32_t samples = sample_rate * (usecs / 1000000.0);
+double paudiosynth::output_latency(void){
+	return stats.block_latency();
+}
 
-	while (samples > 0){
-		unsigned n = (samples >= BUFFER_SIZE)? BUFFER_SIZE : samples;
-		samples -= n;
+void paudiosynth::output(uint32_t frames){
+	while (frames > 0){
+		unsigned n = (frames >= block_frames)? block_frames : frames;
+		frames -= n;
 
-		for (unsigned i = 0; i < n; i++)
-			buffer[i] = next_sample();
+		gov.block_start();
+		render(buffer, n);
 
-		PaError err = Pa_WriteStream(stream, buffer, n);
+		if (gov.block_end(n)){
+			set_quality(gov.quality());
+		}
+
+		stats.before_write(Pa_GetStreamWriteAvailable(stream));
+		PaError err;
+
+		{
+			TRACE_SCOPE("Pa_WriteStream");
+			err = Pa_WriteStream(stream, buffer, n);
+		}
+
+		if (err == paOutputUnderflowed){
+			stats.underflow();
 
-		if (err != paNoError){
+		} else if (err != paNoError){
+			stats.write_error();
 			fprintf(stderr, "midithing: error during Pa_WriteStream(): %d\n", err);
 		}
+
+		stats.after_write(n, Pa_GetStreamTime(stream));
 	}
 }
 
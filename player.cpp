@@ -1,5 +1,9 @@
 #include <midi/midi.h>
 #include <midi/player.h>
+#include <midi/live.h>
+#include <midi/log.h>
+#include <midi/tracing.h>
+#include <midi/snapshot.h>
 
 #include <stdio.h>
 #include <limits.h>
@@ -10,30 +14,140 @@
 namespace midi {
 
 channel::channel(){
+	reset();
+}
+
+void channel::reset(void){
 	memset(notemap, 0, sizeof(notemap));
 	memset(active, 0, sizeof(active));
+	instrument = 0;
+	volume = 100;
+	pan = 64;
+	bend_range = 2;
+	reset_controllers();
+	changed = false;
+}
+
+// everything CC121 resets, volume and pan stay as they are
+void channel::reset_controllers(void){
+	memset(sustained, 0, sizeof(sustained));
+	expression = 127;
+	modulation = 0;
+	bend = 0x2000;
+	sustain = false;
+	rpn = 0x3fff;
+}
+
+void channel::save_state(std::string &out) const {
+	save_field(out, instrument);
+	save_field(out, volume);
+	save_field(out, expression);
+	save_field(out, pan);
+	save_field(out, modulation);
+	save_field(out, bend);
+	save_field(out, bend_range);
+	save_field(out, sustain);
+	save_field(out, notemap);
+	save_field(out, active);
+	save_field(out, changed);
+	save_field(out, sustained);
+	save_field(out, rpn);
 }
 
 void channel::note_on(uint16_t midi_data){
 	uint8_t key = midi_data & 0x7f;
 	uint8_t velocity = midi_data >> 7;
 
+	if (velocity == 0){
+		// running note off
+		note_off(midi_data);
+		return;
+	}
+
 	notemap[key] = velocity;
+	sustained[key] = false;
 	changed = true;
 	//regen_active();
 
-	printf("::: channel: key %u on, velocity %u\n", key, velocity);
+	MIDI_LOG(LOG_TRACE, "::: channel: key %u on, velocity %u", key, velocity);
 }
 
 void channel::note_off(uint16_t midi_data){
 	uint8_t key = midi_data & 0x7f;
 	uint8_t velocity = midi_data >> 7;
 
-	notemap[key] = 0;
+	if (sustain){
+		// keeps sounding until the pedal comes up
+		sustained[key] = notemap[key] != 0;
+
+	} else {
+		notemap[key] = 0;
+		changed = true;
+	}
+
+	MIDI_LOG(LOG_TRACE, "::: channel: key %u off, velocity %u", key, velocity);
+}
+
+void channel::release_sustained(void){
+	for (unsigned i = 0; i < 128; i++) {
+		if (sustained[i]){
+			notemap[i] = 0;
+			sustained[i] = false;
+			changed = true;
+		}
+	}
+}
+
+void channel::all_notes_off(void){
+	memset(notemap, 0, sizeof(notemap));
+	memset(sustained, 0, sizeof(sustained));
 	changed = true;
-	//regen_active();
+}
+
+void channel::control_change(uint16_t midi_data){
+	uint8_t controller = midi_data & 0x7f;
+	uint8_t value = midi_data >> 7;
+
+	switch (controller) {
+		case 1:   modulation = value; break;
+		case 7:   volume = value; break;
+		case 10:  pan = value; break;
+		case 11:  expression = value; break;
+
+		// data entry, only the pitch bend range is supported
+		case 6:
+			if (rpn == 0){
+				bend_range = (value > 24)? 24 : value;
+			}
+			break;
 
-	printf("::: channel: key %u off, velocity %u\n", key, velocity);
+		case 100: rpn = (rpn & 0x3f80) | value; break;
+		case 101: rpn = (rpn & 0x7f) | (value << 7); break;
+
+		case 64:
+			sustain = value >= 64;
+
+			if (!sustain){
+				release_sustained();
+			}
+			break;
+
+		case 121: reset_controllers(); break;
+
+		// all sound off, all notes off
+		case 120:
+		case 123: all_notes_off(); break;
+
+		default: break;
+	}
+
+	MIDI_LOG(LOG_TRACE, "::: channel: controller %u = %u", controller, value);
+}
+
+void channel::pitch_bend(uint16_t midi_data){
+	bend = midi_data & 0x3fff;
+
+	MIDI_LOG(LOG_TRACE, "::: channel: pitch bend %u", bend);
 }
 
 void channel::update(void){
@@ -61,12 +175,20 @@ void channel::regen_active(void){
 	}
 }
 
-player::player(file f){
-	// default tempo of 120 bpm
-	usecs_per_tick = (60000.0 / (120 * f.division())) * 1000;
+// default tempo of 120 bpm, until the file says otherwise
+static const uint32_t default_usecs_per_quarter = 500000;
+
+player::player(file f)
+	: clock(f)
+{
+	usecs_per_tick = clock.tick_usecs(default_usecs_per_quarter);
 	load_tracks(f);
 }
 
+player::player(void){
+	usecs_per_tick = 0;
+}
+
 void player::set_synth(synth *syn){
 	synthesizer = syn;
 }
@@ -76,40 +198,53 @@ void player::load_tracks(file f){
 		track temp = f.get_track(i);
 		tracks.push_back(player_track(temp));
 
-		printf("have track with length %u\n", temp.length());
+		MIDI_LOG(LOG_INFO, "have track with length %u", temp.length());
 	}
 
-	puts("note: we're in player::load_tracks()");
+	MIDI_LOG(LOG_DEBUG, "note: we're in player::load_tracks()");
+}
+
+void player::load(const std::vector<track> &trks, uint16_t division){
+	tracks.clear();
+
+	for (auto &x : trks) {
+		tracks.push_back(player_track(x));
+	}
+
+	clock = tempo_map(trks, division);
+	stop_requested = false;
+	rewind();
+	set_state(PLAYER_INITIALIZED);
 }
 
 void player::dump_tracks(void){
 	for (auto &x : tracks) {
-		event ev = x.stream.get_event();
 		printf("  events:\n");
 
-		while (ev.type() != EVENT_UNKNOWN && ev.type() != EVENT_META_TRACK_END) {
+		while (!x.stream.done()) {
+			event ev = x.stream.get_event();
+			uint32_t type = ev.type();
+
+			if (type == EVENT_UNKNOWN || type == EVENT_META_TRACK_END){
+				break;
+			}
+
 			// TODO: wrap this up in an iterator
 
 			printf("    %s (after %u) ",
-				   midi_event_string(ev.type()),
+				   midi_event_string(type),
 				   ev.delta_time().num );
 
-			if (ev.is_midi()) {
+			if (type >= EVENT_MIDI_NOTE_ON && type <= EVENT_MIDI_CHAN_MODE) {
 				uint8_t  channel = ev.midi_channel();
-				uint16_t data    = ev.midi_data();
+				uint16_t data    = ev.midi_data(type);
 
 				printf("chan. %x: %04x", channel, data);
 			}
 
 			printf("\n");
 
-			if (ev.type() == EVENT_UNKNOWN) {
-				printf("    event length: %u\n", ev.length());
-				printf("    debug: %08x\n", ev.debug_bytes());
-			}
-
 			x.stream.next();
-			ev = x.stream.get_event();
 		}
 	}
 }
@@ -127,84 +262,489 @@ unsigned player::tracks_active(void){
 }
 
 void print_event(event &ev){
-	printf("::: event: %s (after %u) ",
-		   midi_event_string(ev.type()),
-		   ev.delta_time().num );
-
 	if (ev.is_midi()) {
-		uint8_t  channel = ev.midi_channel();
-		uint16_t data    = ev.midi_data();
+		MIDI_LOG(LOG_TRACE, "::: event: %s (after %u) chan. %x: %04x",
+		         midi_event_string(ev.type()), ev.delta_time().num,
+		         ev.midi_channel(), ev.midi_data());
 
-		printf("chan. %x: %04x", channel, data);
+	} else {
+		MIDI_LOG(LOG_TRACE, "::: event: %s (after %u)",
+		         midi_event_string(ev.type()), ev.delta_time().num);
 	}
 
-	printf("\n");
-
 	if (ev.type() == EVENT_UNKNOWN) {
-		printf("    event length: %u\n", ev.length());
-		printf("    debug: %08x\n", ev.debug_bytes());
+		MIDI_LOG(LOG_TRACE, "    event length: %u", ev.length());
+		MIDI_LOG(LOG_TRACE, "    debug: %08x", ev.debug_bytes());
 	}
 }
 
-void player::play(void){
-	while (tracks_active() > 0) {
-		uint32_t min_next = UINT_MAX;
+// interpret every event that's due at the current tick, returns the number
+// of ticks until the next one, or UINT_MAX if there's nothing left to play
+uint32_t player::process_events(bool defer, uint32_t offset){
+	uint32_t min_next = UINT_MAX;
+
+	for (auto &x : tracks) {
+reinterpret:
 
-		for (auto &x : tracks) {
-	reinterpret:
+		if (!x.active){
+			continue;
+		}
 
-			if (!x.active){
+		// TODO: This assumes the first event has a delta of zero, which might
+		//       not be the case, and will throw off timing it's not
+		if (x.next_tick <= tick) {
+			// nothing past an event we can't find the length of can be
+			// trusted, the track stops there, same as at the end of its data
+			if (x.stream.done() || x.stream.get_event().type() == EVENT_UNKNOWN){
+				x.active = false;
 				continue;
 			}
 
-			// TODO: This assumes the first event has a delta of zero, which might
-			//       not be the case, and will throw off timing it's not
-			if (x.next_tick <= tick) {
-				event ev = x.stream.get_event();
+			event ev = x.stream.get_event();
+			bool more;
 
-				do {
+			do {
+				// a tempo change has to be in effect before the events
+				// after it are scheduled, rather than when it's reached
+				if (defer && ev.type() != EVENT_META_TEMPO){
+					schedule_event(ev.raw(), offset, ev.status);
+				} else {
 					interpret(ev);
-					x.stream.next();
+				}
+
+				x.stream.next();
+				more = !x.stream.done();
+
+				if (more){
 					ev = x.stream.get_event();
-				} while (ev.delta_time().num == 0 && ev.type() != EVENT_META_TRACK_END);
+				}
+			} while (more && ev.delta_time().num == 0 && ev.type() != EVENT_META_TRACK_END
+			         && ev.type() != EVENT_UNKNOWN);
+
+			x.next_tick = tick + ev.delta_time().num;
+
+			if (!more || ev.type() == EVENT_META_TRACK_END || ev.type() == EVENT_UNKNOWN){
+				x.active = false;
+			}
+
+			goto reinterpret;
+
+		} else if (x.next_tick < min_next) {
+			min_next = x.next_tick;
+		}
+	}
+
+	if (!defer){
+		for (auto &x : channels){
+			x.update();
+		}
+	}
+
+	return (min_next == UINT_MAX)? UINT_MAX : min_next - tick;
+}
+
+double player::frames_per_tick(void){
+	return usecs_per_tick / tempo_scale * synthesizer->rate() / 1000000.0;
+}
+
+// Gathers the events due within the next block into the schedule, each at
+// the frame it falls on. The fraction of a frame before the next event is
+// carried over in ticks_pending, so positions never drift. Returns true
+// once the sequence has run out of events.
+bool player::schedule_block(uint32_t frames){
+	TRACE_SPAN(span, "schedule");
+	double fpt = frames_per_tick();
+	double pos = ticks_pending * fpt;
+
+	num_scheduled = 0;
+	next_scheduled = 0;
+	dispatch_cursor = 0;
+
+	while (pos < frames) {
+		tick = event_tick;
+		uint32_t delta = process_events(true, pos);
+
+		if (delta == UINT_MAX){
+			// let go of anything still held right after the last events
+			schedule_event(NULL, pos);
+			ticks_pending = 0;
+
+			if (end_frame == UINT64_MAX){
+				end_frame = frames_played + (uint64_t)pos;
+			}
+
+			TRACE_SPAN_ARG(span, "events", num_scheduled);
+			return true;
+		}
+
+		// the events just processed may have changed the tempo
+		fpt = frames_per_tick();
+		event_tick = tick + delta;
+		pos += delta * fpt;
+	}
+
+	ticks_pending = (pos - frames) / fpt;
+	TRACE_SPAN_ARG(span, "events", num_scheduled);
+	return false;
+}
+
+void player::schedule_event(const void *data, uint32_t offset, uint8_t status){
+	if (num_scheduled == PLAYER_MAX_SCHEDULED){
+		// out of room, apply what's there now rather than lose the order
+		while (next_scheduled < num_scheduled) {
+			apply(schedule[next_scheduled++]);
+		}
+
+		num_scheduled = 0;
+		next_scheduled = 0;
+	}
+
+	schedule[num_scheduled++] = {offset, data, status};
+}
+
+void player::apply(const scheduled_event_t &sched){
+	if (event_hash){
+		fingerprint(sched);
+	}
+
+	if (!sched.data){
+		// nothing left to play, release tails ring out from here
+		for (auto &x : channels) {
+			x.all_notes_off();
+		}
+
+		return;
+	}
+
+	if (synthesizer->timing){
+		synthesizer->timing->events++;
+	}
+
+	event ev(sched.data, sched.status);
+	TRACE_INSTANT(midi_event_string(ev.type()), "offset", sched.offset);
+	interpret(ev);
+}
+
+void player::fingerprint(const scheduled_event_t &sched){
+	uint64_t at = frames_played + sched.offset;
+
+	if (!sched.data){
+		// every block after the end gets one of these, only the first
+		// changes anything
+		if (at == end_frame){
+			*event_hash = fnv_hash(*event_hash, &at, sizeof(at));
+		}
+
+		return;
+	}
 
-				x.next_tick = tick + ev.delta_time().num;
+	// the bytes after the status, whether or not it was left out
+	event ev(sched.data, sched.status);
+	const uint8_t *end = (const uint8_t *)ev.raw() + ev.length();
 
-				if (ev.type() == EVENT_META_TRACK_END || ev.type() == EVENT_UNKNOWN){
-					x.active = false;
+	*event_hash = fnv_hash(*event_hash, &at, sizeof(at));
+	*event_hash = fnv_hash(*event_hash, &ev.status, 1);
+	*event_hash = fnv_hash(*event_hash, ev.params,
+	                       (end > ev.params)? end - ev.params : 0);
+}
+
+uint32_t player::dispatch(uint32_t frames){
+	bool any = false;
+
+	while (next_scheduled < num_scheduled
+	       && schedule[next_scheduled].offset <= dispatch_cursor)
+	{
+		apply(schedule[next_scheduled++]);
+		any = true;
+	}
+
+	if (any){
+		for (auto &x : channels){
+			x.update();
+		}
+	}
+
+	if (next_scheduled < num_scheduled){
+		uint32_t until = schedule[next_scheduled].offset - dispatch_cursor;
+		frames = (until < frames)? until : frames;
+	}
+
+	dispatch_cursor += frames;
+	return frames;
+}
+
+uint32_t player::step(uint32_t frames){
+	uint32_t done = 0;
+
+	if (state != PLAYER_STARTED && state != PLAYER_PAUSED){
+		set_state(PLAYER_STARTED);
+		synthesizer->set_mute_mask(mute_mask);
+		synthesizer->set_paused(false);
+	}
+
+	while (done < frames) {
+		TRACE_SPAN(span, "player block");
+
+		if (handle_commands() && stop_requested){
+			break;
+		}
+
+		if (state == PLAYER_PAUSED){
+			// keep the output fed, with silence while paused
+			num_scheduled = 0;
+			synthesizer->output(frames - done);
+			done = frames;
+			break;
+		}
+
+		if (tracks_active() == 0 && !synthesizer->sounding()){
+			// already played out
+			set_state(PLAYER_STOPPED);
+			break;
+		}
+
+		uint32_t n = frames - done;
+		n = (n < SYNTH_BLOCK_SIZE)? n : SYNTH_BLOCK_SIZE;
+		TRACE_SPAN_ARG(span, "frames", n);
+
+		render_stats *timing = synthesizer->timing;
+
+		if (timing){
+			timing->block_start();
+		}
+
+		bool ended = schedule_block(n);
+
+		if (timing){
+			timing->output_start();
+		}
+
+		// the synth splits the block at each event as it renders
+		synthesizer->output(n);
+		done += n;
+		frames_played += n;
+
+		if (timing){
+			timing->block_end(n);
+		}
+		publish_position(event_tick - ticks_pending);
+
+		if (ended && !synthesizer->sounding()){
+			set_state(PLAYER_STOPPED);
+			break;
+		}
+	}
+
+	return done;
+}
+
+// returns true if the play position was moved, by a seek or a stop
+bool player::handle_commands(void){
+	transport_command_t cmd;
+	bool moved = false;
+
+	while (control.next_command(cmd)) {
+		switch (cmd.type) {
+			case TRANSPORT_PLAY:
+				if (state == PLAYER_PAUSED){
+					set_state(PLAYER_STARTED);
+					synthesizer->set_paused(false);
+				}
+				break;
+
+			case TRANSPORT_PAUSE:
+				if (state == PLAYER_STARTED){
+					set_state(PLAYER_PAUSED);
+					synthesizer->set_paused(true);
+				}
+				break;
+
+			case TRANSPORT_STOP:
+				stop_requested = true;
+				rewind();
+				moved = true;
+				break;
+
+			case TRANSPORT_SEEK:
+				seek(cmd.position);
+				moved = true;
+				break;
+
+			case TRANSPORT_TEMPO_SCALE:
+				tempo_scale = cmd.value;
+				control.publish_tempo_scale(tempo_scale);
+				break;
+
+			case TRANSPORT_MUTE:
+				if (cmd.value){
+					mute_mask |= 1 << cmd.channel;
+				} else {
+					mute_mask &= ~(1 << cmd.channel);
 				}
 
-				goto reinterpret;
+				control.publish_mute_mask(mute_mask);
+				synthesizer->set_mute_mask(mute_mask);
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	return moved;
+}
+
+// replay everything before the target without rendering it, so that held
+// notes and program changes end up as they would be if we'd played through
+void player::seek(uint64_t usecs){
+	rewind();
 
-			} else if (x.next_tick < min_next) {
-				min_next = x.next_tick;
+	while (tracks_active() > 0) {
+		uint32_t delta = process_events();
+
+		if (delta == UINT_MAX){
+			break;
+		}
+
+		// any tempo change at this tick has been applied, so
+		// usecs_per_tick holds until the next event
+		uint64_t now = clock.usecs(tick);
+
+		if (clock.usecs(tick + delta) > usecs){
+			double target = tick + (usecs - now) / usecs_per_tick;
+
+			event_tick = tick + delta;
+			ticks_pending = event_tick - target;
+			tick = target;
+			break;
+		}
+
+		tick += delta;
+	}
+
+	publish_position(tick);
+}
+
+void player::rewind(void){
+	for (auto &x : tracks) {
+		x.reset();
+	}
+
+	for (auto &x : channels) {
+		x.reset();
+	}
+
+	// the file's tempo events are played again from the start
+	usecs_per_tick = clock.tick_usecs(default_usecs_per_quarter);
+	clock.rewind();
+	tick = 0;
+	event_tick = 0;
+	ticks_pending = 0;
+	frames_played = 0;
+	end_frame = UINT64_MAX;
+	publish_position(0);
+}
+
+void player::set_state(unsigned st){
+	state = st;
+	control.publish_state(st);
+}
+
+void player::publish_position(double ticks){
+	uint32_t whole = ticks;
+
+	control.publish_position(clock.usecs(whole) + (ticks - whole) * usecs_per_tick);
+}
+
+void player::play(void){
+	stop_requested = false;
+
+	// step() handles transport commands at each block boundary
+	while (!stop_requested && step(SYNTH_BLOCK_SIZE) > 0);
+
+	set_state(PLAYER_STOPPED);
+}
+
+// live input is rendered in small blocks, messages which arrived during
+// a block are applied at the start of the next one
+#define LIVE_BLOCK_SIZE (SYNTH_BLOCK_SIZE / 4)
+
+void player::play_live(live_input &in){
+	// events are parsed with a delta time prefix, keep it at zero
+	uint8_t buf[4] = {0};
+	uint64_t arrivals[LIVE_BLOCK_SIZE];
+
+	stop_requested = false;
+	set_state(PLAYER_STARTED);
+	synthesizer->set_mute_mask(mute_mask);
+	synthesizer->set_paused(false);
+
+	while (!stop_requested) {
+		handle_commands();
+
+		// check before draining, so that nothing queued before the
+		// input closed gets left behind
+		bool finished = in.finished();
+		live_message_t msg;
+		unsigned n = 0;
+		render_stats *timing = synthesizer->timing;
+		TRACE_SPAN(span, "live block");
+
+		if (timing){
+			timing->block_start();
+		}
+
+		while (n < LIVE_BLOCK_SIZE && in.next(msg)) {
+			if (msg.bytes[0] == 0xff){
+				// system reset
+				for (auto &x : channels) {
+					x.reset();
+				}
+
+			} else {
+				memcpy(buf + 1, msg.bytes, sizeof(msg.bytes));
+				event ev(buf);
+				interpret(ev);
 			}
+
+			arrivals[n++] = msg.arrival;
 		}
 
 		for (auto &x : channels){
 			x.update();
 		}
 
-		if (min_next != UINT_MAX){
-			uint32_t delta = min_next - tick;
+		TRACE_SPAN_ARG(span, "messages", n);
+
+		if (timing){
+			timing->events += n;
+			timing->output_start();
+		}
+
+		synthesizer->output(LIVE_BLOCK_SIZE);
 
-			synthesizer->wait(delta * usecs_per_tick);
-			tick += delta;
+		if (timing){
+			timing->block_end(LIVE_BLOCK_SIZE);
+		}
+
+		double heard = live_clock() / 1e9 + synthesizer->output_latency();
+
+		for (unsigned i = 0; i < n; i++) {
+			in.record_latency(heard - arrivals[i] / 1e9);
+		}
+
+		if (finished && n == 0){
+			break;
 		}
 	}
 
-	// and there's nothing left to play
-	// TODO: if looping is enabled, reset all tracks and start from the beginning
-	state = PLAYER_STOPPED;
+	set_state(PLAYER_STOPPED);
 }
 
 void player::loop(unsigned loops){
-	for (unsigned i = 0; i < loops; i++) {
+	for (unsigned i = 0; i < loops && !stop_requested; i++) {
 		play();
-
-		for (auto &x : tracks) {
-			x.reset();
-		}
+		rewind();
 	}
 }
 
@@ -220,10 +760,23 @@ void player::interpret(event &ev){
 			channels[ev.midi_channel()].note_off(ev.midi_data());
 			break;
 
+		case EVENT_MIDI_CHAN_MODE:
+			channels[ev.midi_channel()].control_change(ev.midi_data());
+			break;
+
+		case EVENT_MIDI_PITCH_WHEEL:
+			channels[ev.midi_channel()].pitch_bend(ev.midi_data());
+			break;
+
+		case EVENT_META_TEMPO:
+			set_tempo(ev);
+			break;
+
 		case EVENT_MIDI_PROC_CHANGE:
 			channels[ev.midi_channel()].instrument = ev.midi_data();
-			printf("::: channel: set instrument %u (group: %u)\n",
-			       ev.midi_data(), ev.midi_data()/8 );
+
+			MIDI_LOG(LOG_TRACE, "::: channel: set instrument %u (group: %u)",
+			         ev.midi_data(), ev.midi_data()/8 );
 			break;
 
 		default:
@@ -232,8 +785,18 @@ void player::interpret(event &ev){
 	}
 }
 
-void player::stop(void){
+void player::set_tempo(event &ev){
+	uint32_t tempo = (ev.evdata[3] << 16) | (ev.evdata[4] << 8) | ev.evdata[5];
+
+	// zero would stop the clock, the tempo map skips it too
+	if (tempo > 0){
+		usecs_per_tick = clock.tick_usecs(tempo);
+		MIDI_LOG(LOG_TRACE, "::: tempo: %u usecs per quarter", tempo);
+	}
+}
 
+void player::stop(void){
+	control.stop();
 }
 
 // namespace midi
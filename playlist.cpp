@@ -0,0 +1,293 @@
+#include <midi/playlist.h>
+#include <midi/log.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+namespace midi {
+
+playlist_deck::playlist_deck(uint32_t rate)
+	: syn(&seq, rate)
+{
+	seq.set_synth(&syn);
+}
+
+playlist::playlist(const std::vector<std::string> &p, uint32_t rate,
+                   double crossfade_secs, unsigned fx)
+	: paths(p), cache(64 << 20), decks{{rate}, {rate}}
+{
+	sample_rate = rate;
+	crossfade = crossfade_secs * rate;
+	effect = fx;
+	loader = std::thread(&playlist::prefetch, this);
+}
+
+playlist::~playlist(){
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = true;
+	}
+
+	wanted.notify_all();
+	loader.join();
+}
+
+// Reads and parses each file in turn into whichever deck is free. The render
+// thread hands decks back without taking the lock, so waits here time out
+// rather than relying on being woken.
+void playlist::prefetch(void){
+	std::unique_lock<std::mutex> guard(lock);
+
+	while (!quit) {
+		if (next_path == paths.size()){
+			exhausted = true;
+			loaded.notify_all();
+			return;
+		}
+
+		playlist_deck *deck = NULL;
+
+		for (auto &x : decks) {
+			if (x.state == DECK_EMPTY){
+				deck = &x;
+				break;
+			}
+		}
+
+		if (!deck){
+			wanted.wait_for(guard, std::chrono::milliseconds(10));
+			continue;
+		}
+
+		size_t index = next_path++;
+		deck->state = DECK_LOADING;
+		guard.unlock();
+
+		bool ok = true;
+
+		try {
+			deck->index = index;
+			load(*deck, paths[index]);
+
+		} catch (const char *errormsg) {
+			fprintf(stderr, "midithing: playlist: skipping %s: %s\n",
+			        paths[index].c_str(), errormsg);
+			ok = false;
+		}
+
+		guard.lock();
+		deck->state = ok? DECK_READY : DECK_EMPTY;
+		loaded.notify_all();
+	}
+}
+
+void playlist::load(playlist_deck &deck, const std::string &path){
+	bool hit;
+	sequence_ref seq = cache.from_path(path, hit);
+
+	deck.data = seq;
+	deck.path = path;
+	deck.seq.load(seq->tracks, seq->division);
+	deck.syn.reset();
+	deck.syn.master.set_effect(effect);
+
+	// the song ends at its last event's tick, wherever the tempo changes
+	// put that
+	uint32_t last = 0;
+
+	for (track trk : seq->tracks) {
+		event_stream stream = trk.events();
+		uint32_t ticks = 0;
+
+		while (!stream.done()) {
+			event ev = stream.get_event();
+			uint32_t type = ev.type();
+
+			if (type == EVENT_UNKNOWN || type == EVENT_META_TRACK_END){
+				break;
+			}
+
+			ticks += ev.delta_time().num;
+			stream.next();
+		}
+
+		last = (ticks > last)? ticks : last;
+	}
+
+	deck.length = deck.seq.clock.usecs(last) * sample_rate / 1e6;
+}
+
+int playlist::next_deck(void){
+	for (;;) {
+		int best = -1;
+		bool pending = false;
+
+		for (int i = 0; i < 2; i++) {
+			unsigned st = decks[i].state;
+
+			if (st == DECK_READY && (best < 0 || decks[i].index < decks[best].index)){
+				best = i;
+			}
+
+			pending |= st == DECK_LOADING;
+		}
+
+		if (best >= 0 || !wait_for_prefetch){
+			return best;
+		}
+
+		std::unique_lock<std::mutex> guard(lock);
+
+		if (exhausted && !pending){
+			return -1;
+		}
+
+		loaded.wait_for(guard, std::chrono::milliseconds(10));
+	}
+}
+
+void playlist::start(int d, unsigned offset){
+	playlist_deck &deck = decks[d];
+
+	deck.state = DECK_PLAYING;
+	deck.fade = (crossfade && outgoing >= 0)? 1 : 0;
+	deck.fade_start = now + offset;
+	current = d;
+	songs_played++;
+
+	MIDI_LOG(LOG_INFO, "playlist: playing %s", deck.path.c_str());
+}
+
+void playlist::retire(int d){
+	// the loader drops the old sequence when it loads the next one, so
+	// nothing gets freed here
+	decks[d].state = DECK_EMPTY;
+	wanted.notify_one();
+
+	if (current == d){
+		current = -1;
+	}
+
+	if (outgoing == d){
+		outgoing = -1;
+	}
+}
+
+void playlist::render_deck(playlist_deck &deck, unsigned offset, unsigned frames){
+	memset(deck.buf, 0, sizeof(deck.buf));
+	deck.rendered = offset;
+
+	if (deck.seq.state != PLAYER_STOPPED){
+		deck.syn.set_target(deck.buf + offset * SYNTH_CHANNELS);
+		deck.rendered += deck.seq.step(frames);
+	}
+}
+
+float playlist::gain(const playlist_deck &deck, uint64_t frame){
+	if (deck.fade == 0){
+		return 1;
+	}
+
+	double t = (frame > deck.fade_start)? frame - deck.fade_start : 0;
+	t = (t < crossfade)? t / crossfade : 1;
+
+	return (deck.fade > 0)? t : 1 - t;
+}
+
+void playlist::render(float *buf, unsigned frames){
+	memset(buf, 0, frames * SYNTH_CHANNELS * sizeof(float));
+
+	if (current < 0){
+		int next = next_deck();
+
+		if (next >= 0){
+			start(next, 0);
+		}
+	}
+
+	if (outgoing >= 0){
+		render_deck(decks[outgoing], 0, frames);
+	}
+
+	if (current >= 0){
+		playlist_deck &cur = decks[current];
+		uint64_t played = cur.seq.frames_played;
+
+		render_deck(cur, 0, frames);
+
+		// the next song comes in where this one runs out of events, or a
+		// crossfade before its end. Only one transition at a time, a song
+		// shorter than the crossfade waits for the last one to finish.
+		uint64_t at = cur.seq.end_frame;
+
+		if (crossfade && cur.length > crossfade && cur.length - crossfade < at){
+			at = cur.length - crossfade;
+		}
+
+		if (outgoing < 0 && at < played + frames){
+			int next = next_deck();
+
+			if (next >= 0){
+				unsigned offset = (at > played)? at - played : 0;
+
+				outgoing = current;
+				cur.fade = crossfade? -1 : 0;
+				cur.fade_start = now + offset;
+
+				start(next, offset);
+				render_deck(decks[current], offset, frames - offset);
+			}
+		}
+	}
+
+	int active[2] = {outgoing, current};
+
+	for (int d : active) {
+		if (d < 0){
+			continue;
+		}
+
+		playlist_deck &deck = decks[d];
+		const float *src = deck.buf;
+
+		for (unsigned i = 0; i < deck.rendered; i++) {
+			float g = gain(deck, now + i);
+
+			buf[2*i]     += g * src[2*i];
+			buf[2*i + 1] += g * src[2*i + 1];
+		}
+	}
+
+	now += frames;
+
+	if (outgoing >= 0){
+		playlist_deck &out = decks[outgoing];
+		bool faded = out.fade < 0 && now >= out.fade_start + crossfade;
+
+		if (faded || out.seq.state == PLAYER_STOPPED){
+			retire(outgoing);
+		}
+	}
+
+	if (current >= 0 && decks[current].seq.state == PLAYER_STOPPED){
+		retire(current);
+	}
+}
+
+bool playlist::finished(void){
+	if (current >= 0 || outgoing >= 0 || !exhausted){
+		return false;
+	}
+
+	for (auto &x : decks) {
+		if (x.state == DECK_READY || x.state == DECK_LOADING){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// namespace midi
+}
@@ -0,0 +1,18 @@
+#include <midi/pullsynth.h>
+
+namespace midi {
+
+pullsynth::pullsynth(player *play, uint32_t rate)
+	: synth(play, rate) { }
+
+void pullsynth::set_target(float *dst){
+	target = dst;
+}
+
+void pullsynth::output(uint32_t frames){
+	render(target, frames);
+	target += frames * SYNTH_CHANNELS;
+}
+
+// namespace midi
+}
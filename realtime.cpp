@@ -0,0 +1,84 @@
+#include <midi/realtime.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <atomic>
+
+namespace midi {
+
+static thread_local bool rt_thread = false;
+static std::atomic<unsigned long> alloc_violations(0);
+static std::atomic<unsigned long> stdio_violations(0);
+
+bool realtime_schedule(void){
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+
+	// leave some headroom above us for the audio server/driver threads
+	param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 10;
+
+	int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+	if (err != 0){
+		fprintf(stderr, "midithing: couldn't get SCHED_FIFO (%s), "
+		                "continuing with normal scheduling\n", strerror(err));
+		return false;
+	}
+
+	return true;
+}
+
+bool realtime_lock_memory(void){
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0){
+		fprintf(stderr, "midithing: couldn't lock memory (%s), "
+		                "page faults may cause dropouts\n", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+void realtime_prefault_stack(void){
+	volatile uint8_t stack[256 * 1024];
+
+	for (unsigned i = 0; i < sizeof(stack); i += 4096) {
+		stack[i] = 0;
+	}
+}
+
+void realtime_enter(void){
+	rt_thread = true;
+}
+
+void realtime_leave(void){
+	rt_thread = false;
+}
+
+bool realtime_thread(void){
+	return rt_thread;
+}
+
+void realtime_check_stdio(void){
+	if (rt_thread){
+		stdio_violations++;
+	}
+}
+
+realtime_violations_t realtime_get_violations(void){
+	return {alloc_violations.load(), stdio_violations.load()};
+}
+
+void realtime_note_allocation(void){
+	if (rt_thread){
+		alloc_violations++;
+	}
+}
+
+// namespace midi
+}
@@ -0,0 +1,144 @@
+#include <midi/renderstats.h>
+
+#include <time.h>
+
+namespace midi {
+
+render_stats::render_stats(uint32_t rate){
+	sample_rate = rate;
+}
+
+uint64_t render_stats::now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void render_stats::add(unsigned stage, uint64_t ns){
+	stage_ns[stage] += ns;
+
+	if (stage != STAGE_OUTPUT){
+		block_inner += ns;
+	}
+}
+
+void render_stats::block_start(void){
+	block_inner = 0;
+	block_begin = now();
+}
+
+void render_stats::output_start(void){
+	output_begin = now();
+	add(STAGE_SEQUENCE, output_begin - block_begin);
+	inner_before = block_inner;
+}
+
+void render_stats::block_end(unsigned n){
+	uint64_t end = now();
+	uint64_t spent = end - output_begin;
+	uint64_t inside = block_inner - inner_before;
+	unsigned bucket = 0;
+
+	stage_ns[STAGE_OUTPUT] += (inside < spent)? spent - inside : 0;
+	frames += n;
+	blocks++;
+
+	while (bucket < RENDER_HISTOGRAM_BUCKETS - 1
+	       && block_inner >= (16000ULL << bucket))
+	{
+		bucket++;
+	}
+
+	histogram[bucket]++;
+
+	if (block_inner * sample_rate > n * 1000000000ULL){
+		late_blocks++;
+	}
+
+	if (log_per_second){
+		if (last_log == 0){
+			last_log = end;
+
+		} else if (end - last_log >= 1000000000ULL){
+			log_line(stderr);
+			last_log = end;
+		}
+	}
+}
+
+void render_stats::voices(unsigned active, unsigned n){
+	if (active > peak_voices){
+		peak_voices = active;
+	}
+
+	voice_frames += (double)active * n;
+}
+
+static double secs(uint64_t ns){
+	return ns / 1e9;
+}
+
+void render_stats::log_line(FILE *fp){
+	uint64_t busy = stage_ns[STAGE_SEQUENCE] + stage_ns[STAGE_SYNTH];
+	double audio = (frames - logged_frames) / (double)sample_rate;
+	double spent = secs(busy - logged_ns);
+
+	fprintf(fp, "midithing: render: %.2f secs in %.1f ms, %.1fx realtime, "
+	            "%u peak voices\n",
+	        audio, spent * 1000, spent > 0? audio / spent : 0, peak_voices);
+
+	logged_frames = frames;
+	logged_ns = busy;
+}
+
+void render_stats::dump(FILE *fp){
+	double audio = frames / (double)sample_rate;
+	double total = 0;
+
+	for (unsigned i = 0; i < STAGE_END; i++) {
+		total += secs(stage_ns[i]);
+	}
+
+	double render = secs(stage_ns[STAGE_SEQUENCE] + stage_ns[STAGE_SYNTH]);
+	double pct = total > 0? 100 / total : 0;
+
+	fprintf(fp,
+		"render stats:\n"
+		"    audio:            %.2f secs (%llu frames, %llu blocks)\n"
+		"    sequencing:       %.3f secs (%.1f%%), %llu events\n"
+		"    synthesis:        %.3f secs (%.1f%%)\n"
+		"    output:           %.3f secs (%.1f%%)\n"
+		"    voices:           peak %u, mean %.1f\n"
+		"    realtime factor:  %.1fx overall, %.1fx rendering only\n"
+		"    late blocks:      %llu\n"
+		"    block render time:\n",
+		audio, (unsigned long long)frames, (unsigned long long)blocks,
+		secs(stage_ns[STAGE_SEQUENCE]), secs(stage_ns[STAGE_SEQUENCE]) * pct,
+		(unsigned long long)events,
+		secs(stage_ns[STAGE_SYNTH]), secs(stage_ns[STAGE_SYNTH]) * pct,
+		secs(stage_ns[STAGE_OUTPUT]), secs(stage_ns[STAGE_OUTPUT]) * pct,
+		peak_voices, frames? voice_frames / frames : 0,
+		total > 0? audio / total : 0, render > 0? audio / render : 0,
+		(unsigned long long)late_blocks);
+
+	for (unsigned i = 0; i < RENDER_HISTOGRAM_BUCKETS; i++) {
+		if (!histogram[i]){
+			continue;
+		}
+
+		char label[32];
+
+		if (i == RENDER_HISTOGRAM_BUCKETS - 1){
+			snprintf(label, sizeof(label), ">= %llu us", 16ULL << (i - 1));
+		} else {
+			snprintf(label, sizeof(label), "< %llu us", 16ULL << i);
+		}
+
+		fprintf(fp, "        %-12s %8llu (%.1f%%)\n", label,
+		        (unsigned long long)histogram[i], 100.0 * histogram[i] / blocks);
+	}
+}
+
+// namespace midi
+}
@@ -0,0 +1,360 @@
+#include <midi/rerender.h>
+#include <midi/wavsynth.h>
+#include <midi/export.h>
+#include <midi/snapshot.h>
+#include <midi/log.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+namespace midi {
+
+static const size_t frame_bytes = 2 * SYNTH_CHANNELS;
+
+rerender_synth::rerender_synth(player *play, uint32_t rate, std::string outfile,
+                               uint64_t settings)
+	: synth(play, rate)
+{
+	this->play = play;
+	path = outfile;
+	journal_path = outfile + ".state";
+	this->settings = settings;
+}
+
+rerender_synth::~rerender_synth(){
+	if (fd >= 0){
+		close(fd);
+	}
+
+	close_journal();
+}
+
+bool rerender_synth::open_journal(void){
+	int jfd = open(journal_path.c_str(), O_RDONLY);
+	struct stat st;
+
+	if (jfd < 0){
+		return false;
+	}
+
+	if (fstat(jfd, &st) < 0 || (size_t)st.st_size < sizeof(rerender_header_t)){
+		close(jfd);
+		return false;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, jfd, 0);
+	close(jfd);
+
+	if (map == MAP_FAILED){
+		return false;
+	}
+
+	journal = (const uint8_t *)map;
+	journal_size = st.st_size;
+	old_header = (const rerender_header_t *)journal;
+
+	const rerender_header_t &h = *old_header;
+	struct stat wav;
+	bool ok = memcmp(h.magic, "MTRR", 4) == 0
+		&& h.version == RERENDER_VERSION
+		&& h.segment_blocks == RERENDER_SEGMENT_BLOCKS
+		&& h.rate == sample_rate
+		&& h.settings == settings
+		&& h.table >= sizeof(h) && h.table <= journal_size
+		&& (journal_size - h.table) / sizeof(rerender_segment_t) >= h.segments;
+
+	// the .wav has to be the one the journal was written with
+	ok = ok && stat(path.c_str(), &wav) == 0
+		&& (uint64_t)wav.st_size == sizeof(wav_header_t) + h.frames * frame_bytes
+		&& wav.st_mtim.tv_sec == h.wav_sec
+		&& wav.st_mtim.tv_nsec == h.wav_nsec;
+
+	if (ok){
+		old_table = (const rerender_segment_t *)(journal + h.table);
+
+		for (uint32_t k = 0; k < h.segments && ok; k++) {
+			ok = old_table[k].offset >= sizeof(h)
+				&& old_table[k].offset <= h.table
+				&& old_table[k].length <= h.table - old_table[k].offset;
+		}
+	}
+
+	if (!ok){
+		MIDI_LOG(LOG_INFO, "rerender: %s doesn't match, rendering everything",
+		         journal_path.c_str());
+		close_journal();
+	}
+
+	return ok;
+}
+
+void rerender_synth::close_journal(void){
+	if (journal){
+		munmap((void *)journal, journal_size);
+	}
+
+	journal = NULL;
+	journal_size = 0;
+	old_header = NULL;
+	old_table = NULL;
+}
+
+uint64_t rerender_synth::old_events(size_t segment){
+	return (segment < old_header->segments)? old_table[segment].events : FNV_BASIS;
+}
+
+// the player's channels count as much as the synth, a controller change
+// shows up in them well before it's heard
+uint64_t rerender_synth::state_hash(const std::string &state){
+	std::string channels;
+
+	for (auto &x : play->channels) {
+		x.save_state(channels);
+	}
+
+	uint64_t hash = fnv_hash(FNV_BASIS, state.data(), state.size());
+	return fnv_hash(hash, channels.data(), channels.size());
+}
+
+std::vector<uint64_t> rerender_synth::fingerprint(void){
+	std::vector<uint64_t> ret;
+
+	play->rewind();
+	reset();
+	position = 0;
+	skipping = true;
+	play->event_hash = &segment_events;
+
+	for (bool more = true; more;) {
+		uint64_t from = position;
+		segment_events = FNV_BASIS;
+
+		while (position - from < RERENDER_SEGMENT_FRAMES
+		       && play->step(SYNTH_BLOCK_SIZE) > 0);
+
+		if (position > from){
+			ret.push_back(segment_events);
+		}
+
+		more = position - from == RERENDER_SEGMENT_FRAMES;
+	}
+
+	play->event_hash = NULL;
+	skipping = false;
+	return ret;
+}
+
+void rerender_synth::run(void){
+	bool incremental = open_journal();
+	size_t first = 0;
+	size_t last = 0;
+
+	if (incremental){
+		std::vector<uint64_t> events = fingerprint();
+		size_t count = std::max(events.size(), (size_t)old_header->segments);
+
+		first = count;
+
+		for (size_t k = 0; k < count; k++) {
+			uint64_t now = (k < events.size())? events[k] : FNV_BASIS;
+
+			if (now != old_events(k)){
+				first = (first == count)? k : first;
+				last = k;
+			}
+		}
+
+		if (first == count){
+			// every event lands where it did last time
+			rendered = 0;
+			reused = old_header->frames;
+			close_journal();
+			return;
+		}
+
+		// anything added past the old end starts from its last snapshot
+		if (first >= old_header->segments){
+			first = old_header->segments? old_header->segments - 1 : 0;
+		}
+
+		fd = open(path.c_str(), O_RDWR);
+
+	} else {
+		fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	}
+
+	if (fd < 0){
+		close_journal();
+		throw "could not open output file for writing";
+	}
+
+	std::string tmp_path = journal_path + ".tmp";
+	int jfd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (jfd < 0){
+		close_journal();
+		throw "could not open render state for writing";
+	}
+
+	rerender_header_t header;
+	std::vector<rerender_segment_t> table;
+	uint64_t written = sizeof(header);
+	bool converged = false;
+
+	memset(&header, 0, sizeof(header));
+
+	try {
+		buffered_writer out(jfd);
+		out.put(&header, sizeof(header));
+
+		// up to the first change, everything's as it was, including the
+		// state going into it
+		play->rewind();
+		reset();
+		position = 0;
+		rendered = 0;
+		skipping = true;
+
+		while (position < (uint64_t)first * RERENDER_SEGMENT_FRAMES
+		       && play->step(SYNTH_BLOCK_SIZE) > 0);
+
+		skipping = false;
+
+		for (size_t k = 0; k < first; k++) {
+			rerender_segment_t seg = old_table[k];
+
+			out.put(journal + seg.offset, seg.length);
+			seg.offset = written;
+			written += seg.length;
+			table.push_back(seg);
+		}
+
+		if (first > 0){
+			load_state(journal + old_table[first].offset, old_table[first].length);
+		}
+
+		play->event_hash = &segment_events;
+
+		for (size_t k = first;; k++) {
+			std::string state;
+			save_state(state);
+			uint64_t hash = state_hash(state);
+
+			// nothing differs from here on, and nothing going into here
+			if (incremental && k > last && k < old_header->segments
+			    && hash == old_table[k].state)
+			{
+				for (size_t j = k; j < old_header->segments; j++) {
+					rerender_segment_t seg = old_table[j];
+
+					out.put(journal + seg.offset, seg.length);
+					seg.offset = written;
+					written += seg.length;
+					table.push_back(seg);
+				}
+
+				converged = true;
+				break;
+			}
+
+			uint64_t from = position;
+			segment_events = FNV_BASIS;
+
+			while (position - from < RERENDER_SEGMENT_FRAMES
+			       && play->step(SYNTH_BLOCK_SIZE) > 0);
+
+			if (position == from){
+				break;
+			}
+
+			table.push_back({segment_events, hash, written, state.size()});
+			out.put(state.data(), state.size());
+			written += state.size();
+
+			if (position - from < RERENDER_SEGMENT_FRAMES){
+				break;
+			}
+		}
+
+		play->event_hash = NULL;
+
+		uint64_t frames = converged? old_header->frames : position;
+		wav_header_t wav;
+		struct stat st;
+
+		if (!converged && ftruncate(fd, sizeof(wav) + frames * frame_bytes) < 0){
+			throw "could not write output file";
+		}
+
+		wav_header(wav, sample_rate, SYNTH_CHANNELS, frames);
+
+		if (pwrite(fd, &wav, sizeof(wav), 0) != sizeof(wav) || fstat(fd, &st) < 0){
+			throw "could not write output file";
+		}
+
+		memcpy(header.magic, "MTRR", 4);
+		header.version = RERENDER_VERSION;
+		header.segment_blocks = RERENDER_SEGMENT_BLOCKS;
+		header.rate = sample_rate;
+		header.segments = table.size();
+		header.settings = settings;
+		header.frames = frames;
+		header.wav_sec = st.st_mtim.tv_sec;
+		header.wav_nsec = st.st_mtim.tv_nsec;
+		header.table = written;
+
+		out.put(table.data(), table.size() * sizeof(rerender_segment_t));
+		out.flush();
+
+		if (pwrite(jfd, &header, sizeof(header), 0) != sizeof(header)){
+			throw "could not write render state";
+		}
+
+		reused = frames - rendered;
+
+	} catch (const char *) {
+		play->event_hash = NULL;
+		close(jfd);
+		unlink(tmp_path.c_str());
+		close_journal();
+		throw;
+	}
+
+	close(jfd);
+	close_journal();
+
+	if (rename(tmp_path.c_str(), journal_path.c_str()) < 0){
+		throw "could not write render state";
+	}
+}
+
+void rerender_synth::output(uint32_t frames){
+	if (skipping){
+		skip(frames);
+		position += frames;
+		return;
+	}
+
+	while (frames > 0){
+		unsigned n = (frames >= SYNTH_BLOCK_SIZE)? SYNTH_BLOCK_SIZE : frames;
+		off_t at = sizeof(wav_header_t) + position * frame_bytes;
+
+		render(buffer, n);
+
+		if (pwrite(fd, buffer, n * frame_bytes, at) != (ssize_t)(n * frame_bytes)){
+			throw "could not write output file";
+		}
+
+		frames -= n;
+		position += n;
+		rendered += n;
+	}
+}
+
+// namespace midi
+}
@@ -0,0 +1,329 @@
+#include <midi/realtime.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <new>
+
+// The C allocator is replaced too, so that malloc() and friends on the
+// render thread are caught along with new, and strdup() and the like with
+// them, as glibc calls malloc() the same way. Not under AddressSanitizer,
+// which brings its own.
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+
+extern "C" {
+	void *__libc_malloc(size_t n);
+	void *__libc_calloc(size_t count, size_t n);
+	void *__libc_realloc(void *ptr, size_t n);
+	void *__libc_memalign(size_t align, size_t n);
+}
+
+static inline void *raw_malloc(size_t n){
+	return __libc_malloc(n);
+}
+
+static inline void *raw_memalign(size_t align, size_t n){
+	return __libc_memalign(align, n);
+}
+
+void *malloc(size_t n){
+	midi::realtime_note_allocation();
+
+	return __libc_malloc(n);
+}
+
+void *calloc(size_t count, size_t n){
+	midi::realtime_note_allocation();
+
+	return __libc_calloc(count, n);
+}
+
+void *realloc(void *ptr, size_t n){
+	midi::realtime_note_allocation();
+
+	return __libc_realloc(ptr, n);
+}
+
+void *memalign(size_t align, size_t n){
+	midi::realtime_note_allocation();
+
+	return __libc_memalign(align, n);
+}
+
+void *aligned_alloc(size_t align, size_t n){
+	midi::realtime_note_allocation();
+
+	return __libc_memalign(align, n);
+}
+
+int posix_memalign(void **ret, size_t align, size_t n){
+	midi::realtime_note_allocation();
+
+	if (align < sizeof(void *) || (align & (align - 1)) != 0){
+		return EINVAL;
+	}
+
+	void *ptr = __libc_memalign(align, n);
+
+	if (!ptr){
+		return ENOMEM;
+	}
+
+	*ret = ptr;
+	return 0;
+}
+
+#else
+static inline void *raw_malloc(size_t n){
+	return malloc(n);
+}
+
+static inline void *raw_memalign(size_t align, size_t n){
+	void *ret = NULL;
+
+	if (posix_memalign(&ret, align, n) != 0){
+		return NULL;
+	}
+
+	return ret;
+}
+#endif
+
+// Replacements for the global allocation functions so that allocations made
+// from the render thread can be caught. Everything else goes to malloc().
+// Every variant is replaced, library code like std::stable_sort() asks for
+// nothrow buffers, and anything left to the default new would be freed
+// here with a mismatched free().
+static inline void *noted_alloc(size_t n){
+	midi::realtime_note_allocation();
+
+	return raw_malloc(n? n : 1);
+}
+
+static inline void *noted_aligned_alloc(size_t n, std::align_val_t al){
+	size_t align = (size_t)al;
+
+	midi::realtime_note_allocation();
+
+	if (align < sizeof(void *)){
+		align = sizeof(void *);
+	}
+
+	return raw_memalign(align, n? n : 1);
+}
+
+static inline void *checked_alloc(size_t n){
+	void *ret = noted_alloc(n);
+
+	if (!ret){
+		throw std::bad_alloc();
+	}
+
+	return ret;
+}
+
+static inline void *checked_aligned_alloc(size_t n, std::align_val_t al){
+	void *ret = noted_aligned_alloc(n, al);
+
+	if (!ret){
+		throw std::bad_alloc();
+	}
+
+	return ret;
+}
+
+void *operator new(size_t n){
+	return checked_alloc(n);
+}
+
+void *operator new[](size_t n){
+	return checked_alloc(n);
+}
+
+void *operator new(size_t n, const std::nothrow_t &) noexcept {
+	return noted_alloc(n);
+}
+
+void *operator new[](size_t n, const std::nothrow_t &) noexcept {
+	return noted_alloc(n);
+}
+
+void *operator new(size_t n, std::align_val_t al){
+	return checked_aligned_alloc(n, al);
+}
+
+void *operator new[](size_t n, std::align_val_t al){
+	return checked_aligned_alloc(n, al);
+}
+
+void *operator new(size_t n, std::align_val_t al, const std::nothrow_t &) noexcept {
+	return noted_aligned_alloc(n, al);
+}
+
+void *operator new[](size_t n, std::align_val_t al, const std::nothrow_t &) noexcept {
+	return noted_aligned_alloc(n, al);
+}
+
+void operator delete(void *ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+	free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+	free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+	free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+	free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+	free(ptr);
+}
+
+// The stdio calls a print on the render thread can end up as, the compiler
+// turns printf("...\n") into puts() and so on, and _FORTIFY_SOURCE builds
+// call the _chk versions. Each one is noted and handed on to the C library.
+template <typename T>
+static T next_symbol(const char *name){
+	return (T)dlsym(RTLD_NEXT, name);
+}
+
+#define RTALLOC_NEXT(name) \
+	static auto next = next_symbol<decltype(&name)>(#name)
+
+extern "C" {
+	int __vfprintf_chk(FILE *fp, int flag, const char *fmt, va_list ap);
+	int __fprintf_chk(FILE *fp, int flag, const char *fmt, ...);
+	int __vprintf_chk(int flag, const char *fmt, va_list ap);
+	int __printf_chk(int flag, const char *fmt, ...);
+}
+
+int vfprintf(FILE *fp, const char *fmt, va_list ap){
+	RTALLOC_NEXT(vfprintf);
+	midi::realtime_check_stdio();
+
+	return next(fp, fmt, ap);
+}
+
+int vprintf(const char *fmt, va_list ap){
+	return vfprintf(stdout, fmt, ap);
+}
+
+int fprintf(FILE *fp, const char *fmt, ...){
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = vfprintf(fp, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+int printf(const char *fmt, ...){
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = vfprintf(stdout, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+int __vfprintf_chk(FILE *fp, int flag, const char *fmt, va_list ap){
+	RTALLOC_NEXT(__vfprintf_chk);
+	midi::realtime_check_stdio();
+
+	return next(fp, flag, fmt, ap);
+}
+
+int __vprintf_chk(int flag, const char *fmt, va_list ap){
+	return __vfprintf_chk(stdout, flag, fmt, ap);
+}
+
+int __fprintf_chk(FILE *fp, int flag, const char *fmt, ...){
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = __vfprintf_chk(fp, flag, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+int __printf_chk(int flag, const char *fmt, ...){
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = __vfprintf_chk(stdout, flag, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+size_t fwrite(const void *ptr, size_t size, size_t count, FILE *fp){
+	RTALLOC_NEXT(fwrite);
+	midi::realtime_check_stdio();
+
+	return next(ptr, size, count, fp);
+}
+
+int fputs(const char *str, FILE *fp){
+	RTALLOC_NEXT(fputs);
+	midi::realtime_check_stdio();
+
+	return next(str, fp);
+}
+
+int puts(const char *str){
+	RTALLOC_NEXT(puts);
+	midi::realtime_check_stdio();
+
+	return next(str);
+}
+
+int fputc(int c, FILE *fp){
+	RTALLOC_NEXT(fputc);
+	midi::realtime_check_stdio();
+
+	return next(c, fp);
+}
+
+int putc(int c, FILE *fp){
+	return fputc(c, fp);
+}
+
+int putchar(int c){
+	return fputc(c, stdout);
+}
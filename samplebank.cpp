@@ -0,0 +1,117 @@
+#include <midi/samplebank.h>
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace midi {
+
+static const char *bank_magic = "MSBK";
+
+static void check_zone(const bank_zone_t &z, uint32_t frames){
+	if (z.key_lo > z.key_hi || z.vel_lo > z.vel_hi || z.key_hi > 127
+	    || z.root_key > 127 || z.sample_rate == 0)
+	{
+		throw "sample bank has a bad zone";
+	}
+
+	if (z.start >= z.end || z.end > frames){
+		throw "sample bank zone runs past the sample data";
+	}
+
+	if ((z.flags & BANK_ZONE_LOOP)
+	    && (z.loop_start < z.start || z.loop_end > z.end
+	        || z.loop_start >= z.loop_end))
+	{
+		throw "sample bank zone has a bad loop";
+	}
+}
+
+sample_bank::sample_bank(const char *path){
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) < 0){
+		if (fd >= 0){
+			close(fd);
+		}
+
+		throw "could not open sample bank";
+	}
+
+	map_size = st.st_size;
+	map = (map_size >= sizeof(bank_header_t))
+		? mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0)
+		: MAP_FAILED;
+	close(fd);
+
+	if (map == MAP_FAILED){
+		throw "could not map sample bank";
+	}
+
+	try {
+		const bank_header_t *hdr = (const bank_header_t *)map;
+
+		if (memcmp(hdr->magic, bank_magic, 4) != 0 || hdr->version != BANK_VERSION){
+			throw "not a sample bank, or an unsupported version";
+		}
+
+		size_t zones_end = sizeof(bank_header_t) + hdr->zone_count * sizeof(bank_zone_t);
+
+		if (zones_end > hdr->data_offset || (hdr->data_offset & 1)
+		    || hdr->data_offset + (size_t)hdr->data_frames * 2 > map_size)
+		{
+			throw "sample bank is truncated";
+		}
+
+		zones = (const bank_zone_t *)(hdr + 1);
+		zone_count = hdr->zone_count;
+		samples = (const int16_t *)((const uint8_t *)map + hdr->data_offset);
+		frames = hdr->data_frames;
+
+		unsigned z = 0;
+
+		for (unsigned p = 0; p <= 128; p++) {
+			while (z < zone_count && zones[z].program < p) {
+				check_zone(zones[z], frames);
+
+				if (z > 0 && zones[z].program < zones[z - 1].program){
+					throw "sample bank zones aren't sorted by program";
+				}
+
+				z++;
+			}
+
+			first[p] = z;
+		}
+
+	} catch (const char *) {
+		munmap(map, map_size);
+		throw;
+	}
+}
+
+sample_bank::~sample_bank(){
+	munmap(map, map_size);
+}
+
+unsigned sample_bank::find(uint8_t program, uint8_t key, uint8_t velocity) const {
+	program &= 0x7f;
+
+	for (unsigned i = first[program]; i < first[program + 1]; i++) {
+		const bank_zone_t &z = zones[i];
+
+		if (key >= z.key_lo && key <= z.key_hi
+		    && velocity >= z.vel_lo && velocity <= z.vel_hi)
+		{
+			return i;
+		}
+	}
+
+	return BANK_NO_ZONE;
+}
+
+// namespace midi
+}
@@ -0,0 +1,473 @@
+#include <midi/server.h>
+#include <midi/synth.h>
+#include <midi/snapshot.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fstream>
+#include <sstream>
+
+namespace midi {
+
+// biggest file accepted over the socket
+#define SERVER_MAX_UPLOAD (16 << 20)
+
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+sequence_cache::sequence_cache(size_t max){
+	max_bytes = max;
+}
+
+sequence_ref sequence_cache::from_path(std::string path, bool &hit){
+	struct stat st;
+
+	if (stat(path.c_str(), &st) < 0){
+		throw "could not open input file";
+	}
+
+	char key[64];
+	snprintf(key, sizeof(key), ":%lld:%lld.%09ld", (long long)st.st_size,
+	         (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+
+	sequence_ref ret = lookup("path:" + path + key);
+
+	if ((hit = (ret != NULL))){
+		return ret;
+	}
+
+	std::ifstream asdf(path);
+	std::stringstream stream;
+	stream << asdf.rdbuf();
+	std::string data = stream.str();
+
+	return insert("path:" + path + key, data);
+}
+
+sequence_ref sequence_cache::from_bytes(std::string &bytes, bool &hit){
+	char key[64];
+	snprintf(key, sizeof(key), "bytes:%016llx:%zu",
+	         (unsigned long long)fnv_hash(FNV_BASIS, bytes.data(), bytes.size()),
+	         bytes.size());
+
+	sequence_ref ret = lookup(key);
+
+	if ((hit = (ret != NULL))){
+		return ret;
+	}
+
+	return insert(key, bytes);
+}
+
+sequence_ref sequence_cache::lookup(const std::string &key){
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = index.find(key);
+
+	if (it == index.end()){
+		misses++;
+		return NULL;
+	}
+
+	// move to the front
+	lru.splice(lru.begin(), lru, it->second);
+	hits++;
+
+	return *it->second;
+}
+
+// parses outside the lock, a duplicate insert from a racing miss just
+// replaces the earlier entry. Track and event bounds are checked here since
+// the data didn't come from anywhere we trust, so a bad upload fails its
+// own job rather than taking the server down.
+sequence_ref sequence_cache::insert(std::string key, std::string &data){
+	auto entry = std::make_shared<cached_sequence_t>();
+	entry->key = key;
+	entry->data.swap(data);
+
+	const std::string &buf = entry->data;
+
+	if (buf.size() < sizeof(file_t)){
+		throw "input is too short to be a MIDI file";
+	}
+
+	file f(buf.data());
+	entry->division = f.division();
+	entry->tracks = f.checked_tracks(buf.size());
+
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = index.find(key);
+
+	if (it != index.end()){
+		total_bytes -= (*it->second)->data.size();
+		lru.erase(it->second);
+		index.erase(it);
+	}
+
+	lru.push_front(entry);
+	index[key] = lru.begin();
+	total_bytes += buf.size();
+
+	// always keep the newest entry, even if it's bigger than the limit
+	while (total_bytes > max_bytes && lru.size() > 1){
+		sequence_ref &last = lru.back();
+		total_bytes -= last->data.size();
+		index.erase(last->key);
+		lru.pop_back();
+	}
+
+	return entry;
+}
+
+size_t sequence_cache::entries(void){
+	std::lock_guard<std::mutex> guard(lock);
+	return lru.size();
+}
+
+size_t sequence_cache::bytes(void){
+	std::lock_guard<std::mutex> guard(lock);
+	return total_bytes;
+}
+
+// buffered line and payload reads from a client socket
+class render_server::connection {
+	public:
+		connection(int fd) : fd(fd) {}
+
+		bool read_line(std::string &line){
+			size_t end;
+
+			while ((end = buf.find('\n')) == std::string::npos) {
+				if (buf.size() > 4096 || !fill()){
+					return false;
+				}
+			}
+
+			line = buf.substr(0, end);
+			buf.erase(0, end + 1);
+			return true;
+		}
+
+		bool read_bytes(std::string &out, size_t n){
+			while (buf.size() < n) {
+				if (!fill()){
+					return false;
+				}
+			}
+
+			out = buf.substr(0, n);
+			buf.erase(0, n);
+			return true;
+		}
+
+		bool write_line(std::string line){
+			line += '\n';
+
+			for (size_t done = 0; done < line.size();) {
+				ssize_t n = send(fd, line.data() + done, line.size() - done,
+				                 MSG_NOSIGNAL);
+
+				if (n < 0 && errno == EINTR){
+					continue;
+				}
+
+				if (n <= 0){
+					return false;
+				}
+
+				done += n;
+			}
+
+			return true;
+		}
+
+	private:
+		bool fill(void){
+			char tmp[4096];
+			ssize_t n;
+
+			do {
+				n = read(fd, tmp, sizeof(tmp));
+			} while (n < 0 && errno == EINTR);
+
+			if (n <= 0){
+				return false;
+			}
+
+			buf.append(tmp, n);
+			return true;
+		}
+
+		int fd;
+		std::string buf;
+};
+
+render_server::render_server(std::string socket_path, unsigned nworkers,
+                             size_t cache_bytes)
+	: cache(cache_bytes)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+
+	if (socket_path.size() >= sizeof(addr.sun_path)){
+		throw "socket path too long";
+	}
+
+	if (nworkers == 0){
+		throw "need at least one worker";
+	}
+
+	path = socket_path;
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+	unlink(path.c_str());
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (listen_fd < 0
+	    || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || listen(listen_fd, 16) < 0)
+	{
+		throw "could not listen on socket";
+	}
+
+	// a little slack so a worker finishing a job has the next one waiting
+	max_pending = nworkers * 2;
+
+	for (unsigned i = 0; i < nworkers; i++) {
+		workers.push_back(std::thread(&render_server::worker, this));
+	}
+}
+
+render_server::~render_server(){
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+
+	queued.notify_all();
+
+	for (auto &x : workers) {
+		x.join();
+	}
+
+	for (int fd : pending) {
+		close(fd);
+	}
+
+	close(listen_fd);
+	unlink(path.c_str());
+}
+
+void render_server::run(void){
+	for (;;) {
+		{
+			// backpressure, stop accepting while the queue is full
+			std::unique_lock<std::mutex> guard(lock);
+			dequeued.wait(guard, [this]{ return pending.size() < max_pending; });
+		}
+
+		int fd = accept(listen_fd, NULL, NULL);
+
+		if (fd < 0){
+			if (errno == EINTR || errno == ECONNABORTED){
+				continue;
+			}
+
+			throw "could not accept connection";
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			pending.push_back(fd);
+		}
+
+		queued.notify_one();
+	}
+}
+
+void render_server::worker(void){
+	// kept around for every job this worker runs
+	player seq;
+	wavsynth out(&seq, rate);
+	seq.set_synth(&out);
+
+	for (;;) {
+		int fd;
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			queued.wait(guard, [this]{ return stopping || !pending.empty(); });
+
+			if (stopping){
+				return;
+			}
+
+			fd = pending.front();
+			pending.pop_front();
+		}
+
+		dequeued.notify_one();
+
+		connection conn(fd);
+		serve(conn, seq, out);
+		close(fd);
+	}
+}
+
+static std::vector<std::string> split(const std::string &line){
+	std::vector<std::string> ret;
+	std::istringstream stream(line);
+	std::string word;
+
+	while (stream >> word) {
+		ret.push_back(word);
+	}
+
+	return ret;
+}
+
+void render_server::serve(connection &conn, player &seq, wavsynth &out){
+	std::string line;
+
+	while (conn.read_line(line)) {
+		std::vector<std::string> req = split(line);
+		std::string reply;
+
+		if (req.empty()){
+			continue;
+		}
+
+		try {
+			if (req[0] == "render" || req[0] == "render-bytes"){
+				reply = render(req, conn, seq, out);
+
+			} else if (req[0] == "stats"){
+				reply = stats();
+
+			} else {
+				throw "unknown request";
+			}
+
+		} catch (const char *msg) {
+			out.close();
+
+			std::lock_guard<std::mutex> guard(lock);
+			failed++;
+			reply = std::string("error ") + msg;
+		}
+
+		if (!conn.write_line(reply)){
+			break;
+		}
+	}
+}
+
+std::string render_server::render(std::vector<std::string> &req,
+                                  connection &conn, player &seq, wavsynth &out)
+{
+	if (req.size() < 4){
+		throw "usage: render <wav|raw> <output> <input> [start ms] [end ms]";
+	}
+
+	double start_time = now();
+	sequence_ref input;
+	bool hit;
+
+	if (req[0] == "render-bytes"){
+		unsigned long length = strtoul(req[3].c_str(), NULL, 10);
+		std::string bytes;
+
+		if (length == 0 || length > SERVER_MAX_UPLOAD){
+			throw "bad upload length";
+		}
+
+		if (!conn.read_bytes(bytes, length)){
+			throw "connection closed during upload";
+		}
+
+		input = cache.from_bytes(bytes, hit);
+
+	} else {
+		input = cache.from_path(req[3], hit);
+	}
+
+	if (req[1] != "wav" && req[1] != "raw"){
+		throw "unknown output format";
+	}
+
+	uint64_t start_ms = (req.size() > 4)? strtoull(req[4].c_str(), NULL, 10) : 0;
+	uint64_t end_ms   = (req.size() > 5)? strtoull(req[5].c_str(), NULL, 10) : 0;
+	uint64_t limit = UINT64_MAX;
+
+	if (end_ms){
+		if (end_ms <= start_ms){
+			throw "range ends before it starts";
+		}
+
+		limit = (end_ms - start_ms) * rate / 1000;
+	}
+
+	seq.load(input->tracks, input->division);
+	out.reset();
+	out.open(req[2], req[1] == "raw");
+
+	if (start_ms){
+		seq.seek(start_ms * 1000);
+	}
+
+	uint64_t total = 0;
+
+	while (total < limit) {
+		uint64_t n = limit - total;
+		n = seq.step((n < SYNTH_BLOCK_SIZE)? n : SYNTH_BLOCK_SIZE);
+
+		if (n == 0){
+			break;
+		}
+
+		total += n;
+	}
+
+	out.close();
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		jobs++;
+		frames += total;
+	}
+
+	char buf[128];
+	snprintf(buf, sizeof(buf), "ok %llu frames, cache %s, %.1f ms",
+	         (unsigned long long)total, hit? "hit" : "miss",
+	         (now() - start_time) * 1000);
+
+	return buf;
+}
+
+std::string render_server::stats(void){
+	char buf[256];
+	std::lock_guard<std::mutex> guard(lock);
+
+	snprintf(buf, sizeof(buf),
+	         "ok jobs %llu, failed %llu, frames %llu, queued %zu, "
+	         "cache hits %llu, misses %llu, entries %zu, bytes %zu",
+	         (unsigned long long)jobs, (unsigned long long)failed,
+	         (unsigned long long)frames, pending.size(),
+	         (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+	         cache.entries(), cache.bytes());
+
+	return buf;
+}
+
+// namespace midi
+}
@@ -0,0 +1,332 @@
+#include <midi/smfwriter.h>
+#include <midi/export.h>
+
+#include <string.h>
+#include <algorithm>
+
+namespace midi {
+
+typedef struct smf_event {
+	uint32_t tick;
+	uint16_t track;
+	bool     keep;
+	// channel messages are rebuilt with their status byte, anything else
+	// is copied out of the track as it is
+	uint8_t  msg[3];
+	uint8_t  msg_length;
+	const uint8_t *raw;
+	uint32_t raw_length;
+} smf_event_t;
+
+// what's known of a channel's state, -1 until something sets it
+typedef struct smf_channel {
+	int program;
+	int bend;
+	int controllers[120];
+} smf_channel_t;
+
+static void put_var(std::vector<uint8_t> &out, uint32_t x){
+	uint8_t tmp[5];
+	unsigned n = 0;
+
+	do {
+		tmp[n++] = x & 0x7f;
+		x >>= 7;
+	} while (x);
+
+	while (n-- > 0) {
+		out.push_back(tmp[n] | (n? 0x80 : 0));
+	}
+}
+
+static void put_be(std::vector<uint8_t> &out, uint32_t x, unsigned bytes){
+	while (bytes-- > 0) {
+		out.push_back(x >> (bytes * 8));
+	}
+}
+
+// decodes a track the same way the player does, returns the tick of its
+// end, or of the last event it got to
+static uint32_t gather(track trk, uint16_t index, std::vector<smf_event_t> &events,
+                       bool &truncated)
+{
+	const uint8_t *ptr = trk.start();
+	const uint8_t *end = trk.end();
+	uint32_t tick = 0;
+	uint8_t running = 0;
+
+	truncated = false;
+
+	while (ptr < end) {
+		event ev(ptr, running);
+		uint32_t type = ev.type();
+
+		if (type == EVENT_UNKNOWN){
+			truncated = true;
+			break;
+		}
+
+		tick += ev.delta_time().num;
+
+		if (type == EVENT_META_TRACK_END){
+			break;
+		}
+
+		const uint8_t *next = ptr + ev.length(type);
+
+		if (next > end){
+			throw "event runs past the end of its track";
+		}
+
+		smf_event_t x = {tick, index, true, {0, 0, 0}, 0, NULL, 0};
+
+		if (ev.status < 0xf0){
+			x.msg_length = next - ev.params + 1;
+			x.msg[0] = ev.status;
+			memcpy(x.msg + 1, ev.params, x.msg_length - 1);
+			running = ev.status;
+
+		} else {
+			// sysex and every meta event, by their own length, with
+			// running status restarted after them in encode_track()
+			x.raw = ev.evdata;
+			x.raw_length = next - ev.evdata;
+		}
+
+		events.push_back(x);
+		ptr = next;
+	}
+
+	return tick;
+}
+
+static void forget_channels(smf_channel_t *chans){
+	for (unsigned k = 0; k < 16; k++) {
+		chans[k].program = -1;
+		chans[k].bend = -1;
+
+		for (auto &x : chans[k].controllers) {
+			x = -1;
+		}
+	}
+}
+
+// Controllers which just hold a value, so setting the one they already
+// have does nothing. Data entry and increment act every time they're sent,
+// 120 and up are channel mode messages.
+static bool state_controller(uint8_t ctl){
+	return ctl < 120 && ctl != 6 && ctl != 38 && ctl != 96 && ctl != 97;
+}
+
+// Normalizes note offs and drops whatever doesn't change a channel's state,
+// going through events in the order they're played. Returns the number of
+// events kept.
+static uint64_t normalize(std::vector<smf_event_t> &events,
+                          const std::vector<uint32_t> &order, bool per_track)
+{
+	smf_channel_t chans[16];
+	uint64_t kept = 0;
+	unsigned track = 0;
+
+	forget_channels(chans);
+
+	for (uint32_t i : order) {
+		smf_event_t &x = events[i];
+
+		// tracks of a format 2 file are separate sequences
+		if (per_track && x.track != track){
+			forget_channels(chans);
+			track = x.track;
+		}
+
+		smf_channel_t &ch = chans[x.msg[0] & 0xf];
+
+		switch (x.msg_length? x.msg[0] & 0xf0 : 0) {
+			case 0x80:
+				if (x.msg[2] == 0 || x.msg[2] == 64){
+					x.msg[0] = 0x90 | (x.msg[0] & 0xf);
+					x.msg[2] = 0;
+				}
+				break;
+
+			case 0xb0: {
+				uint8_t ctl = x.msg[1];
+
+				if (ctl == 121){
+					// reset all controllers
+					for (auto &c : ch.controllers) {
+						c = -1;
+					}
+
+					ch.bend = -1;
+
+				} else if (state_controller(ctl)){
+					if (ch.controllers[ctl] == x.msg[2]){
+						x.keep = false;
+
+					} else if (ctl == 0 || ctl == 32){
+						// the next program change picks from another bank
+						ch.program = -1;
+					}
+
+					ch.controllers[ctl] = x.msg[2];
+				}
+				break;
+			}
+
+			case 0xc0:
+				x.keep = ch.program != x.msg[1];
+				ch.program = x.msg[1];
+				break;
+
+			case 0xe0: {
+				int bend = x.msg[1] | (x.msg[2] << 7);
+
+				x.keep = ch.bend != bend;
+				ch.bend = bend;
+				break;
+			}
+
+			default:
+				break;
+		}
+
+		kept += x.keep;
+	}
+
+	return kept;
+}
+
+static void encode_track(std::vector<uint8_t> &body, const std::vector<smf_event_t> &events,
+                         const uint32_t *index, size_t count, uint32_t end_tick)
+{
+	uint32_t last = 0;
+	uint8_t running = 0;
+
+	body.clear();
+
+	for (size_t i = 0; i < count; i++) {
+		const smf_event_t &x = events[index[i]];
+
+		if (!x.keep){
+			continue;
+		}
+
+		put_var(body, x.tick - last);
+		last = x.tick;
+
+		if (x.msg_length){
+			if (x.msg[0] != running){
+				body.push_back(x.msg[0]);
+				running = x.msg[0];
+			}
+
+			body.insert(body.end(), x.msg + 1, x.msg + x.msg_length);
+
+		} else {
+			body.insert(body.end(), x.raw, x.raw + x.raw_length);
+			running = 0;
+		}
+	}
+
+	put_var(body, end_tick - last);
+	body.insert(body.end(), {0xff, 0x2f, 0x00});
+}
+
+static void put_chunk(buffered_writer &out, const char *magic,
+                      const std::vector<uint8_t> &body, uint64_t &bytes)
+{
+	uint8_t header[8];
+	uint32_t length = body.size();
+
+	memcpy(header, magic, 4);
+
+	for (unsigned i = 0; i < 4; i++) {
+		header[4 + i] = length >> (24 - i * 8);
+	}
+
+	out.put(header, sizeof(header));
+	out.put(body.data(), body.size());
+	bytes += sizeof(header) + body.size();
+}
+
+smf_stats_t write_smf(const std::vector<track> &tracks, uint16_t format,
+                      uint16_t division, const smf_options_t &opts, int fd)
+{
+	smf_stats_t stats;
+	std::vector<smf_event_t> events;
+	std::vector<uint32_t> first;
+	std::vector<uint32_t> ends;
+
+	memset(&stats, 0, sizeof(stats));
+
+	if (opts.flatten && format == 2){
+		throw "format 2 files can't be flattened";
+	}
+
+	for (unsigned i = 0; i < tracks.size(); i++) {
+		bool truncated;
+
+		first.push_back(events.size());
+		ends.push_back(gather(tracks[i], i, events, truncated));
+		stats.truncated_tracks += truncated;
+	}
+
+	first.push_back(events.size());
+
+	// tracks are already in order, so a stable sort by tick merges them the
+	// same way the player does, by tick and then by track
+	std::vector<uint32_t> order(events.size());
+
+	for (uint32_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+
+	if (format != 2){
+		std::stable_sort(order.begin(), order.end(),
+			[&events](uint32_t a, uint32_t b){
+				return events[a].tick < events[b].tick;
+			});
+	}
+
+	stats.events_in = events.size();
+	stats.events_out = normalize(events, order, format == 2);
+
+	buffered_writer out(fd);
+	std::vector<uint8_t> body;
+	unsigned ntracks = opts.flatten? 1 : tracks.size();
+
+	put_be(body, opts.flatten? 0 : format, 2);
+	put_be(body, ntracks, 2);
+	put_be(body, division, 2);
+	put_chunk(out, "MThd", body, stats.bytes);
+
+	if (opts.flatten){
+		uint32_t end_tick = 0;
+
+		for (uint32_t x : ends) {
+			end_tick = std::max(end_tick, x);
+		}
+
+		encode_track(body, events, order.data(), order.size(), end_tick);
+		put_chunk(out, "MTrk", body, stats.bytes);
+
+	} else {
+		// back to each track's events in the order they came in
+		for (uint32_t i = 0; i < order.size(); i++) {
+			order[i] = i;
+		}
+
+		for (unsigned t = 0; t < tracks.size(); t++) {
+			encode_track(body, events, order.data() + first[t],
+			             first[t + 1] - first[t], ends[t]);
+			put_chunk(out, "MTrk", body, stats.bytes);
+		}
+	}
+
+	out.flush();
+	return stats;
+}
+
+// namespace midi
+}
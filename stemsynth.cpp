@@ -0,0 +1,242 @@
+#include <midi/stemsynth.h>
+#include <midi/wavsynth.h>
+#include <midi/tracing.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace midi {
+
+static std::string stem_path(const std::string &prefix, unsigned index){
+	char name[32];
+
+	if (index == STEM_MASTER){
+		snprintf(name, sizeof(name), "-master.wav");
+	} else if (index == 9){
+		snprintf(name, sizeof(name), "-drums.wav");
+	} else {
+		snprintf(name, sizeof(name), "-ch%02u.wav", index + 1);
+	}
+
+	return prefix + name;
+}
+
+static inline int16_t to_pcm(float x){
+	// stems are from before the limiter, so they can go past full scale
+	return 0x7fff * std::max(-1.0f, std::min(1.0f, x));
+}
+
+stemsynth::stemsynth(player *play, uint32_t rate, std::string prefix,
+                     unsigned nwriters)
+	: synth(play, rate)
+{
+	for (unsigned i = 0; i < STEM_FILES; i++) {
+		std::string path = stem_path(prefix, i);
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+		if (fd < 0){
+			for (auto &x : files) {
+				::close(x.fd);
+			}
+
+			throw "could not open stem file for writing";
+		}
+
+		files.push_back({path, fd, std::unique_ptr<buffered_writer>(new buffered_writer(fd)),
+		                 false, false});
+
+		// stub header, rewritten once the length is known
+		wav_header_t header;
+		wav_header(header, rate, SYNTH_CHANNELS, 0);
+		files.back().out->put(&header, sizeof(header));
+	}
+
+	nwriters = std::max(1u, std::min(nwriters, (unsigned)STEM_FILES));
+	taken.assign(nwriters, 0);
+	stems = this;
+
+	for (unsigned i = 0; i < nwriters; i++) {
+		writers.push_back(std::thread(&stemsynth::writer, this, i));
+	}
+}
+
+stemsynth::~stemsynth(){
+	try {
+		close();
+	} catch (const char *) {
+		// nowhere to report it from here
+	}
+}
+
+void stemsynth::output(uint32_t frames){
+	while (frames > 0) {
+		unsigned n = (frames < SYNTH_BLOCK_SIZE)? frames : SYNTH_BLOCK_SIZE;
+		unsigned slot = published % STEM_SLOTS;
+
+		{
+			// wait for the slowest writer to be done with this slot
+			std::unique_lock<std::mutex> guard(lock);
+			written_cv.wait(guard, [this]{
+				return published - *std::min_element(taken.begin(), taken.end())
+				       < STEM_SLOTS;
+			});
+		}
+
+		memset(stem_pos, 0, sizeof(stem_pos));
+		render(master_buf, n);
+
+		int16_t *master = slots[slot][STEM_MASTER];
+
+		// same conversion as render(int16_t *), so the master matches a
+		// plain wav render
+		for (unsigned i = 0; i < n * SYNTH_CHANNELS; i++) {
+			master[i] = 0x7fff * master_buf[i];
+		}
+
+		slot_frames[slot] = n;
+		frames -= n;
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			published++;
+		}
+
+		published_cv.notify_all();
+	}
+}
+
+void stemsynth::stem(unsigned channel, const float *left, const float *right,
+                     unsigned frames)
+{
+	unsigned slot = published % STEM_SLOTS;
+	int16_t *dst = slots[slot][channel] + stem_pos[channel] * SYNTH_CHANNELS;
+
+	for (unsigned i = 0; i < frames; i++) {
+		*dst++ = to_pcm(left[i]);
+		*dst++ = to_pcm(right[i]);
+	}
+
+	stem_pos[channel] += frames;
+}
+
+void stemsynth::writer(unsigned index){
+	unsigned stride = taken.size();
+
+	for (;;) {
+		uint64_t seq;
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			published_cv.wait(guard, [this, index]{
+				return finishing || taken[index] < published;
+			});
+
+			if (taken[index] == published){
+				return;
+			}
+
+			seq = taken[index];
+		}
+
+		unsigned slot = seq % STEM_SLOTS;
+		unsigned n = slot_frames[slot];
+
+		{
+			TRACE_SCOPE("stem write");
+
+			for (unsigned f = index; f < STEM_FILES; f += stride) {
+				const int16_t *block = slots[slot][f];
+				stem_file_t &file = files[f];
+
+				if (!file.audible){
+					for (unsigned i = 0; i < n * SYNTH_CHANNELS; i++) {
+						file.audible |= block[i] != 0;
+					}
+				}
+
+				try {
+					file.out->put(block, n * SYNTH_CHANNELS * sizeof(int16_t));
+				} catch (const char *) {
+					// reported from close()
+					file.failed = true;
+				}
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			taken[index]++;
+		}
+
+		written_cv.notify_one();
+	}
+}
+
+unsigned stemsynth::close(void){
+	if (closed){
+		return written.size();
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		finishing = true;
+	}
+
+	published_cv.notify_all();
+
+	for (auto &x : writers) {
+		x.join();
+	}
+
+	closed = true;
+	stems = NULL;
+
+	const char *error = NULL;
+	wav_header_t header;
+
+	for (unsigned i = 0; i < STEM_FILES; i++) {
+		stem_file_t &file = files[i];
+		off_t end = 0;
+
+		try {
+			file.out->flush();
+			end = lseek(file.fd, 0, SEEK_END);
+		} catch (const char *) {
+			file.failed = true;
+		}
+
+		if (file.failed){
+			error = "could not write output";
+		}
+
+		// the master is kept even if it's silent
+		if (file.audible || i == STEM_MASTER){
+			size_t frames = (end - sizeof(header)) / (2 * SYNTH_CHANNELS);
+
+			wav_header(header, sample_rate, SYNTH_CHANNELS, frames);
+
+			if (pwrite(file.fd, &header, sizeof(header), 0) != sizeof(header)){
+				error = "could not write output";
+			}
+
+			written.push_back(file.path);
+
+		} else {
+			unlink(file.path.c_str());
+		}
+
+		::close(file.fd);
+	}
+
+	if (error){
+		throw error;
+	}
+
+	return written.size();
+}
+
+// namespace midi
+}
@@ -1,24 +1,79 @@
 #include <midi/midi.h>
 #include <midi/player.h>
 #include <midi/synth.h>
+#include <midi/snapshot.h>
+#include <midi/tracing.h>
+#include <midi/log.h>
 
 #include <stdio.h>
 #include <unistd.h>
 #include <math.h>
+#include <string.h>
+#include <algorithm>
 
 namespace midi {
 
-synth::synth(player *play, uint32_t rate){
+typedef struct envelope_shape {
+	// seconds to full level
+	double attack;
+	// seconds for decay and release to fall by 60dB
+	double decay;
+	double sustain;
+	double release;
+} envelope_shape_t;
+
+// per instrument family, in the same order as instrument_function() below
+static const envelope_shape_t envelope_shapes[16] = {
+	/* Piano */                {0.002, 1.00, 0.40, 0.25},
+	/* Chromatic percussion */ {0.002, 0.50, 0.20, 0.30},
+	/* Organ */                {0.005, 0.05, 1.00, 0.05},
+	/* Guitar */               {0.002, 0.80, 0.30, 0.20},
+	/* Bass */                 {0.003, 0.40, 0.70, 0.08},
+	/* Strings */              {0.080, 0.20, 0.90, 0.30},
+	/* Ensemble */             {0.060, 0.20, 0.90, 0.35},
+	/* Brass */                {0.030, 0.15, 0.80, 0.15},
+	/* Reed */                 {0.020, 0.10, 0.85, 0.12},
+	/* Pipe */                 {0.030, 0.10, 0.90, 0.15},
+	/* Synth lead */           {0.005, 0.10, 0.85, 0.10},
+	/* Synth pad */            {0.150, 0.40, 0.80, 0.60},
+	/* Synth effects */        {0.100, 0.50, 0.70, 0.60},
+	/* Ethnic */               {0.005, 0.60, 0.40, 0.25},
+	/* Percussive */           {0.002, 0.30, 0.00, 0.20},
+	/* Sound effects */        {0.010, 0.30, 0.70, 0.30},
+};
+
+// below this an envelope counts as silent, about -60dB
+static const float envelope_floor = 0.001;
+
+synth::synth(player *play, uint32_t rate)
+	: master(rate, SYNTH_BLOCK_SIZE)
+{
 	sequencer = play;
 	sample_rate = rate;
 	perc_time = 4000 * (sample_rate / 44100.0);
-	tick = 0;
+	increment = (1.0 / sample_rate) * (16.35 / 2) /* C0 */ * 2*M_PI;
+	// bends settle over about 5ms, vibrato runs at 5.5Hz
+	control_coeff = 1 - exp(-SYNTH_CONTROL_BLOCK / (sample_rate * 0.005));
+	vibrato_inc = 2*M_PI * 5.5 / sample_rate;
+
+	double blocks = sample_rate / (double)SYNTH_CONTROL_BLOCK;
+
+	for (unsigned i = 0; i < 16; i++) {
+		const envelope_shape_t &shape = envelope_shapes[i];
+		double attack = shape.attack * blocks;
 
-	puts("::: synth worker started");
+		envelopes[i].attack_step = (attack > 1)? 1 / attack : 1;
+		envelopes[i].decay_coeff = pow(envelope_floor, 1 / (shape.decay * blocks));
+		envelopes[i].sustain = shape.sustain;
+		envelopes[i].release_coeff = pow(envelope_floor, 1 / (shape.release * blocks));
+	}
+	reset();
+
+	MIDI_LOG(LOG_DEBUG, "::: synth worker started");
 }
 
 synth::~synth(){
-	puts("::: synth exited");
+	MIDI_LOG(LOG_DEBUG, "::: synth exited");
 }
 
 #ifndef NO_OPTIMIZATIONS
@@ -73,10 +128,6 @@ static inline double note(unsigned i){
 // NO_OPTIMIZATIONS
 #endif
 
-static inline double d_note(double d){
-	return pow(pow(2, 1/12.0), d);
-}
-
 static inline double clipped_sin(double in, double clip){
 	double x = sin(in);
 
@@ -103,55 +154,52 @@ static inline double squarewave(double in){
 }
 
 // TODO: consider implementing an lfsr, although this sounds decent as is
-unsigned prand(void){
-	static unsigned x = 0x7ff7ff7f;
+static inline unsigned prand(unsigned &x){
 	x = x * 1103515245 + 12345;
 	return ((x / 0xffff) % 32767);
 }
 
-static inline double white_noise(void){
-	double a = prand() / 32767.0;
-	double b = prand() / 32767.0;
+static inline double white_noise(unsigned &state){
+	double a = prand(state) / 32767.0;
+	double b = prand(state) / 32767.0;
 
 	return (double)(a - b);
 }
 
-static uint16_t percussion_buf[0x40];
-
-double synth::kick(unsigned index, double tick){
+double synth::kick(unsigned index, double tick, double sweep){
 	percussion_buf[index]--;
 	double foo = 1 - (percussion_buf[index] / perc_time);
 	double impulse = foo / 32;
 	double impulse_adjust = 1 - impulse;
 
 	double a = clipped_sin(note(70), 0.3);
-	double b = clipped_sin(d_note(80 - foo * 8), 0.4 + foo/2);
+	double b = clipped_sin(sweep, 0.4 + foo/2);
 	double c = squarewave(tick * note(24)) * impulse;
 
 	return amplify((a*1.4 + b*1.5 + c*0.20) / (3 - impulse_adjust), 0.55);
 }
 
-double synth::snare(unsigned index, double tick){
+double synth::snare(unsigned index, double tick, double sweep){
 	percussion_buf[index]--;
 	double foo = 1 - (percussion_buf[index] / perc_time);
 	double impulse = foo / 32;
 	double impulse_adjust = 1 - impulse;
 
 	double a = clipped_sin(note(84), foo);
-	double b = clipped_sin(d_note(92 - foo * 10), foo);
+	double b = clipped_sin(sweep, foo);
 	double c = squarewave(tick * note(24)) * impulse;
 
 	return amplify((a*1.35 + b*1.45 + c*0.20) / (3 - impulse_adjust), 0.7);
 }
 
-double synth::tom(unsigned index, double tick){
+double synth::tom(unsigned index, double tick, double sweep){
 	percussion_buf[index]--;
 	double foo = 1 - (percussion_buf[index] / perc_time);
 	double impulse = foo / 32;
 	double impulse_adjust = 1 - impulse;
 
 	double a = clipped_sin(note(78), foo);
-	double b = clipped_sin(d_note(84 - foo * 10), foo);
+	double b = clipped_sin(sweep, foo);
 	double c = squarewave(tick * note(24)) * impulse;
 
 	return amplify((a*1.4 + b*1.5 + c*0.20) / (3 - impulse_adjust), 0.7);
@@ -161,7 +209,7 @@ double synth::hihat(unsigned index, double tick){
 	percussion_buf[index]--;
 	double foo = (1 - (percussion_buf[index] / perc_time)) / 8;
 
-	double a = white_noise() * foo;
+	double a = white_noise(noise_state) * foo;
 	double b = squarewave(tick * note(24)) * (foo / 4);
 	double x = (a + b) / 2;
 
@@ -171,15 +219,33 @@ double synth::hihat(unsigned index, double tick){
 	return x;
 }
 
-double synth::do_percussion(unsigned index, double tick){
+// cheap stand-ins for the drum kit, used when the governor needs to shed load
+double synth::simple_percussion(unsigned index, double tick){
+	percussion_buf[index]--;
+	double foo = 1 - (percussion_buf[index] / perc_time);
+
+	switch (index) {
+		case 0:
+		case 1:  return squarewave(tick * note(12)) * (1 - foo) * 0.6;
+
+		case 2:
+		case 3:
+		case 4:
+		case 5:  return white_noise(noise_state) * (1 - foo) * 0.5;
+
+		default: return white_noise(noise_state) * (1 - foo) / 16;
+	}
+}
+
+double synth::do_percussion(unsigned index, double tick, double sweep){
 	switch (index) {
 		case 0:
-		case 1:  return kick(index, tick);
+		case 1:  return kick(index, tick, sweep);
 
 		case 2:
 		case 3:
 		case 4:
-		case 5:  return snare(index, tick);
+		case 5:  return snare(index, tick, sweep);
 
 		/* closed hi hat */
 		case 7:
@@ -194,7 +260,30 @@ double synth::do_percussion(unsigned index, double tick){
 		case 10:
 		case 12:
 		case 13:
-		case 15: return tom(index, tick);
+		case 15: return tom(index, tick, sweep);
+
+		default: return 0;
+	}
+}
+
+// Pitch of the falling tone in the kick, snare and toms, in semitones above
+// C0, at a given point through the drum. Zero for drums without one.
+static double drum_sweep(unsigned index, double foo){
+	switch (index) {
+		case 0:
+		case 1:  return 80 - foo * 8;
+
+		case 2:
+		case 3:
+		case 4:
+		case 5:  return 92 - foo * 10;
+
+		case 6:
+		case 8:
+		case 10:
+		case 12:
+		case 13:
+		case 15: return 84 - foo * 10;
 
 		default: return 0;
 	}
@@ -236,20 +325,23 @@ static double synth_ensemble(double tick, unsigned key){
 	return amplify(a, 0.3);
 }
 
-static double gen_instrument(unsigned instrument, double tick, unsigned key){
+typedef double (*instrument_fn)(double tick, unsigned key);
+
+// looked up once per voice per block rather than for every sample
+static instrument_fn instrument_function(unsigned instrument){
 	switch (instrument >> 3) {
 		// Organ
-		case 2: return synth_organ(tick, key);
+		case 2: return synth_organ;
 		// Guitar
-		case 3: return synth_guitar(tick, key);
+		case 3: return synth_guitar;
 		// Bass
-		case 4: return synth_bass(tick, key);
+		case 4: return synth_bass;
 		// Ensemble
-		case 6: return synth_ensemble(tick, key);
+		case 6: return synth_ensemble;
 		// Synth lead
-		case 10: return synth_lead(tick, key);
+		case 10: return synth_lead;
 		// Synth pad
-		case 11: return synth_pad(tick, key);
+		case 11: return synth_pad;
 
 		// Piano
 		case 0:
@@ -271,41 +363,391 @@ static double gen_instrument(unsigned instrument, double tick, unsigned key){
 		case 14:
 		// Sound effects
 		case 15:
-		default: return synth_pad(tick, key);
+		default: return synth_pad;
 	}
 }
 
-static double ghetto_limiter(double x, double *thresh){
-	if (*thresh > 1){
-		*thresh -= 0.0001;
+// one control block's worth of envelope, from one target to the next
+static inline void advance_envelope(voice_t &vo, const envelope_t &env){
+	switch (vo.stage) {
+		case ENVELOPE_ATTACK:
+			vo.target += env.attack_step;
+
+			if (vo.target >= 1){
+				vo.target = 1;
+				vo.stage = ENVELOPE_DECAY;
+			}
+			break;
+
+		case ENVELOPE_DECAY:
+			vo.target = env.sustain + (vo.target - env.sustain) * env.decay_coeff;
+
+			if (vo.target - env.sustain < envelope_floor){
+				vo.target = env.sustain;
+				vo.stage = (env.sustain > 0)? ENVELOPE_SUSTAIN : ENVELOPE_DONE;
+			}
+			break;
+
+		case ENVELOPE_RELEASE:
+			vo.target *= env.release_coeff;
+
+			if (vo.target < envelope_floor){
+				vo.target = 0;
+				vo.stage = ENVELOPE_DONE;
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+// Steps the control grid on by a number of frames, returns how many
+// updates fell within them.
+static inline unsigned control_updates(unsigned &left, unsigned frames){
+	if (left >= frames){
+		left -= frames;
+		return 0;
 	}
 
-	if (x > *thresh)  *thresh = x;
-	if (x < -*thresh) *thresh = -x;
+	unsigned ret = (frames - left - 1) / SYNTH_CONTROL_BLOCK + 1;
+	left = (left + ret * SYNTH_CONTROL_BLOCK) - frames;
+
+	return ret;
+}
+
+// naive square wave computed from the phase directly, no sin() involved
+static inline double cheap_instrument(double tick, unsigned key){
+	double phase = tick * note(key) * (0.5 / M_PI);
 
-	return x / *thresh;
+	return (phase - floor(phase) < 0.5)? 0.6 : -0.6;
 }
 
-int16_t synth::next_sample(void){
-	static double increment = (1.0 / sample_rate) * (16.35 / 2) /* C0 */ * 2*M_PI;
+// Per-channel gains for the mix bus. Volume follows the usual squared
+// curve, but with unity gain at the GM default of 100 so that files which
+// never send CC7 are as loud as they've always been, and expression (CC11)
+// scales it the same way. Pan is constant power,
+// likewise normalized to unity at center.
+static void channel_gains(const channel &ch, float *gain){
+	double v = (ch.volume / 100.0) * (ch.expression / 127.0);
+	double p = (ch.pan <= 64)? ch.pan / 128.0 : 0.5 + (ch.pan - 64) / 126.0;
+
+	gain[0] = v * v * cos(p * M_PI/2) * M_SQRT2;
+	gain[1] = v * v * sin(p * M_PI/2) * M_SQRT2;
+}
 
-	tick += increment;
+typedef float v4sf __attribute__((vector_size(16), may_alias));
 
-	double sum = 0;
+// dst += src * gain, with the gain ramping linearly from g0 to g1 over
+// frames. Both buffers are aligned and zero past frames, up to padded.
+static void mix_ramp(float *dst, const float *src, float g0, float g1,
+                     unsigned frames, unsigned padded)
+{
+	float step = (g1 - g0) / frames;
+	v4sf g  = {g0 + step, g0 + 2*step, g0 + 3*step, g0 + 4*step};
+	v4sf dg = {4*step, 4*step, 4*step, 4*step};
+
+	for (unsigned i = 0; i < padded; i += 4) {
+		*(v4sf *)(dst + i) += *(const v4sf *)(src + i) * g;
+		g += dg;
+	}
+}
+
+// SIMD loops work on groups of 4 frames
+static inline unsigned padded_frames(unsigned frames){
+	return (frames + 3) & ~3u;
+}
+
+// wraps a sample position back into the zone's loop, or -1 once a sample
+// that doesn't loop has run out
+static inline double sample_advance(const bank_zone_t &z, double pos){
+	if (z.flags & BANK_ZONE_LOOP){
+		if (pos >= z.loop_end){
+			pos = z.loop_start + fmod(pos - z.loop_start, z.loop_end - z.loop_start);
+		}
+
+	} else if (pos >= z.end){
+		return -1;
+	}
+
+	return pos;
+}
+
+double synth::output_latency(void){
+	return 0;
+}
+
+uint32_t synth::rate(void){
+	return sample_rate;
+}
+
+void synth::set_quality(const synth_quality_t &q){
+	quality = q;
+}
+
+void synth::set_mute_mask(uint16_t mask){
+	mute_mask = mask;
+}
+
+void synth::set_paused(bool pause){
+	paused = pause;
+}
+
+bool synth::sounding(void){
+	for (unsigned v = 0; v < num_voices; v++) {
+		if (voices[v].stage != ENVELOPE_DONE){
+			return true;
+		}
+	}
+
+	for (unsigned k = 0; k < 0x40; k++) {
+		if (percussion_buf[k] > 2){
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void synth::reset(void){
+	tick = 0;
+	vibrato_phase = 0;
+	control_left = 0;
+	quality = {SYNTH_MAX_VOICES, 0, false, false};
+	num_voices = 0;
+	num_rendered = 0;
+	num_stolen = 0;
+	mute_mask = 0;
+	drums_muted = false;
+	paused = false;
+	noise_state = 0x7ff7ff7f;
+	channels_used = 0;
+	memset(percussion_buf, 0, sizeof(percussion_buf));
+	master.reset();
+
+	channel defaults;
+
+	for (unsigned k = 0; k < 16; k++) {
+		channel_gains(defaults, gains[k]);
+		chan_tick[k] = 0;
+		chan_ratio[k] = 1;
+		chan_target[k] = 1;
+		chan_step[k] = 0;
+		chan_bend[k] = 0;
+	}
+}
+
+void synth::prefault(void){
+	memset(voices, 0, sizeof(voices));
+	memset(render_list, 0, sizeof(render_list));
+	memset(percussion_buf, 0, sizeof(percussion_buf));
+	memset(channel_buf, 0, sizeof(channel_buf));
+	memset(mix_buf, 0, sizeof(mix_buf));
+	memset(stem_buf, 0, sizeof(stem_buf));
+	memset(tick_buf, 0, sizeof(tick_buf));
+	memset(phase_buf, 0, sizeof(phase_buf));
+	memset(tap_buf, 0, sizeof(tap_buf));
+	memset(frac_buf, 0, sizeof(frac_buf));
+	memset(voice_buf, 0, sizeof(voice_buf));
+	memset(patch_osc, 0, sizeof(patch_osc));
+	memset(patch_acc, 0, sizeof(patch_acc));
+	master.reset();
+}
+
+void synth::prefault_render(int16_t *buf, unsigned frames){
+	synth::prefault();
+
+	// nothing's playing yet, so this renders silence, but it runs the
+	// whole render path once and initializes any lazy state in it
+	memset(buf, 0, frames * SYNTH_CHANNELS * sizeof(int16_t));
+
+	render_stats *saved = timing;
+	frame_source *src = source;
+	stem_sink *sink = stems;
+	timing = NULL;
+	source = NULL;
+	stems = NULL;
+
+	if (sequencer){
+		render(buf, frames);
+	}
+
+	timing = saved;
+	source = src;
+	stems = sink;
+}
+
+void synth::save_state(std::string &out) const {
+	save_field(out, tick);
+	save_field(out, chan_tick);
+	save_field(out, chan_ratio);
+	save_field(out, chan_target);
+	save_field(out, chan_step);
+	save_field(out, control_left);
+	save_field(out, chan_bend);
+	save_field(out, vibrato_phase);
+	save_field(out, percussion_buf);
+	save_field(out, noise_state);
+	save_field(out, gains);
+	save_field(out, quality.max_voices);
+	save_field(out, quality.min_velocity);
+	save_field(out, quality.cheap_oscillators);
+	save_field(out, quality.simple_drums);
+	save_field(out, mute_mask);
+	save_field(out, num_voices);
+
+	for (unsigned v = 0; v < num_voices; v++) {
+		const voice_t &vo = voices[v];
+
+		save_field(out, vo.channel);
+		save_field(out, vo.key);
+		save_field(out, vo.velocity);
+		save_field(out, vo.instrument);
+		save_field(out, vo.stage);
+		save_field(out, vo.level);
+		save_field(out, vo.target);
+		save_field(out, vo.step);
+		save_field(out, vo.zone);
+		save_field(out, vo.pitch);
+		save_field(out, vo.pos);
+	}
+
+	master.save_state(out);
+}
+
+void synth::load_state(const uint8_t *ptr, size_t len){
+	const uint8_t *end = ptr + len;
+
+	load_field(ptr, end, tick);
+	load_field(ptr, end, chan_tick);
+	load_field(ptr, end, chan_ratio);
+	load_field(ptr, end, chan_target);
+	load_field(ptr, end, chan_step);
+	load_field(ptr, end, control_left);
+	load_field(ptr, end, chan_bend);
+	load_field(ptr, end, vibrato_phase);
+	load_field(ptr, end, percussion_buf);
+	load_field(ptr, end, noise_state);
+	load_field(ptr, end, gains);
+	load_field(ptr, end, quality.max_voices);
+	load_field(ptr, end, quality.min_velocity);
+	load_field(ptr, end, quality.cheap_oscillators);
+	load_field(ptr, end, quality.simple_drums);
+	load_field(ptr, end, mute_mask);
+	load_field(ptr, end, num_voices);
+
+	if (num_voices > SYNTH_MAX_VOICES){
+		throw "render state is corrupt";
+	}
+
+	for (unsigned v = 0; v < num_voices; v++) {
+		voice_t &vo = voices[v];
+
+		load_field(ptr, end, vo.channel);
+		load_field(ptr, end, vo.key);
+		load_field(ptr, end, vo.velocity);
+		load_field(ptr, end, vo.instrument);
+		load_field(ptr, end, vo.stage);
+		load_field(ptr, end, vo.level);
+		load_field(ptr, end, vo.target);
+		load_field(ptr, end, vo.step);
+		load_field(ptr, end, vo.zone);
+		load_field(ptr, end, vo.pitch);
+		load_field(ptr, end, vo.pos);
+
+		if (vo.channel > 15 || vo.key > 127 || vo.stage > ENVELOPE_DONE
+		    || (vo.zone != BANK_NO_ZONE && (!bank || vo.zone >= bank->zone_count)))
+		{
+			throw "render state is corrupt";
+		}
+	}
+
+	master.load_state(ptr, end);
+
+	if (ptr != end){
+		throw "render state doesn't fit this synth";
+	}
+}
+
+void synth::skip(unsigned frames){
+	while (frames > 0) {
+		frames -= sequencer->dispatch(frames);
+	}
+}
+
+// render only the loudest voices, the rest carry on silently so that they
+// can come back once there's room
+void synth::steal_voices(void){
+	voice_t *v = voices;
+
+	std::nth_element(render_list, render_list + quality.max_voices,
+		render_list + num_rendered,
+		[v](uint16_t a, uint16_t b){
+			return v[a].velocity * v[a].level > v[b].velocity * v[b].level;
+		});
+
+	num_stolen = num_rendered - quality.max_voices;
+	num_rendered = quality.max_voices;
+}
+
+// Changes of stage take effect straight away rather than at the next
+// control update, the rest of the current segment ramps to the new stage's
+// first target.
+void synth::retarget(voice_t &vo){
+	vo.target = vo.level;
+	vo.step = 0;
+
+	if (control_left > 0){
+		advance_envelope(vo, envelopes[vo.instrument >> 3]);
+		vo.step = (vo.target - vo.level) / control_left;
+	}
+}
+
+// Starts, releases and retires voices to match the channels' notemaps.
+// Channel state can't change in the middle of a block, so doing this once
+// per block is enough.
+void synth::update_voices(void){
+	uint64_t present[16][2];
+	unsigned kept = 0;
+
+	memset(present, 0, sizeof(present));
+
+	for (unsigned v = 0; v < num_voices; v++) {
+		voice_t vo = voices[v];
+		channel &ch = sequencer->channels[vo.channel];
+		bool held = ch.notemap[vo.key] != 0;
+
+		if (mute_mask & (1 << vo.channel)){
+			continue;
+		}
+
+		if (held && vo.stage == ENVELOPE_RELEASE){
+			// struck again before it died away, rises from where it is
+			vo.stage = ENVELOPE_ATTACK;
+			vo.velocity = ch.notemap[vo.key];
+			start_sample(vo);
+			retarget(vo);
+
+		} else if (!held && vo.stage < ENVELOPE_RELEASE){
+			vo.stage = ENVELOPE_RELEASE;
+			retarget(vo);
+		}
+
+		if (!held && vo.stage == ENVELOPE_DONE){
+			continue;
+		}
+
+		present[vo.channel][vo.key >> 6] |= 1ULL << (vo.key & 63);
+		voices[kept++] = vo;
+	}
+
+	num_voices = kept;
 
 	for (unsigned k = 0; k < 16; k++) {
 		channel &ch = sequencer->channels[k];
 
-		if (k == 9) {
-			// XXX: need to tie in the synth to the sequencer,
-			//      percussion needs to be edge-triggered rather than level-triggered
-			//      like the instruments. This will do for now, but uses noticably
-			//      more CPU scanning this each sample
-			for (unsigned key = 35; key <= 81; key++) {
-				if (!ch.notemap[key]){
-					percussion_buf[key - 35] = 0;
-				}
-			}
+		if (k == 9 || (mute_mask & (1 << k))){
+			continue;
 		}
 
 		for (unsigned i = 0; i < 128; i++){
@@ -313,32 +755,630 @@ int16_t synth::next_sample(void){
 				break;
 
 			uint8_t key = ch.active[i];
+			uint8_t velocity = ch.notemap[key];
 
-			// handle percussion channel
-			if (k == 9){
-				if (key >= 35 && key <= 81 && !percussion_buf[key - 35]){
-					percussion_buf[key - 35] = perc_time;
-				}
+			if (velocity < quality.min_velocity
+			    || (present[k][key >> 6] & (1ULL << (key & 63)))){
 				continue;
 			}
 
-			uint8_t velocity = ch.notemap[key];
-			double x = gen_instrument(ch.instrument, tick, key);
+			voices[num_voices] = {(uint8_t)k, key, velocity, ch.instrument,
+			                      ENVELOPE_ATTACK, 0, 0, 0, BANK_NO_ZONE, 0, 0};
+			start_sample(voices[num_voices]);
+			retarget(voices[num_voices++]);
+		}
+	}
+}
 
-			sum += x * (velocity / 127.0) * 0.3;
+void synth::begin_block(void){
+	drums_muted = mute_mask & (1 << 9);
+
+	if (!(mute_mask & (1 << 9))){
+		// XXX: need to tie in the synth to the sequencer,
+		//      percussion needs to be edge-triggered rather than level-triggered
+		//      like the instruments.
+		channel &ch = sequencer->channels[9];
+
+		for (unsigned key = 35; key <= 81; key++) {
+			if (!ch.notemap[key]){
+				percussion_buf[key - 35] = 0;
+
+			} else if (!percussion_buf[key - 35]){
+				percussion_buf[key - 35] = perc_time;
+			}
 		}
 	}
 
-	for (unsigned k = 0; k < 0x40; k++) {
-		if (percussion_buf[k] > 2) {
-			uint8_t velocity = sequencer->channels[9].notemap[k + 35];
+	update_voices();
+	num_rendered = 0;
+	num_stolen = 0;
 
-			sum += do_percussion(k, tick) * (velocity / 127.0) * 0.33;
+	for (unsigned v = 0; v < num_voices; v++) {
+		if (voices[v].stage != ENVELOPE_DONE){
+			render_list[num_rendered++] = v;
 		}
 	}
 
-	static double thresh_state = 1;
-	return 0x7fff * ghetto_limiter(sum, &thresh_state);
+	if (num_rendered > quality.max_voices){
+		steal_voices();
+	}
+
+	voice_t *v = voices;
+
+	// grouped by channel for render_block()
+	std::sort(render_list, render_list + num_rendered,
+		[v](uint16_t a, uint16_t b){
+			return v[a].channel < v[b].channel;
+		});
+}
+
+unsigned synth::render_chunk(unsigned frames){
+	TRACE_SPAN(span, "render");
+	uint64_t start = timing? render_stats::now() : 0;
+
+	// split wherever the sequencer has an event due
+	frames = sequencer->dispatch(frames);
+
+	uint64_t dispatched = timing? render_stats::now() : 0;
+	render_block(frames);
+
+	if (timing){
+		timing->add(STAGE_SEQUENCE, dispatched - start);
+		timing->add(STAGE_SYNTH, render_stats::now() - dispatched);
+		timing->voices(num_rendered, frames);
+	}
+
+	TRACE_SPAN_ARG(span, "frames", frames);
+	TRACE_SPAN_ARG(span, "voices", num_rendered);
+	TRACE_COUNTER("voices", num_rendered);
+	return frames;
+}
+
+void synth::render(int16_t *buf, unsigned frames){
+	if (paused){
+		memset(buf, 0, frames * SYNTH_CHANNELS * sizeof(int16_t));
+		return;
+	}
+
+	// frames from a source are already mixed and limited
+	while (source && frames > 0) {
+		unsigned n = (frames < SYNTH_BLOCK_SIZE)? frames : SYNTH_BLOCK_SIZE;
+
+		source->render(source_buf, n);
+
+		for (unsigned i = 0; i < n * SYNTH_CHANNELS; i++) {
+			*buf++ = 0x7fff * source_buf[i];
+		}
+
+		frames -= n;
+	}
+
+	while (frames > 0) {
+		unsigned n = (frames < SYNTH_BLOCK_SIZE)? frames : SYNTH_BLOCK_SIZE;
+
+		n = render_chunk(n);
+
+		for (unsigned i = 0; i < n; i++) {
+			*buf++ = 0x7fff * mix_buf[0][i];
+			*buf++ = 0x7fff * mix_buf[1][i];
+		}
+
+		frames -= n;
+	}
+}
+
+void synth::render(float *buf, unsigned frames){
+	if (paused){
+		memset(buf, 0, frames * SYNTH_CHANNELS * sizeof(float));
+		return;
+	}
+
+	while (source && frames > 0) {
+		unsigned n = (frames < SYNTH_BLOCK_SIZE)? frames : SYNTH_BLOCK_SIZE;
+
+		source->render(buf, n);
+		buf += n * SYNTH_CHANNELS;
+		frames -= n;
+	}
+
+	while (frames > 0) {
+		unsigned n = (frames < SYNTH_BLOCK_SIZE)? frames : SYNTH_BLOCK_SIZE;
+
+		n = render_chunk(n);
+
+		for (unsigned i = 0; i < n; i++) {
+			*buf++ = mix_buf[0][i];
+			*buf++ = mix_buf[1][i];
+		}
+
+		frames -= n;
+	}
+}
+
+void synth::render_block(unsigned frames){
+	unsigned padded = padded_frames(frames);
+
+	begin_block();
+	channels_used = 0;
+
+	// drums, and channels at their natural pitch, see this phase
+	for (unsigned i = 0; i < frames; i++) {
+		tick += increment;
+		tick_buf[i] = tick;
+	}
+
+	for (unsigned r = 0; r < num_rendered; r++) {
+		voice_t &vo = voices[render_list[r]];
+		float *dst = channel_buf[vo.channel];
+
+		if (!(channels_used & (1 << vo.channel))){
+			memset(dst, 0, padded * sizeof(float));
+			channels_used |= 1 << vo.channel;
+
+			// voices are grouped by channel, so this is worked out once
+			// for all of a channel's voices
+			channel_phase(vo.channel, frames);
+		}
+
+		instrument_fn fn = quality.cheap_oscillators
+			? cheap_instrument
+			: instrument_function(vo.instrument);
+		const envelope_t &env = envelopes[vo.instrument >> 3];
+		float amp = (vo.velocity / 127.0) * 0.3;
+		const float *samples = NULL;
+		const patch_plan_t *plan = (patches && !quality.cheap_oscillators)
+			? patches->plan(vo.instrument)
+			: NULL;
+
+		if (vo.zone != BANK_NO_ZONE){
+			render_sample(vo, frames);
+			samples = voice_buf;
+
+		} else if (plan){
+			render_patch(vo, *plan, frames);
+			samples = voice_buf;
+		}
+
+		unsigned left = control_left;
+
+		// envelope levels are worked out per control block and ramped
+		// linearly across it
+		for (unsigned start = 0, n; start < frames; start += n) {
+			if (left == 0){
+				vo.level = vo.target;
+				advance_envelope(vo, env);
+				vo.step = (vo.target - vo.level) / SYNTH_CONTROL_BLOCK;
+				left = SYNTH_CONTROL_BLOCK;
+			}
+
+			n = std::min(frames - start, left);
+			float level = vo.level;
+			float step = vo.step;
+			unsigned key = vo.key;
+
+			if (samples){
+				for (unsigned i = start; i < start + n; i++) {
+					level += step;
+					dst[i] += samples[i] * level * amp;
+				}
+
+			} else {
+				for (unsigned i = start; i < start + n; i++) {
+					level += step;
+					dst[i] += fn(phase_buf[i], key) * level * amp;
+				}
+			}
+
+			vo.level = level;
+			left -= n;
+		}
+	}
+
+	// stolen voices still need to age, they're left just past the end of
+	// the render list
+	unsigned left = control_left;
+	unsigned updates = control_updates(left, frames);
+
+	for (unsigned r = num_rendered; r < num_rendered + num_stolen; r++) {
+		voice_t &vo = voices[render_list[r]];
+
+		for (unsigned u = 0; u < updates; u++) {
+			advance_envelope(vo, envelopes[vo.instrument >> 3]);
+		}
+
+		if (vo.zone != BANK_NO_ZONE){
+			// near enough, bends are ignored while it can't be heard
+			vo.pos = sample_advance(bank->zones[vo.zone], vo.pos + vo.pitch * frames);
+
+			if (vo.pos < 0){
+				vo.stage = ENVELOPE_DONE;
+			}
+		}
+
+		vo.level = vo.target;
+		vo.step = 0;
+	}
+
+	for (unsigned k = 0; k < 16; k++) {
+		if (!(channels_used & (1 << k))){
+			idle_channel(k);
+		}
+	}
+
+	vibrato_phase = fmod(vibrato_phase + frames * vibrato_inc, 2*M_PI);
+	control_left = left;
+
+	if (!drums_muted){
+		render_percussion(frames);
+	}
+
+	mix_channels(frames);
+	master.process(mix_buf[0], mix_buf[1], frames);
+}
+
+static inline double bend_semitones(const channel &ch){
+	return ((int)ch.bend - 0x2000) / 8192.0 * ch.bend_range;
+}
+
+// The pitch ratio is worked out at each control update, from the smoothed
+// bend plus vibrato, and ramped linearly until the next, so exp2() and sin()
+// run a handful of times per block rather than per sample. At rest the ratio
+// is exactly 1 and the phase matches tick_buf.
+void synth::channel_phase(unsigned k, unsigned frames){
+	const channel &ch = sequencer->channels[k];
+	double target = bend_semitones(ch);
+	double depth = ch.modulation * (0.5 / 127);
+	double t = chan_tick[k];
+	double ratio = chan_ratio[k];
+	double step = chan_step[k];
+	double &bend = chan_bend[k];
+	unsigned left = control_left;
+
+	phase_origin = t;
+
+	for (unsigned start = 0, n; start < frames; start += n) {
+		if (left == 0){
+			ratio = chan_target[k];
+			bend += (target - bend) * control_coeff;
+
+			if (fabs(target - bend) < 1e-4){
+				bend = target;
+			}
+
+			double semitones = bend;
+
+			if (depth > 0){
+				double at = (start + SYNTH_CONTROL_BLOCK) * vibrato_inc;
+				semitones += depth * sin(vibrato_phase + at);
+			}
+
+			chan_target[k] = (semitones == 0)? 1 : exp2(semitones / 12);
+			step = (chan_target[k] - ratio) / SYNTH_CONTROL_BLOCK;
+			left = SYNTH_CONTROL_BLOCK;
+		}
+
+		n = std::min(frames - start, left);
+
+		for (unsigned i = start; i < start + n; i++) {
+			ratio += step;
+			t += increment * ratio;
+			phase_buf[i] = t;
+		}
+
+		left -= n;
+	}
+
+	chan_tick[k] = t;
+	chan_ratio[k] = ratio;
+	chan_step[k] = step;
+}
+
+void synth::start_sample(voice_t &vo){
+	if (!bank){
+		return;
+	}
+
+	vo.zone = bank->find(vo.instrument, vo.key, vo.velocity);
+
+	if (vo.zone != BANK_NO_ZONE){
+		const bank_zone_t &z = bank->zones[vo.zone];
+		double semitones = ((int)vo.key - z.root_key) + z.tune / 100.0;
+
+		vo.pitch = (double)z.sample_rate / sample_rate * exp2(semitones / 12);
+		vo.pos = z.start;
+	}
+}
+
+// Positions are worked out from the channel phase, so bends and vibrato
+// apply to samples the same as to the built in instruments. Finding the
+// taps needs a gather and wraps at the loop, so that's done per frame, the
+// interpolation itself runs four frames at a time.
+void synth::render_sample(voice_t &vo, unsigned frames){
+	const bank_zone_t &z = bank->zones[vo.zone];
+	const int16_t *data = bank->samples;
+	bool loop = z.flags & BANK_ZONE_LOOP;
+	uint32_t limit = loop? z.loop_end : z.end;
+	uint32_t length = z.loop_end - z.loop_start;
+	unsigned padded = padded_frames(frames);
+	double scale = vo.pitch / increment;
+	double prev = phase_origin;
+	double pos = vo.pos;
+	unsigned i = 0;
+
+	for (; i < frames; i++) {
+		pos += (phase_buf[i] - prev) * scale;
+		prev = phase_buf[i];
+		pos = sample_advance(z, pos);
+
+		if (pos < 0){
+			// a one shot sample ran out, the voice is done with
+			vo.stage = ENVELOPE_DONE;
+			break;
+		}
+
+		uint32_t at = pos;
+		frac_buf[i] = pos - at;
+
+		for (unsigned j = 0; j < 4; j++) {
+			int64_t x = (int64_t)at + j - 1;
+
+			if (x < z.start){
+				x = z.start;
+			} else if (x >= limit){
+				x = loop? x - length : z.end - 1;
+			}
+
+			tap_buf[j][i] = data[x] * (1 / 32768.0f);
+		}
+	}
+
+	vo.pos = pos;
+
+	for (; i < padded; i++) {
+		frac_buf[i] = 0;
+
+		for (unsigned j = 0; j < 4; j++) {
+			tap_buf[j][i] = 0;
+		}
+	}
+
+	for (i = 0; i < padded; i += 4) {
+		v4sf a = *(v4sf *)(tap_buf[0] + i);
+		v4sf b = *(v4sf *)(tap_buf[1] + i);
+		v4sf c = *(v4sf *)(tap_buf[2] + i);
+		v4sf d = *(v4sf *)(tap_buf[3] + i);
+		v4sf t = *(v4sf *)(frac_buf + i);
+
+		if (quality.cheap_oscillators){
+			*(v4sf *)(voice_buf + i) = b + t * (c - b);
+
+		} else {
+			// Catmull-Rom
+			v4sf p = 3.0f * (b - c) + d - a;
+			v4sf q = 2.0f * a - 5.0f * b + 4.0f * c - d;
+
+			*(v4sf *)(voice_buf + i) = b + 0.5f * t * (c - a + t * (q + t * p));
+		}
+	}
+}
+
+// Each step runs over the whole block before the next one starts, and
+// whatever a patch doesn't use was left out when it was lowered, so the
+// per-frame loops are straight-line code the compiler can vectorize where
+// it doesn't have to call sin(). Clipping is the same as clipped_sin()
+// and drive the same as amplify(), so the default patches sound just like
+// the built in instruments.
+void synth::render_patch(const voice_t &vo, const patch_plan_t &plan,
+                         unsigned frames)
+{
+	double *osc = patch_osc;
+	double *acc = patch_acc;
+	const double *phase = phase_buf;
+
+	memset(acc, 0, frames * sizeof(double));
+
+	for (unsigned s = 0; s < plan.count; s++) {
+		const patch_step_t &st = plan.steps[s];
+		double a = st.a;
+
+		switch (st.op) {
+			case PATCH_OP_SINE: {
+				double freq = note(vo.key + st.transpose) * a;
+
+				for (unsigned i = 0; i < frames; i++) {
+					osc[i] = sin(phase[i] * freq);
+				}
+				break;
+			}
+
+			case PATCH_OP_TRIANGLE: {
+				double freq = note(vo.key + st.transpose) * a * (0.5 / M_PI);
+
+				for (unsigned i = 0; i < frames; i++) {
+					double t = phase[i] * freq + 0.25;
+					osc[i] = 1 - 4 * fabs(t - floor(t) - 0.5);
+				}
+				break;
+			}
+
+			case PATCH_OP_SAW: {
+				double freq = note(vo.key + st.transpose) * a * (0.5 / M_PI);
+
+				for (unsigned i = 0; i < frames; i++) {
+					double t = phase[i] * freq + 0.5;
+					osc[i] = 2 * (t - floor(t)) - 1;
+				}
+				break;
+			}
+
+			case PATCH_OP_CLIP:
+				for (unsigned i = 0; i < frames; i++) {
+					double x = osc[i];
+
+					x = (x >  a)?  1 : x;
+					x = (x < -a)? -1 : x;
+					osc[i] = x;
+				}
+				break;
+
+			case PATCH_OP_CLIP_LFO:
+				for (unsigned i = 0; i < frames; i++) {
+					double clip = a + st.c * sin(phase[i] * st.b);
+					double x = osc[i];
+
+					x = (x >  clip)?  1 : x;
+					x = (x < -clip)? -1 : x;
+					osc[i] = x;
+				}
+				break;
+
+			case PATCH_OP_MIX:
+				for (unsigned i = 0; i < frames; i++) {
+					acc[i] += osc[i] * a;
+				}
+				break;
+
+			case PATCH_OP_DRIVE:
+				for (unsigned i = 0; i < frames; i++) {
+					double x = acc[i];
+
+					x += (x > 0)?  a : 0;
+					x -= (x < 0)?  a : 0;
+					acc[i] = fmax(-1, fmin(1, x));
+				}
+				break;
+
+			case PATCH_OP_OUTPUT:
+				for (unsigned i = 0; i < frames; i++) {
+					voice_buf[i] = acc[i] * a;
+				}
+				break;
+		}
+	}
+
+	for (unsigned i = frames; i < padded_frames(frames); i++) {
+		voice_buf[i] = 0;
+	}
+}
+
+// nothing to glide from, so jump straight to the channel's current bend
+void synth::idle_channel(unsigned k){
+	double bend = bend_semitones(sequencer->channels[k]);
+
+	chan_tick[k] = tick;
+	chan_bend[k] = bend;
+	chan_ratio[k] = (bend == 0)? 1 : exp2(bend / 12);
+	chan_target[k] = chan_ratio[k];
+	chan_step[k] = 0;
+}
+
+void synth::render_percussion(unsigned frames){
+	bool any = false;
+
+	for (unsigned k = 0; k < 0x40 && !any; k++) {
+		any = percussion_buf[k] > 2;
+	}
+
+	if (!any){
+		return;
+	}
+
+	// melodic voices are never on channel 10, so it's all ours
+	float *dst = channel_buf[9];
+	uint8_t *notemap = sequencer->channels[9].notemap;
+	double sweep[0x40];
+	double sweep_step[0x40];
+
+	memset(dst, 0, padded_frames(frames) * sizeof(float));
+	channels_used |= 1 << 9;
+
+	for (unsigned start = 0; start < frames; start += SYNTH_CONTROL_BLOCK) {
+		unsigned n = std::min(frames - start, (unsigned)SYNTH_CONTROL_BLOCK);
+
+		// pitch sweeps are exponential, but close enough to linear over
+		// a control block to only need exp2() at each end of it
+		for (unsigned k = 0; k < 0x40; k++) {
+			sweep[k] = 0;
+			sweep_step[k] = 0;
+
+			if (percussion_buf[k] <= 2){
+				continue;
+			}
+
+			// as of the first frame, the drums count down before rendering
+			double foo = 1 - (percussion_buf[k] - 1) / perc_time;
+			double from = drum_sweep(k, foo);
+
+			if (from != 0){
+				sweep[k] = exp2(from / 12);
+				sweep_step[k] = (exp2(drum_sweep(k, foo + n / perc_time) / 12) - sweep[k]) / n;
+			}
+		}
+
+		for (unsigned i = start; i < start + n; i++) {
+			double sum = 0;
+
+			for (unsigned k = 0; k < 0x40; k++) {
+				if (percussion_buf[k] > 2) {
+					double x = quality.simple_drums
+						? simple_percussion(k, tick_buf[i])
+						: do_percussion(k, tick_buf[i], sweep[k]);
+
+					sweep[k] += sweep_step[k];
+					sum += x * (notemap[k + 35] / 127.0) * 0.33;
+				}
+			}
+
+			dst[i] = sum;
+		}
+	}
+}
+
+void synth::mix_channels(unsigned frames){
+	unsigned padded = padded_frames(frames);
+
+	for (unsigned c = 0; c < SYNTH_CHANNELS; c++) {
+		memset(mix_buf[c], 0, padded * sizeof(float));
+	}
+
+	for (unsigned k = 0; k < 16; k++) {
+		float target[SYNTH_CHANNELS];
+		channel_gains(sequencer->channels[k], target);
+
+		if (stems){
+			for (unsigned c = 0; c < SYNTH_CHANNELS; c++) {
+				memset(stem_buf[c], 0, padded * sizeof(float));
+			}
+		}
+
+		if (channels_used & (1 << k)){
+			for (unsigned c = 0; c < SYNTH_CHANNELS; c++) {
+				float g = gains[k][c];
+
+				// blocks split at events can be very short, so ramps take
+				// at least a control block and carry on into the next one
+				if (frames < SYNTH_CONTROL_BLOCK){
+					target[c] = g + (target[c] - g) * frames / SYNTH_CONTROL_BLOCK;
+				}
+
+				mix_ramp(mix_buf[c], channel_buf[k], g, target[c],
+				         frames, padded);
+
+				// a stem takes the same ramp as its part of the mix
+				if (stems){
+					mix_ramp(stem_buf[c], channel_buf[k], g, target[c],
+					         frames, padded);
+				}
+			}
+		}
+
+		if (stems){
+			stems->stem(k, stem_buf[0], stem_buf[1], frames);
+		}
+
+		// silent channels can jump straight to their new gains
+		memcpy(gains[k], target, sizeof(target));
+	}
 }
 
 // namespace midi
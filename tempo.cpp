@@ -0,0 +1,121 @@
+#include <midi/tempo.h>
+#include <algorithm>
+
+namespace midi {
+
+tempo_map::tempo_map(file f){
+	std::vector<track> trks;
+
+	for (unsigned i = 0; i < f.tracks(); i++) {
+		trks.push_back(f.get_track(i));
+	}
+
+	build(trks, f.division());
+}
+
+tempo_map::tempo_map(const std::vector<track> &trks, uint16_t division){
+	build(trks, division);
+}
+
+tempo_map::tempo_map(void){
+	tempos.push_back({0, 500000, 0});
+}
+
+void tempo_map::build(const std::vector<track> &trks, uint16_t division){
+	// default tempo of 120 bpm until the file says otherwise
+	tempos.push_back({0, 500000, 0});
+
+	for (track trk : trks) {
+		const uint8_t *end = trk.end();
+		uint32_t tick = 0;
+		uint8_t running = 0;
+
+		for (const uint8_t *ptr = trk.start(); ptr < end;) {
+			event ev(ptr, running);
+			uint32_t type = ev.type();
+
+			if (type == EVENT_UNKNOWN || type == EVENT_META_TRACK_END){
+				break;
+			}
+
+			if (ev.status < 0xf0){
+				running = ev.status;
+			}
+
+			tick += ev.delta_time().num;
+
+			if (type == EVENT_META_TEMPO){
+				uint32_t tempo = (ev.evdata[3] << 16) | (ev.evdata[4] << 8)
+				               | ev.evdata[5];
+
+				// a tempo of zero would stop the clock, the player
+				// skips those too
+				if (tempo > 0){
+					tempos.push_back({tick, tempo, 0});
+				}
+			}
+
+			ptr += ev.length(type);
+		}
+	}
+
+	std::stable_sort(tempos.begin(), tempos.end(),
+		[](const tempo_change_t &a, const tempo_change_t &b){
+			return a.tick < b.tick;
+		});
+
+	if (division & 0x8000){
+		// SMPTE frames per second and ticks per frame, which gives a
+		// constant tick length
+		int fps = -(int8_t)(division >> 8);
+		smpte_usecs = 1e6 / ((fps == 29? 29.97 : fps) * (division & 0xff));
+		return;
+	}
+
+	ticks_per_quarter = division? division : 1;
+
+	for (size_t i = 1; i < tempos.size(); i++) {
+		tempo_change_t &prev = tempos[i - 1];
+		tempos[i].usecs = prev.usecs + to_usecs(prev, tempos[i].tick - prev.tick);
+	}
+}
+
+void tempo_map::rewind(void){
+	current = 0;
+}
+
+uint64_t tempo_map::usecs(uint32_t tick){
+	if (smpte_usecs > 0){
+		return tick * smpte_usecs;
+	}
+
+	if (tick < tempos[current].tick){
+		current = 0;
+	}
+
+	while (current + 1 < tempos.size() && tempos[current + 1].tick <= tick) {
+		current++;
+	}
+
+	tempo_change_t &t = tempos[current];
+	return t.usecs + to_usecs(t, tick - t.tick);
+}
+
+size_t tempo_map::changes(void){
+	return tempos.size() - 1;
+}
+
+double tempo_map::tick_usecs(uint32_t usecs_per_quarter){
+	if (smpte_usecs > 0){
+		return smpte_usecs;
+	}
+
+	return (double)usecs_per_quarter / ticks_per_quarter;
+}
+
+uint64_t tempo_map::to_usecs(const tempo_change_t &t, uint32_t ticks){
+	return (uint64_t)ticks * t.usecs_per_quarter / ticks_per_quarter;
+}
+
+// namespace midi
+}
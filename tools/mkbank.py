@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+# Builds a sample bank for `midithing --bank=` from 16 bit .wav files and a
+# zone list, one zone per line:
+#
+#     program keys velocities root file.wav [loop=start:end] [tune=cents]
+#
+# keys and velocities are ranges like 0-127 or single values, loop points are
+# in frames from the start of the file. Stereo files are mixed down to mono.
+# See include/midi/samplebank.h for the layout.
+#
+#     tools/mkbank.py zones.txt out.bank
+
+import os
+import struct
+import sys
+import wave
+
+BANK_VERSION = 1
+BANK_ZONE_LOOP = 1
+HEADER = "<4sHHII"
+ZONE = "<BBBBBBbBIIIII"
+
+
+def span(text):
+    lo, _, hi = text.partition("-")
+    return int(lo), int(hi or lo)
+
+
+def load_wav(path):
+    with wave.open(path, "rb") as w:
+        if w.getsampwidth() != 2:
+            raise ValueError("%s: only 16 bit files are supported" % path)
+
+        channels = w.getnchannels()
+        data = w.readframes(w.getnframes())
+        rate = w.getframerate()
+
+    samples = struct.unpack("<%dh" % (len(data) // 2), data)
+
+    if channels > 1:
+        samples = [sum(samples[i:i + channels]) // channels
+                   for i in range(0, len(samples), channels)]
+
+    return rate, list(samples)
+
+
+def main(argv):
+    if len(argv) != 3:
+        print("usage: mkbank.py zones.txt out.bank")
+        return 2
+
+    zones = []
+    pcm = []
+    loaded = {}
+    base = os.path.dirname(argv[1])
+
+    with open(argv[1]) as f:
+        for line in f:
+            fields = line.split("#")[0].split()
+
+            if not fields:
+                continue
+
+            program = int(fields[0])
+            key_lo, key_hi = span(fields[1])
+            vel_lo, vel_hi = span(fields[2])
+            root = int(fields[3])
+            path = os.path.join(base, fields[4])
+            loop = None
+            tune = 0
+
+            for opt in fields[5:]:
+                name, _, value = opt.partition("=")
+
+                if name == "loop":
+                    loop = [int(x) for x in value.split(":")]
+                elif name == "tune":
+                    tune = int(value)
+                else:
+                    raise ValueError("unknown zone option " + opt)
+
+            # zones sharing a file share its data
+            if path not in loaded:
+                rate, samples = load_wav(path)
+                loaded[path] = (rate, len(pcm), len(samples))
+                pcm.extend(samples)
+
+            rate, start, frames = loaded[path]
+            flags = 0
+            loop_start = loop_end = start
+
+            if loop:
+                if not 0 <= loop[0] < loop[1] <= frames:
+                    raise ValueError("%s: loop outside the sample" % path)
+
+                flags = BANK_ZONE_LOOP
+                loop_start, loop_end = start + loop[0], start + loop[1]
+
+            zones.append((program, key_lo, key_hi, vel_lo, vel_hi, root,
+                          tune, flags, rate, start, start + frames,
+                          loop_start, loop_end))
+
+    # the player looks zones up by program, first match wins
+    zones.sort(key=lambda z: z[0])
+
+    offset = struct.calcsize(HEADER) + len(zones) * struct.calcsize(ZONE)
+
+    with open(argv[2], "wb") as out:
+        out.write(struct.pack(HEADER, b"MSBK", BANK_VERSION, len(zones),
+                              offset, len(pcm)))
+
+        for z in zones:
+            out.write(struct.pack(ZONE, *z))
+
+        out.write(struct.pack("<%dh" % len(pcm), *pcm))
+
+    print("%s: %d zones, %d frames" % (argv[2], len(zones), len(pcm)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,160 @@
+#include <midi/tracing.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <vector>
+
+namespace midi {
+
+bool trace_armed = false;
+
+typedef struct trace_ring {
+	std::vector<trace_record_t> records;
+	// total ever added, the ring holds the last TRACE_RING_RECORDS
+	uint64_t added;
+} trace_ring_t;
+
+static trace_ring_t rings[TRACE_MAX_THREADS];
+static std::atomic<unsigned> rings_claimed(0);
+static uint64_t trace_epoch;
+
+// no constructor, so taking one doesn't allocate on any thread
+static thread_local trace_ring_t *thread_ring = NULL;
+static thread_local bool thread_unclaimed = true;
+
+uint64_t trace_clock(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_start(void){
+	for (auto &x : rings) {
+		x.records.assign(TRACE_RING_RECORDS, trace_record_t());
+		x.added = 0;
+	}
+
+	rings_claimed = 0;
+	trace_epoch = trace_clock();
+	trace_armed = true;
+}
+
+void trace_add(const trace_record_t &rec){
+	if (thread_unclaimed){
+		unsigned n = rings_claimed++;
+
+		// past the last ring, this thread just isn't traced
+		thread_ring = (n < TRACE_MAX_THREADS)? &rings[n] : NULL;
+		thread_unclaimed = false;
+	}
+
+	if (!thread_ring){
+		return;
+	}
+
+	thread_ring->records[thread_ring->added % TRACE_RING_RECORDS] = rec;
+	thread_ring->added++;
+}
+
+void trace_instant(const char *name, const char *arg_name, int64_t arg){
+	trace_record_t rec = {name, {arg_name, NULL}, {arg, 0}, trace_clock(), 0, 'i'};
+	trace_add(rec);
+}
+
+void trace_counter(const char *name, int64_t value){
+	trace_record_t rec = {name, {name, NULL}, {value, 0}, trace_clock(), 0, 'C'};
+	trace_add(rec);
+}
+
+trace_scope::trace_scope(const char *name){
+	rec = {name, {NULL, NULL}, {0, 0}, trace_armed? trace_clock() : 0, 0, 'X'};
+}
+
+trace_scope::~trace_scope(){
+	if (trace_armed && rec.start){
+		rec.duration = trace_clock() - rec.start;
+		trace_add(rec);
+	}
+}
+
+void trace_scope::set_arg(const char *name, int64_t value){
+	unsigned i = rec.arg_names[0]? 1 : 0;
+
+	rec.arg_names[i] = name;
+	rec.args[i] = value;
+}
+
+// microseconds since trace_start(), which is what the format wants
+static double trace_usecs(uint64_t ns){
+	return (int64_t)(ns - trace_epoch) / 1e3;
+}
+
+static void write_record(FILE *fp, const trace_record_t &rec, unsigned tid){
+	fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+	        rec.name, rec.phase, tid, trace_usecs(rec.start));
+
+	if (rec.phase == 'X'){
+		fprintf(fp, ",\"dur\":%.3f", rec.duration / 1e3);
+
+	} else if (rec.phase == 'i'){
+		fputs(",\"s\":\"t\"", fp);
+	}
+
+	if (rec.arg_names[0]){
+		fprintf(fp, ",\"args\":{\"%s\":%lld", rec.arg_names[0], (long long)rec.args[0]);
+
+		if (rec.arg_names[1]){
+			fprintf(fp, ",\"%s\":%lld", rec.arg_names[1], (long long)rec.args[1]);
+		}
+
+		fputc('}', fp);
+	}
+
+	fputc('}', fp);
+}
+
+void trace_write(const char *path){
+	trace_armed = false;
+
+	FILE *fp = fopen(path, "w");
+
+	if (!fp){
+		throw "could not open trace file for writing";
+	}
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+	      "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+	      "\"args\":{\"name\":\"midithing\"}}", fp);
+
+	unsigned claimed = rings_claimed;
+	claimed = (claimed < TRACE_MAX_THREADS)? claimed : TRACE_MAX_THREADS;
+
+	for (unsigned t = 0; t < claimed; t++) {
+		trace_ring_t &ring = rings[t];
+		uint64_t first = (ring.added > TRACE_RING_RECORDS)?
+		                 ring.added - TRACE_RING_RECORDS : 0;
+
+		fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		            "\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}", t, t);
+
+		for (uint64_t i = first; i < ring.added; i++) {
+			write_record(fp, ring.records[i % TRACE_RING_RECORDS], t);
+		}
+	}
+
+	fputs("\n]}\n", fp);
+
+	if (fclose(fp) != 0){
+		throw "could not write trace file";
+	}
+
+	for (auto &x : rings) {
+		std::vector<trace_record_t>().swap(x.records);
+	}
+}
+
+// namespace midi
+}
@@ -0,0 +1,80 @@
+#include <midi/transport.h>
+
+namespace midi {
+
+bool transport::send(unsigned type, unsigned channel, uint64_t position, double value){
+	transport_command_t cmd = {type, channel, position, value};
+
+	return queue.push(cmd);
+}
+
+bool transport::play(void){
+	return send(TRANSPORT_PLAY, 0, 0, 0);
+}
+
+bool transport::pause(void){
+	return send(TRANSPORT_PAUSE, 0, 0, 0);
+}
+
+bool transport::stop(void){
+	return send(TRANSPORT_STOP, 0, 0, 0);
+}
+
+bool transport::seek(uint64_t usecs){
+	return send(TRANSPORT_SEEK, 0, usecs, 0);
+}
+
+bool transport::set_tempo_scale(double scale){
+	if (scale <= 0){
+		return false;
+	}
+
+	return send(TRANSPORT_TEMPO_SCALE, 0, 0, scale);
+}
+
+bool transport::mute(unsigned channel, bool muted){
+	if (channel >= 16){
+		return false;
+	}
+
+	return send(TRANSPORT_MUTE, channel, 0, muted);
+}
+
+unsigned transport::state(void){
+	return cur_state.load(std::memory_order_acquire);
+}
+
+uint64_t transport::position(void){
+	return cur_position.load(std::memory_order_relaxed);
+}
+
+double transport::tempo_scale(void){
+	return cur_scale.load(std::memory_order_relaxed);
+}
+
+uint16_t transport::mute_mask(void){
+	return cur_mutes.load(std::memory_order_relaxed);
+}
+
+bool transport::next_command(transport_command_t &cmd){
+	return queue.pop(cmd);
+}
+
+void transport::publish_state(unsigned state){
+	cur_state.store(state, std::memory_order_release);
+}
+
+void transport::publish_position(uint64_t usecs){
+	cur_position.store(usecs, std::memory_order_relaxed);
+}
+
+void transport::publish_tempo_scale(double scale){
+	cur_scale.store(scale, std::memory_order_relaxed);
+}
+
+void transport::publish_mute_mask(uint16_t mask){
+	cur_mutes.store(mask, std::memory_order_relaxed);
+}
+
+// namespace midi
+}
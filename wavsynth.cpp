@@ -1,14 +1,11 @@
 #include <midi/wavsynth.h>
+#include <midi/tracing.h>
 #include <string.h>
 #include <stdio.h>
 
 namespace midi {
 
-void wavsynth::write_header(void){
-	wav_header_t header;
-	// TODO: change this once stereo is implemented
-	unsigned channels = 1;
-
+void wav_header(wav_header_t &header, uint32_t rate, unsigned channels, size_t frames){
 	// set chunk strings
 	memcpy(&header.id, "RIFF", 4);
 	memcpy(&header.wave.id, "WAVE", 4);
@@ -19,54 +16,85 @@ void wavsynth::write_header(void){
 	header.wave.chunk_size = 16;
 	header.wave.format = WAVE_FORMAT_PCM;
 	header.wave.channels = channels;
-	header.wave.samples_per_sec = sample_rate;
-	header.wave.bytes_per_sec = sample_rate * 2 * channels;
+	header.wave.samples_per_sec = rate;
+	header.wave.bytes_per_sec = rate * 2 * channels;
 	header.wave.block_align = 2 * channels;
 	header.wave.bits_per_sample = 16;
 
 	// set values in data chunk
-	header.pcm.size = 2 * samples * channels;
+	header.pcm.size = 2 * frames * channels;
 
 	// set size of the top-level header
-	header.size = 36 + header.pcm.size + (samples % 2);
+	header.size = 36 + header.pcm.size + (header.pcm.size % 2);
+}
 
+void wavsynth::write_header(void){
+	wav_header_t header;
+
+	wav_header(header, sample_rate, SYNTH_CHANNELS, samples);
 	fwrite(&header, sizeof(header), 1, fp);
 }
 
 wavsynth::wavsynth(player *play, uint32_t rate, std::string outfile)
 	: synth(play, rate)
 {
+	open(outfile);
+}
+
+wavsynth::wavsynth(player *play, uint32_t rate)
+	: synth(play, rate) { }
+
+wavsynth::~wavsynth(){
+	close();
+}
+
+void wavsynth::open(std::string outfile, bool raw_output){
+	close();
+
 	samples = 0;
+	raw = raw_output;
 	fp = fopen(outfile.c_str(), "w");
 
 	if (!fp) {
-		throw "could not open " + outfile + " for writing";
+		throw "could not open output file for writing";
 	}
 
-	// write a stub header which will be overwritten once all the samples
-	// have been written
-	write_header();
+	if (!raw){
+		// write a stub header which will be overwritten once all the
+		// samples have been written
+		write_header();
+	}
 }
 
-wavsynth::~wavsynth(){
-	// padding byte if the number of samples is odd
-	if (samples % 2){
-		uint8_t x = 0;
-		fwrite(&x, 1, 1, fp);
+size_t wavsynth::close(void){
+	if (!fp){
+		return 0;
+	}
+
+	if (!raw){
+		fseek(fp, 0, SEEK_SET);
+		write_header();
 	}
 
-	fseek(fp, 0, SEEK_SET);
-	write_header();
 	fclose(fp);
+	fp = NULL;
+
+	return samples;
 }
 
-void wavsynth::wait(uint32_t usecs){
-	uint32_t num = sample_rate * (usecs / 1000000.0);
+void wavsynth::output(uint32_t frames){
+	while (frames > 0){
+		unsigned n = (frames >= SYNTH_BLOCK_SIZE)? SYNTH_BLOCK_SIZE : frames;
+		frames -= n;
+
+		render(buffer, n);
+
+		{
+			TRACE_SCOPE("fwrite");
+			fwrite(buffer, 2 * SYNTH_CHANNELS, n, fp);
+		}
 
-	for (uint32_t i = 0; i < num; i++) {
-		int16_t sample = next_sample();
-		fwrite(&sample, 2, 1, fp);
-		samples++;
+		samples += n;
 	}
 }
 